@@ -0,0 +1,255 @@
+// emu-minimal-aot: recompile the code in a flash image to a C++ program
+// with one function per basic block.  Code is found by following control
+// flow from reset; anything it can't see statically, like code in RAM or
+// reached only through JPR or RTS, runs on the interpreter instead.
+#include "minimal.h"
+
+struct Recompiler
+{
+    const FlashImage& image;
+    // translation-cache keys of the instructions found, and of block starts
+    std::vector<uint8_t> decoded;
+    std::set<uint32_t> leaders;
+    std::vector<uint32_t> pending;
+
+    Recompiler(const FlashImage& image_) :
+        image(image_),
+        decoded(TranslationCache::Keys, 0)
+    {}
+
+    uint8_t byte(uint32_t key) const
+    {
+        return image.data[key];
+    }
+
+    uint16_t word(uint32_t key) const
+    {
+        return u16from2xu8(byte(key + 1), byte(key));
+    }
+
+    // Only flash code is compiled; flash only changes through the chip's
+    // programming commands, which send its bank back to the interpreter
+    void addLeader(uint32_t bank, uint16_t address)
+    {
+        if(address >= 0x8000) {
+            return;
+        }
+        uint32_t key = TranslationCache::Key(bank, address);
+        if(leaders.insert(key).second) {
+            pending.push_back(key);
+        }
+    }
+
+    // Bytes the instruction at key takes, or 0 if it runs out of its bank
+    int length(uint32_t key) const
+    {
+        uint8_t instruction = byte(key) & 0x3F;
+        // JPS reads its operand itself, but it's still part of the instruction
+        int bytes = 1 + ((instruction == OpJPS) ? 2 : GetOperandBytes(instruction));
+        return (((key & 0x7FFF) + bytes) <= 0x8000) ? bytes : 0;
+    }
+
+    // Follow everything reachable from the leaders found so far
+    void explore()
+    {
+        while(!pending.empty()) {
+            uint32_t key = pending.back();
+            pending.pop_back();
+            uint32_t bank = key >> 15;
+            while(!decoded[key]) {
+                int bytes = length(key);
+                if(bytes == 0) {
+                    break;
+                }
+                decoded[key] = 1;
+                uint8_t instruction = byte(key) & 0x3F;
+                uint16_t next = (key & 0x7FFF) + bytes;
+                if(instruction >= OpBNE) {
+                    addLeader(bank, word(key + 1));
+                    addLeader(bank, next);
+                } else if(instruction == OpJPA) {
+                    addLeader(bank, word(key + 1));
+                } else if(instruction == OpJPS) {
+                    addLeader(bank, word(key + 1));
+                    // RTS comes back past the operand
+                    addLeader(bank, next);
+                } else if(instruction == OpBNK) {
+                    // whichever bank A selects carries on from here
+                    for(uint32_t b = 0; b < 16; b++) {
+                        addLeader(b, next);
+                    }
+                }
+                if(EndsBasicBlock(instruction) || (next >= 0x8000)) {
+                    break;
+                }
+                key = TranslationCache::Key(bank, next);
+            }
+        }
+    }
+
+    static std::string BlockName(uint32_t key)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "Block_%u_%04X", key >> 15, key & 0x7FFF);
+        return name;
+    }
+
+    static std::string OpcodeName(uint8_t instruction)
+    {
+        std::string name = "Op" + InstructionToMnemonic[instruction];
+        std::transform(name.begin() + 2, name.end(), name.begin() + 2, ::toupper);
+        return name;
+    }
+
+    // Write the block at key, running up to the next leader or the end
+    // of straight-line code; returns the instructions in it
+    size_t writeBlock(FILE *fp, uint32_t key)
+    {
+        fprintf(fp, "static void %s(CPU& cpu, Memory& memory, Interface& interface, uint64_t& clock, uint64_t limit)\n", BlockName(key).c_str());
+        fprintf(fp, "{\n");
+        fprintf(fp, "    const uint64_t len = cpu.cpuClockLengthInSystemClocks;\n");
+        uint32_t bank = key >> 15;
+        size_t count = 0;
+        while(true) {
+            int bytes = length(key);
+            if(bytes == 0) {
+                break;
+            }
+            uint8_t instruction = byte(key) & 0x3F;
+            int operandBytes = GetOperandBytes(instruction);
+            uint16_t operand = (operandBytes == 2) ? word(key + 1) : (operandBytes == 1) ? byte(key + 1) : 0;
+            uint16_t next = (key & 0x7FFF) + bytes;
+            if(count > 0) {
+                fprintf(fp, "    if(clock > limit) return;\n");
+            }
+            fprintf(fp, "    // %04X %s", key & 0x7FFF, InstructionToMnemonic[instruction].c_str());
+            if((instruction == OpJPS) || (operandBytes == 2)) {
+                fprintf(fp, " 0x%04X", (instruction == OpJPS) ? word(key + 1) : operand);
+            } else if(operandBytes == 1) {
+                fprintf(fp, " 0x%02X", operand);
+            }
+            fprintf(fp, "\n");
+            // JPS fetches its own operand, so PC is left on it
+            fprintf(fp, "    cpu.PC = 0x%04X;\n", (key & 0x7FFF) + 1 + operandBytes);
+            fprintf(fp, "    clock += cpu.execute(memory, interface, %s, 0x%04X) * len;\n", OpcodeName(instruction).c_str(), operand);
+            fprintf(fp, "    cpu.instructions++;\n");
+            count++;
+            if(EndsBasicBlock(instruction) || (next >= 0x8000)) {
+                break;
+            }
+            key = TranslationCache::Key(bank, next);
+            if(leaders.count(key)) {
+                break;
+            }
+        }
+        fprintf(fp, "}\n\n");
+        return count;
+    }
+
+    void write(FILE *fp, const std::string& source)
+    {
+        fprintf(fp, "// Generated by emu-minimal-aot from %s; do not edit.\n", source.c_str());
+        fprintf(fp, "// Build with the emulator's directory on the include path.\n");
+        fprintf(fp, "#include \"minimal.h\"\n\n");
+        fprintf(fp, "typedef MinimalEmulator<Memory, Interface> CPU;\n\n");
+        fprintf(fp, "constexpr uint64_t FlashHash = 0x%016llXull;\n\n", (unsigned long long)HashBytes(image.data, FlashSize));
+        size_t instructions = 0;
+        for(uint32_t key : leaders) {
+            instructions += writeBlock(fp, key);
+        }
+        fprintf(fp, "static const std::vector<std::pair<uint32_t, CPU::CompiledBlock>> CompiledBlocks =\n{\n");
+        for(uint32_t key : leaders) {
+            fprintf(fp, "    { 0x%05X, %s },\n", key, BlockName(key).c_str());
+        }
+        fprintf(fp, "};\n\n");
+        fprintf(fp, "int main(int argc, char **argv)\n");
+        fprintf(fp, "{\n");
+        fprintf(fp, "    if(argc != 2) {\n");
+        fprintf(fp, "        fprintf(stderr, \"usage: %%s flash.bin\\n\", argv[0]);\n");
+        fprintf(fp, "        exit(EXIT_FAILURE);\n");
+        fprintf(fp, "    }\n");
+        fprintf(fp, "    Clock systemClock(SystemClockRate);\n");
+        fprintf(fp, "    Interface interface(systemClock);\n");
+        fprintf(fp, "    auto image = std::make_shared<const FlashImage>(argv[1]);\n");
+        fprintf(fp, "    if(HashBytes(image->data, FlashSize) != FlashHash) {\n");
+        fprintf(fp, "        fprintf(stderr, \"%%s isn't the flash image this program was compiled from\\n\", argv[1]);\n");
+        fprintf(fp, "        exit(EXIT_FAILURE);\n");
+        fprintf(fp, "    }\n");
+        fprintf(fp, "    static Memory memory(image);\n");
+        fprintf(fp, "    CPU minimal(CPUClockRate, systemClock);\n");
+        fprintf(fp, "    minimal.enableCompiledBlocks(CompiledBlocks);\n");
+        fprintf(fp, "    RunEmulator(minimal, memory, interface, systemClock);\n");
+        fprintf(fp, "}\n");
+        fprintf(stderr, "%zu blocks, %zu instructions\n", leaders.size(), instructions);
+    }
+};
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [options] flash.bin output.cpp\n", name);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "\t--entry BANK:ADDRESS - also compile code reached from ADDRESS (hex) in BANK,\n");
+    fprintf(stderr, "\t                       like targets of JPR or RTS tables; may be repeated\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *progname = argv[0];
+    argc -= 1;
+    argv += 1;
+
+    std::vector<std::pair<uint32_t, uint16_t>> entries = {{0, 0}};
+
+    while((argc > 0) && (argv[0][0] == '-')) {
+        if(
+            (strcmp(argv[0], "-help") == 0) ||
+            (strcmp(argv[0], "-h") == 0) ||
+            (strcmp(argv[0], "-?") == 0))
+        {
+            usage(progname);
+            exit(EXIT_SUCCESS);
+        } else if(strcmp(argv[0], "--entry") == 0) {
+            unsigned int bank, address;
+            if((argc < 2) || (sscanf(argv[1], "%u:%x", &bank, &address) != 2) || (bank > 15) || (address > 0x7FFF)) {
+                fprintf(stderr, "--entry requires BANK:ADDRESS in flash\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            entries.push_back({bank, address});
+            argc -= 2;
+            argv += 2;
+        } else {
+            fprintf(stderr, "unknown parameter \"%s\"\n", argv[0]);
+            usage(progname);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(argc != 2) {
+        usage(progname);
+        exit(EXIT_FAILURE);
+    }
+
+    std::string flash_file = argv[0];
+    std::unique_ptr<FlashImage> image;
+    try {
+        image = std::make_unique<FlashImage>(flash_file);
+    } catch(const std::string& error) {
+        fprintf(stderr, "%s\n", error.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    Recompiler recompiler(*image);
+    for(auto [bank, address] : entries) {
+        recompiler.addLeader(bank, address);
+    }
+    recompiler.explore();
+
+    FILE *fp = fopen(argv[1], "w");
+    if(!fp) {
+        fprintf(stderr, "couldn't open %s\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    recompiler.write(fp, flash_file);
+    fclose(fp);
+}
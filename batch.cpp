@@ -0,0 +1,428 @@
+// emu-minimal-batch: run a manifest of jobs, each on its own instruction-level
+// machine, across every core, and report the results as JSON.
+//
+// A manifest has one job per line, blank lines and lines starting with #
+// ignored:
+//
+//     NAME FLASH CYCLES INPUT EXPECTED
+//
+// FLASH is a flash image, relative to the manifest's directory; CYCLES the
+// most system clocks to run; INPUT what to queue on the UART and EXPECTED
+// what the UART has to print for the job to pass, each either - for none,
+// @FILE for a file's contents or a double-quoted string with C escapes.
+// A job with expected output stops as soon as it has printed it.
+#include "minimal.h"
+
+#include <deque>
+#include <mutex>
+#include <thread>
+
+struct Job
+{
+    std::string name;
+    std::string flash_file;
+    clk_t cycles = 0;
+    std::vector<uint8_t> input;
+    bool checked = false;
+    std::vector<uint8_t> expected;
+
+    // results
+    std::vector<uint8_t> output;
+    bool passed = false;
+    bool stopped = false;
+    clk_t ran = 0;
+    uint64_t instructions = 0;
+    double seconds = 0;
+};
+
+std::vector<uint8_t> ReadFile(const std::string& file)
+{
+    FILE *fp = fopen(file.c_str(), "rb");
+    if(!fp) {
+        throw "couldn't open " + file;
+    }
+    std::vector<uint8_t> bytes;
+    uint8_t buffer[65536];
+    size_t size;
+    while((size = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        bytes.insert(bytes.end(), buffer, buffer + size);
+    }
+    fclose(fp);
+    return bytes;
+}
+
+// Splits manifest lines into fields, keeping quoted strings whole
+struct ManifestLine
+{
+    const std::string& line;
+    size_t position = 0;
+
+    ManifestLine(const std::string& line_) :
+        line(line_)
+    {}
+
+    bool field(std::string& text)
+    {
+        while((position < line.size()) && isspace((unsigned char)line[position])) {
+            position++;
+        }
+        if(position >= line.size()) {
+            return false;
+        }
+        size_t start = position;
+        if(line[position] == '"') {
+            position++;
+            while((position < line.size()) && (line[position] != '"')) {
+                position += (line[position] == '\\') ? 2 : 1;
+            }
+            if(position >= line.size()) {
+                throw std::string("unterminated string");
+            }
+            position++;
+        } else {
+            while((position < line.size()) && !isspace((unsigned char)line[position])) {
+                position++;
+            }
+        }
+        text = line.substr(start, position - start);
+        return true;
+    }
+
+    // -, @FILE or a quoted string, as bytes
+    static std::vector<uint8_t> Bytes(const std::string& text, const std::string& directory)
+    {
+        std::vector<uint8_t> bytes;
+        if(text == "-") {
+            return bytes;
+        }
+        if(text[0] == '@') {
+            return ReadFile(directory + text.substr(1));
+        }
+        if(text[0] != '"') {
+            throw "expected -, @FILE or a quoted string, not " + text;
+        }
+        for(size_t i = 1; i < text.size() - 1; i++) {
+            if(text[i] != '\\') {
+                bytes.push_back(text[i]);
+                continue;
+            }
+            char c = text[++i];
+            switch(c) {
+                case 'n': bytes.push_back('\n'); break;
+                case 'r': bytes.push_back('\r'); break;
+                case 't': bytes.push_back('\t'); break;
+                case '0': bytes.push_back('\0'); break;
+                case 'x': {
+                    unsigned int value;
+                    if((i + 2 >= text.size() - 1) || (sscanf(text.substr(i + 1, 2).c_str(), "%2x", &value) != 1)) {
+                        throw std::string("\\x needs two hex digits");
+                    }
+                    bytes.push_back(value);
+                    i += 2;
+                    break;
+                }
+                default: bytes.push_back(c); break;
+            }
+        }
+        return bytes;
+    }
+};
+
+std::vector<Job> ReadManifest(const std::string& manifest_file)
+{
+    std::vector<uint8_t> contents = ReadFile(manifest_file);
+    size_t slash = manifest_file.rfind('/');
+    std::string directory = (slash == std::string::npos) ? "" : manifest_file.substr(0, slash + 1);
+
+    std::vector<Job> jobs;
+    std::string text(contents.begin(), contents.end());
+    size_t start = 0;
+    for(int number = 1; start < text.size(); number++) {
+        size_t end = text.find('\n', start);
+        if(end == std::string::npos) {
+            end = text.size();
+        }
+        std::string line = text.substr(start, end - start);
+        start = end + 1;
+        try {
+            ManifestLine fields(line);
+            std::string name, flash, cycles, input, expected, extra;
+            if(!fields.field(name) || (name[0] == '#')) {
+                continue;
+            }
+            if(!fields.field(flash) || !fields.field(cycles) || !fields.field(input) || !fields.field(expected) || fields.field(extra)) {
+                throw std::string("expected NAME FLASH CYCLES INPUT EXPECTED");
+            }
+            Job job;
+            job.name = name;
+            job.flash_file = (flash[0] == '/') ? flash : directory + flash;
+            char *last = nullptr;
+            job.cycles = strtoull(cycles.c_str(), &last, 0);
+            if((*last != '\0') || (job.cycles == 0)) {
+                throw "bad cycle count " + cycles;
+            }
+            job.input = ManifestLine::Bytes(input, directory);
+            job.checked = (expected != "-");
+            job.expected = ManifestLine::Bytes(expected, directory);
+            jobs.push_back(std::move(job));
+        } catch(const std::string& error) {
+            throw manifest_file + ":" + std::to_string(number) + ": " + error;
+        }
+    }
+    return jobs;
+}
+
+// Run job on a machine of its own, stopping at its cycle limit or once it
+// has printed what it should
+void RunJob(Job& job, std::shared_ptr<const FlashImage> image, const std::string& engine)
+{
+    auto then = std::chrono::steady_clock::now();
+    Clock systemClock(SystemClockRate);
+    Interface interface(systemClock);
+    auto memory = std::make_unique<Memory>(std::move(image));
+    MinimalEmulator<Memory, Interface> cpu(CPUClockRate, systemClock);
+    if(engine == "translated") {
+        cpu.enableTranslationCache();
+    } else if(engine == "fused") {
+        cpu.enableFusion();
+    } else if(engine == "jit") {
+#if EMU_JIT
+        cpu.enableJit();
+#else
+        cpu.enableTranslationCache();
+#endif
+    }
+    for(uint8_t byte : job.input) {
+        interface.inputBuffer.push(byte);
+    }
+    interface.capture = &job.output;
+
+    auto printed = [&]() {
+        return job.checked && (std::search(job.output.begin(), job.output.end(), job.expected.begin(), job.expected.end()) != job.output.end());
+    };
+    // check for the expected output every hundredth of an emulated second
+    clk_t chunk = systemClock.rate / 100;
+    while(!job.stopped && (systemClock.clocks < job.cycles) && !printed()) {
+        job.stopped = !RunUntil(cpu, *memory, interface, systemClock, std::min(job.cycles, systemClock.clocks + chunk));
+    }
+    job.passed = !job.checked || printed();
+    job.ran = systemClock.clocks;
+    job.instructions = cpu.instructions;
+    job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - then).count();
+}
+
+// A pool of threads each taking jobs from the back of its own queue, and
+// when that's empty stealing from the front of another's.  Jobs never make
+// more jobs, so a thread is done when every queue is empty.
+struct WorkStealingPool
+{
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<size_t> jobs;
+    };
+    std::vector<Queue> queues;
+
+    WorkStealingPool(size_t threads, size_t jobs) :
+        queues(threads)
+    {
+        // dealt out in turn, so long and short jobs next to each other in
+        // a manifest end up on different threads
+        for(size_t job = 0; job < jobs; job++) {
+            queues[job % threads].jobs.push_back(job);
+        }
+    }
+
+    bool take(size_t self, size_t& job)
+    {
+        {
+            std::lock_guard<std::mutex> guard(queues[self].lock);
+            if(!queues[self].jobs.empty()) {
+                job = queues[self].jobs.back();
+                queues[self].jobs.pop_back();
+                return true;
+            }
+        }
+        for(size_t i = 1; i < queues.size(); i++) {
+            Queue& victim = queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if(!victim.jobs.empty()) {
+                job = victim.jobs.front();
+                victim.jobs.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(const std::function<void(size_t)>& work)
+    {
+        std::vector<std::thread> threads;
+        for(size_t self = 0; self < queues.size(); self++) {
+            threads.emplace_back([this, self, &work]() {
+                size_t job;
+                while(take(self, job)) {
+                    work(job);
+                }
+            });
+        }
+        for(auto& thread : threads) {
+            thread.join();
+        }
+    }
+};
+
+void WriteJSONString(FILE *fp, const std::string& text)
+{
+    fputc('"', fp);
+    for(unsigned char c : text) {
+        switch(c) {
+            case '"': fputs("\\\"", fp); break;
+            case '\\': fputs("\\\\", fp); break;
+            case '\n': fputs("\\n", fp); break;
+            case '\r': fputs("\\r", fp); break;
+            case '\t': fputs("\\t", fp); break;
+            default:
+                // output is bytes, not UTF-8, so anything past ASCII is escaped too
+                if((c < 0x20) || (c >= 0x7F)) {
+                    fprintf(fp, "\\u%04x", c);
+                } else {
+                    fputc(c, fp);
+                }
+                break;
+        }
+    }
+    fputc('"', fp);
+}
+
+void WriteResults(FILE *fp, const std::vector<Job>& jobs, double seconds, size_t threads)
+{
+    size_t passed = std::count_if(jobs.begin(), jobs.end(), [](const Job& job) { return job.passed; });
+    fprintf(fp, "{\n  \"threads\": %zu,\n  \"wall_seconds\": %.6f,\n  \"passed\": %zu,\n  \"failed\": %zu,\n  \"jobs\": [\n",
+        threads, seconds, passed, jobs.size() - passed);
+    for(size_t i = 0; i < jobs.size(); i++) {
+        const Job& job = jobs[i];
+        fprintf(fp, "    {\"name\": ");
+        WriteJSONString(fp, job.name);
+        fprintf(fp, ", \"flash\": ");
+        WriteJSONString(fp, job.flash_file);
+        fprintf(fp, ", \"passed\": %s, \"checked\": %s, \"stopped\": %s, \"cycles\": %llu, \"instructions\": %llu, \"wall_seconds\": %.6f, \"output\": ",
+            job.passed ? "true" : "false", job.checked ? "true" : "false", job.stopped ? "true" : "false",
+            (unsigned long long)job.ran, (unsigned long long)job.instructions, job.seconds);
+        WriteJSONString(fp, std::string(job.output.begin(), job.output.end()));
+        fprintf(fp, "}%s\n", (i + 1 < jobs.size()) ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [options] manifest\n", name);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "\t--threads N        - run N jobs at once (default: one per core)\n");
+    fprintf(stderr, "\t--engine NAME      - instruction (default), translated, fused or jit\n");
+    fprintf(stderr, "\t--output FILE      - write the JSON results to FILE instead of stdout\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *progname = argv[0];
+    argc -= 1;
+    argv += 1;
+
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string engine = "instruction";
+    std::string output_file;
+
+    while((argc > 0) && (argv[0][0] == '-')) {
+        if(
+            (strcmp(argv[0], "-help") == 0) ||
+            (strcmp(argv[0], "-h") == 0) ||
+            (strcmp(argv[0], "-?") == 0))
+        {
+            usage(progname);
+            exit(EXIT_SUCCESS);
+        } else if(strcmp(argv[0], "--threads") == 0) {
+            if((argc < 2) || (atoi(argv[1]) <= 0)) {
+                fprintf(stderr, "--threads requires a number of threads\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            threads = atoi(argv[1]);
+            argc -= 2;
+            argv += 2;
+        } else if(strcmp(argv[0], "--engine") == 0) {
+            if((argc < 2) || ((strcmp(argv[1], "instruction") != 0) && (strcmp(argv[1], "translated") != 0) && (strcmp(argv[1], "fused") != 0) && (strcmp(argv[1], "jit") != 0))) {
+                fprintf(stderr, "--engine requires instruction, translated, fused or jit\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            engine = argv[1];
+            argc -= 2;
+            argv += 2;
+        } else if(strcmp(argv[0], "--output") == 0) {
+            if(argc < 2) {
+                fprintf(stderr, "--output requires a file name\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            output_file = argv[1];
+            argc -= 2;
+            argv += 2;
+        } else {
+            fprintf(stderr, "unknown parameter \"%s\"\n", argv[0]);
+            usage(progname);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(argc != 1) {
+        usage(progname);
+        exit(EXIT_FAILURE);
+    }
+
+    // Each image is loaded once and shared by every job that runs it
+    std::vector<Job> jobs;
+    std::map<std::string, std::shared_ptr<const FlashImage>> images;
+    try {
+        jobs = ReadManifest(argv[0]);
+        for(const auto& job : jobs) {
+            if(!images.count(job.flash_file)) {
+                images[job.flash_file] = std::make_shared<const FlashImage>(job.flash_file);
+            }
+        }
+    } catch(const std::string& error) {
+        fprintf(stderr, "%s\n", error.c_str());
+        exit(EXIT_FAILURE);
+    }
+    threads = std::min(threads, std::max<size_t>(jobs.size(), 1));
+
+    // Machines intern their trace names as they're made; doing it once here
+    // means the threads only ever look the names up
+    {
+        Clock clock(SystemClockRate);
+        Interface interface(clock);
+        Memory memory;
+    }
+
+    auto then = std::chrono::steady_clock::now();
+    WorkStealingPool pool(threads, jobs.size());
+    pool.run([&](size_t job) {
+        RunJob(jobs[job], images.at(jobs[job].flash_file), engine);
+    });
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - then).count();
+
+    FILE *fp = output_file.empty() ? stdout : fopen(output_file.c_str(), "w");
+    if(!fp) {
+        fprintf(stderr, "couldn't open %s\n", output_file.c_str());
+        exit(EXIT_FAILURE);
+    }
+    WriteResults(fp, jobs, seconds, threads);
+    if(fp != stdout) {
+        fclose(fp);
+    }
+
+    size_t failed = std::count_if(jobs.begin(), jobs.end(), [](const Job& job) { return !job.passed; });
+    fprintf(stderr, "%zu jobs, %zu failed, %.3f seconds on %zu threads\n", jobs.size(), failed, seconds, threads);
+    exit((failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
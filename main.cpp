@@ -1,326 +1,242 @@
-#include <algorithm>
-#include <map>
-#include <string>
-#include <queue>
-#include <array>
-#include <vector>
-#include <cstdio>
-#include <cstdint>
-#include <cstdlib>
-#include <cassert>
-#include <cstring>
-#include <chrono>
+#include "minimal.h"
 
 #include <MiniFB.h>
 
+// The fork server needs fork() and Unix domain sockets
+#ifndef EMU_FORK_SERVER
+#if defined(__unix__) || defined(__APPLE__)
+#define EMU_FORK_SERVER 1
+#else
+#define EMU_FORK_SERVER 0
+#endif
+#endif
+#if EMU_FORK_SERVER
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
 constexpr bool debug = true;
+
+// Build with EMU_VIRTUAL_BLOCKS=1 to have the gate-level System evaluate its
+// blocks through Block::Evaluate() instead of as one composed sweep
+#ifndef EMU_VIRTUAL_BLOCKS
+#define EMU_VIRTUAL_BLOCKS 0
+#endif
 constexpr int QuiescentEvaluateMaxCycles = 10;
-constexpr uint64_t SystemClockRate = 3686400;
-constexpr uint64_t CPUClockRate = 3686400;
-
-constexpr size_t FlashSize = 512 * 1024;
-constexpr size_t RAMSize = 32 * 1024;
-
-constexpr uint32_t AI   = 0x0001; // latch bus into A
-constexpr uint32_t AO   = 0x0002; // enable output from A
-constexpr uint32_t BI   = 0x0004; // latch bus into B
-constexpr uint32_t BO   = 0x0008; // enable output from B
-constexpr uint32_t CI   = 0x0010; // latch bus into program counter low or high byte
-constexpr uint32_t CO   = 0x0020; // enable output from program counter low or high byte
-constexpr uint32_t EC   = 0x0040; // enable carry, also latch into BANK register if HI
-constexpr uint32_t ES   = 0x0080; // negate B input to ALU
-constexpr uint32_t CEME = 0x0100; // represents both CE/chipenable and ME/memoryenable
-constexpr uint32_t EOFI = 0x0200; // represents both EO/accumulator-buffer-output-enable and FI/latch-flags-from-buffer
-constexpr uint32_t HI   = 0x0400; // whether I/O is for low or high byte
-constexpr uint32_t IC   = 0x0800; // reset microcode step register
-constexpr uint32_t MI   = 0x1000; // latch bus into memory address low or high byte register (MAH,MAL)
-constexpr uint32_t RI   = 0x2000; // latch bus into memory data  (RAM or ROM/Flash) using MAH,MAL,BANK registers
-constexpr uint32_t RO   = 0x4000; // enable output from memory data using MAH,MAL,BANK registers
-constexpr uint32_t TR   = 0x8000; // I/O transfer in and out depending on HI
-
-/*
-------------------------------------------------------------------------------
-MIT License
-Copyright (c) 2021 Carsten Herting
-------------------------------------------------------------------------------
-Permission is hereby granted, free of charge, to any person obtaining a copy of
-this software and associated documentation files (the "Software"), to deal in
-the Software without restriction, including without limitation the rights to
-use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
-of the Software, and to permit persons to whom the Software is furnished to do
-so, subject to the following conditions:
-The above copyright notice and this permission notice shall be included in all
-copies or substantial portions of the Software.
-THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
-IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
-FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
-AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
-LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
-OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
-SOFTWARE.
-------------------------------------------------------------------------------
-*/
-
-// XXX grantham - changed Out to OUT
-
-// MINIMAL CPU SYSTEM - MICROCODE VERSION 1.5 written by Carsten Herting 17.04.2021
-// Use for board revisions 1.3 and higher.
-
-#define NOP     CO|MI, CO|MI|HI, RO|HI|CEME, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define BNK     CO|MI, CO|MI|HI, RO|HI|CEME, AO|EC|HI, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define OUT     CO|MI, CO|MI|HI, RO|HI|CEME, AO|TR|HI, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define CLC     CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI, EOFI|ES,        IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define SEC     CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI, EOFI|ES|EC,     IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define LSL     CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI,  EOFI|AI,       IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define ROL0    CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI,  EOFI|AI,       IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define ROL1    CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI,  EOFI|AI|EC,    IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define LSR0    CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI,  EOFI|ES,       EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    IC, 0, 0
-#define LSR1    CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI,  EOFI|ES,       EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, IC, 0, 0
-#define ROR0    CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI,  EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    IC,            0,  0, 0
-#define ROR1    CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI,  EOFI|AI|BI|EC, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, IC,            0,  0, 0
-#define ASR00x  CO|MI, CO|MI|HI, RO|HI|CEME, BI, EOFI|EC, AO|BI,    EOFI|ES,       EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    IC
-#define ASR01x  CO|MI, CO|MI|HI, RO|HI|CEME, BI, EOFI|EC, AO|BI,    EOFI|ES,       EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, IC
-#define ASR10x  CO|MI, CO|MI|HI, RO|HI|CEME, BI, EOFI|EC, AO|BI,    EOFI|ES|EC,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    IC
-#define ASR11x  CO|MI, CO|MI|HI, RO|HI|CEME, BI, EOFI|EC, AO|BI,    EOFI|ES|EC,    EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, IC
-#define INP     CO|MI, CO|MI|HI, RO|HI|CEME, TR|AI|BI, EOFI|ES|BI, EOFI|ES|EC, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define NEG     CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI, EOFI|ES|EC|AI, EOFI|ES|EC|AI, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define Inc     CO|MI, CO|MI|HI, RO|HI|CEME, BI, EOFI|ES|EC|AI, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define Dec     CO|MI, CO|MI|HI, RO|HI|CEME, BI, EOFI|AI, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-
-#define LDI     CO|MI, CO|MI|HI, RO|HI|CEME, RO|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define ADI     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI, EOFI|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define SBI     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI, EOFI|ES|EC|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define CPI     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI, EOFI|ES|EC|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define ACI0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI, EOFI|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define ACI1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI, EOFI|EC|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define SCI0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI, EOFI|ES|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define SCI1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI, EOFI|ES|EC|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-
-#define JPA     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|CI|HI, BO|CI, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0
-#define LDA     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0
-#define STA     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|RI, CEME, IC, 0, 0, 0, 0, 0, 0, 0
-#define ADA     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0
-#define SBA     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|ES|EC|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0
-#define CPA     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|ES|EC|CEME, IC, 0, 0, 0, 0, 0, 0, 0
-#define ACA0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0
-#define ACA1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|EC|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0
-#define SCA0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|ES|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0
-#define SCA1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|ES|EC|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0
-
-#define JPR     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|CI|HI, BO|CI, IC, 0, 0, 0, 0, 0, 0
-#define LDR     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI, IC, 0, 0, 0, 0, 0
-#define STR     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, AO|RI, IC, 0, 0, 0, 0, 0
-#define ADR     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|AI, IC, 0, 0, 0, 0
-#define SBR     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|ES|EC|AI, IC, 0, 0, 0, 0
-#define CPR     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|ES|EC, IC, 0, 0, 0, 0
-#define ACR0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|AI, IC, 0, 0, 0, 0
-#define ACR1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|EC|AI, IC, 0, 0, 0, 0
-#define SCR0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|ES|AI, IC, 0, 0, 0, 0
-#define SCR1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|ES|EC|AI, IC, 0, 0, 0, 0
-
-#define CLB     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI|AI, EOFI|ES|EC|RI, EOFI|ES|EC|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0
-#define NEB     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|AI, EOFI|ES|EC|RI, EOFI|ES|EC|AI|CEME, IC, 0, 0, 0, 0, 0
-#define INB     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|BI, EOFI|EC|RI, EOFI|EC|AI|CEME, IC, 0, 0, 0, 0, 0
-#define DEB     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|BI, EOFI|ES|RI, EOFI|ES|AI|CEME, IC, 0, 0, 0, 0, 0
-#define ADB     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|RI, CEME, IC, 0, 0, 0, 0, 0, 0
-#define SBB     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|BI, RO|AI, EOFI|ES|EC|RI, BO|AI|CEME, IC, 0, 0, 0, 0, 0
-#define ACB0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|AI,    AO|RI, CEME, IC, 0, 0, 0, 0, 0
-#define ACB1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|EC|AI, AO|RI, CEME, IC, 0, 0, 0, 0, 0
-#define SCB0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|BI, RO|AI, EOFI|ES|AI,    AO|RI, BO|AI|CEME, IC, 0, 0, 0, 0
-#define SCB1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|BI, RO|AI, EOFI|ES|EC|AI, AO|RI, BO|AI|CEME, IC, 0, 0, 0, 0
-
-#define CLW     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|BI,    EOFI|ES|EC|RI, CEME, EOFI|ES|EC|RI, IC, 0, 0, 0, 0, 0
-#define NEW0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|AI, EOFI|ES|EC|RI, CEME, RO|BI, EOFI|ES|AI,     AO|RI, IC, 0, 0
-#define NEW1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|AI, EOFI|ES|EC|RI, CEME, RO|BI, EOFI|ES|EC|AI, AO|RI, IC, 0, 0
-#define INW0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|BI, EOFI|EC|RI, CEME|BI, RO|AI, EOFI|ES|AI,     AO|RI, IC, 0, 0
-#define INW1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|BI, EOFI|EC|RI, CEME|BI, RO|AI, EOFI|ES|EC|AI, AO|RI, IC, 0, 0
-#define DEW0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|BI, EOFI|ES|RI, CEME|BI, RO|AI, EOFI|AI,       AO|RI, IC, 0, 0
-#define DEW1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|BI, EOFI|ES|RI, CEME|BI, RO|AI, EOFI|EC|AI,     AO|RI, IC, 0, 0
-#define ADW0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI,    EOFI|RI, CEME|BI, RO|AI, EOFI|ES|AI,    AO|RI, IC, 0, 0, 0
-#define ADW1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI,    EOFI|RI, CEME|BI, RO|AI, EOFI|ES|EC|AI, AO|RI, IC, 0, 0, 0
-#define SBW0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|BI,    RO|AI, EOFI|ES|EC|RI, CEME|BI, RO|AI, EOFI|AI,    AO|RI, IC, 0, 0
-#define SBW1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|BI,    RO|AI, EOFI|ES|EC|RI, CEME|BI, RO|AI, EOFI|EC|AI, AO|RI, IC, 0, 0
-#define ACW0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI,    EOFI|BI,    BO|RI, CEME|BI, RO|AI, EOFI|ES|AI,    AO|RI, IC, 0, 0
-#define ACW1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI,    EOFI|EC|BI, BO|RI, CEME|BI, RO|AI, EOFI|ES|EC|AI, AO|RI, IC, 0, 0
-#define SCW0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|BI,    RO|AI, EOFI|ES|BI,    BO|RI, CEME|BI, RO|AI, EOFI|AI,     AO|RI, IC, 0
-#define SCW1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|BI,    RO|AI, EOFI|ES|EC|BI, BO|RI, CEME|BI, RO|AI, EOFI|EC|AI, AO|RI, IC, 0
-
-#define LDS     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, MI|HI, MI, RO|AI, EOFI|MI, RO|AI, IC, 0, 0, 0, 0, 0, 0
-#define STS     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, MI|HI, MI, RO|MI, AO|RI, MI, RO|AI, EOFI|BI, MI, RO|MI, RO|AI, BO|MI, AO|RI
-#define PHS     CO|MI, CO|MI|HI, RO|HI|CEME, MI|HI, MI, RO|MI|BI, AO|RI, BO|AI,  EOFI|ES|BI|MI, EOFI|RI, AO|MI, RO|AI, IC, 0, 0, 0
-#define PLS     CO|MI, CO|MI|HI, RO|HI|CEME, MI|HI, MI|BI, RO|AI, EOFI|ES|EC|AI, AO|RI, AO|MI, RO|AI, IC, 0, 0, 0, 0, 0
-#define JPS     CO|MI, CO|MI|HI, RO|HI|CEME, MI|HI, MI|BI, RO|AI|MI, CO|RI, EOFI|AI|MI, CO|RI|HI, BO|MI, EOFI|RI, CO|MI, CO|MI|HI, RO|BI|CEME, RO|CI|HI, BO|CI
-#define RTS     CO|MI, CO|MI|HI, RO|HI|CEME, MI|HI, MI|BI, RO|AI|MI, EOFI|ES|EC|AI|MI, RO|CI|HI, EOFI|ES|EC|AI|MI, RO|CI, BO|MI, AO|RI, CEME, CEME, IC, 0
-
-#define BRA     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|CI|HI, BO|CI, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0    // branching
-#define ___     CO|MI, CO|MI|HI, RO|HI|CEME, CEME, CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0                  // non-branching
-
-uint16_t mEEPROM[8192]    // microcode depending on flags, opcode and stepcounter
-{
-  /*NCZ    target: A, operand: none                                                       target: A, operand: immediate      target: A, operand:  byte at abs address    target: A, operand:  byte at rel address    target: byte at abs address, operand: A      target: word at abs address, operand: A          stack operations                BNE  BEQ  BCC  BCS  BPL  BMI */
-  /*---*/  NOP, BNK, OUT, CLC, SEC, LSL, ROL0, LSR0, ROR0, ASR00x, INP,  NEG, Inc, Dec,   LDI, ADI, SBI, CPI, ACI0, SCI0,    JPA, LDA, STA, ADA, SBA, CPA, ACA0, SCA0,   JPR, LDR, STR, ADR, SBR, CPR, ACR0, SCR0,   CLB, NEB, INB, DEB, ADB, SBB, ACB0, SCB0,    CLW, NEW0, INW0, DEW0, ADW0, SBW0, ACW0, SCW0,   LDS, STS, PHS, PLS, JPS, RTS,   BRA, ___, BRA, ___, BRA, ___,
-  /*--1*/  NOP, BNK, OUT, CLC, SEC, LSL, ROL0, LSR0, ROR0, ASR00x, INP,  NEG, Inc, Dec,   LDI, ADI, SBI, CPI, ACI0, SCI0,    JPA, LDA, STA, ADA, SBA, CPA, ACA0, SCA0,   JPR, LDR, STR, ADR, SBR, CPR, ACR0, SCR0,   CLB, NEB, INB, DEB, ADB, SBB, ACB0, SCB0,    CLW, NEW0, INW0, DEW0, ADW0, SBW0, ACW0, SCW0,   LDS, STS, PHS, PLS, JPS, RTS,   ___, BRA, BRA, ___, BRA, ___,
-  /*-1-*/  NOP, BNK, OUT, CLC, SEC, LSL, ROL1, LSR1, ROR1, ASR01x, INP,  NEG, Inc, Dec,   LDI, ADI, SBI, CPI, ACI1, SCI1,    JPA, LDA, STA, ADA, SBA, CPA, ACA1, SCA1,   JPR, LDR, STR, ADR, SBR, CPR, ACR1, SCR1,   CLB, NEB, INB, DEB, ADB, SBB, ACB1, SCB1,    CLW, NEW1, INW1, DEW1, ADW1, SBW1, ACW1, SCW1,   LDS, STS, PHS, PLS, JPS, RTS,   BRA, ___, ___, BRA, BRA, ___,
-  /*-11*/  NOP, BNK, OUT, CLC, SEC, LSL, ROL1, LSR1, ROR1, ASR01x, INP,  NEG, Inc, Dec,   LDI, ADI, SBI, CPI, ACI1, SCI1,    JPA, LDA, STA, ADA, SBA, CPA, ACA1, SCA1,   JPR, LDR, STR, ADR, SBR, CPR, ACR1, SCR1,   CLB, NEB, INB, DEB, ADB, SBB, ACB1, SCB1,    CLW, NEW1, INW1, DEW1, ADW1, SBW1, ACW1, SCW1,   LDS, STS, PHS, PLS, JPS, RTS,   ___, BRA, ___, BRA, BRA, ___,
-  /*1--*/  NOP, BNK, OUT, CLC, SEC, LSL, ROL0, LSR0, ROR0, ASR10x, INP,  NEG, Inc, Dec,   LDI, ADI, SBI, CPI, ACI0, SCI0,    JPA, LDA, STA, ADA, SBA, CPA, ACA0, SCA0,   JPR, LDR, STR, ADR, SBR, CPR, ACR0, SCR0,   CLB, NEB, INB, DEB, ADB, SBB, ACB0, SCB0,    CLW, NEW0, INW0, DEW0, ADW0, SBW0, ACW0, SCW0,   LDS, STS, PHS, PLS, JPS, RTS,   BRA, ___, BRA, ___, ___, BRA,
-  /*1-1*/  NOP, BNK, OUT, CLC, SEC, LSL, ROL0, LSR0, ROR0, ASR10x, INP,  NEG, Inc, Dec,   LDI, ADI, SBI, CPI, ACI0, SCI0,    JPA, LDA, STA, ADA, SBA, CPA, ACA0, SCA0,   JPR, LDR, STR, ADR, SBR, CPR, ACR0, SCR0,   CLB, NEB, INB, DEB, ADB, SBB, ACB0, SCB0,    CLW, NEW0, INW0, DEW0, ADW0, SBW0, ACW0, SCW0,   LDS, STS, PHS, PLS, JPS, RTS,   ___, BRA, BRA, ___, ___, BRA,
-  /*11-*/  NOP, BNK, OUT, CLC, SEC, LSL, ROL1, LSR1, ROR1, ASR11x, INP,  NEG, Inc, Dec,   LDI, ADI, SBI, CPI, ACI1, SCI1,    JPA, LDA, STA, ADA, SBA, CPA, ACA1, SCA1,   JPR, LDR, STR, ADR, SBR, CPR, ACR1, SCR1,   CLB, NEB, INB, DEB, ADB, SBB, ACB1, SCB1,    CLW, NEW1, INW1, DEW1, ADW1, SBW1, ACW1, SCW1,   LDS, STS, PHS, PLS, JPS, RTS,   BRA, ___, ___, BRA, ___, BRA,
-  /*111*/  NOP, BNK, OUT, CLC, SEC, LSL, ROL1, LSR1, ROR1, ASR11x, INP,  NEG, Inc, Dec,   LDI, ADI, SBI, CPI, ACI1, SCI1,    JPA, LDA, STA, ADA, SBA, CPA, ACA1, SCA1,   JPR, LDR, STR, ADR, SBR, CPR, ACR1, SCR1,   CLB, NEB, INB, DEB, ADB, SBB, ACB1, SCB1,    CLW, NEW1, INW1, DEW1, ADW1, SBW1, ACW1, SCW1,   LDS, STS, PHS, PLS, JPS, RTS,   ___, BRA, ___, BRA, ___, BRA,
-};
+/* XXX should make a struct so it can have a std::string name for debugging and tracing */
+typedef bool Wire;
 
-/* End of snippet by Carsten Herting */
+template <int SIZE> struct Buffer;
 
-/* instruction must be 6 bits */
-/* step must be 4 bits */
-uint16_t GetMicrocodeWord(uint8_t instruction, uint8_t N, uint8_t C, uint8_t Z, uint8_t step)
+// The wires of a Bus or Buffer packed into one word, wire i in bit i, so
+// conversions and change detection are single operations.  Indexing still
+// reaches individual wires.
+template <int SIZE>
+struct PackedWires
 {
-    return mEEPROM[(N << 12) | (C << 11) | (Z << 10) | (instruction << 4) | (step << 0)];
-}
-
-typedef uint64_t clk_t;
+    static_assert(SIZE > 0 && SIZE <= 32, "PackedWires holds at most 32 wires");
+    static constexpr uint32_t mask = (SIZE == 32) ? 0xFFFFFFFFu : ((1u << SIZE) - 1);
 
-struct Clock
-{
-    clk_t rate;
-    clk_t clocks;
+    uint32_t bits = 0;
 
-    Clock(clk_t rate) :
-        rate(rate),
-        clocks(0)
-    {}
+    struct WireReference
+    {
+        uint32_t& bits;
+        uint32_t bit;
+        operator bool () const
+        {
+            return bits & bit;
+        }
+        WireReference& operator =(bool v)
+        {
+            bits = v ? (bits | bit) : (bits & ~bit);
+            return *this;
+        }
+    };
 
-    Clock(const Clock& clock) :
-        rate(clock.rate), 
-        clocks(clock.clocks)
-    {}
+    static constexpr size_t size()
+    {
+        return SIZE;
+    }
+    WireReference operator [](size_t i)
+    {
+        return WireReference{bits, 1u << i};
+    }
+    bool operator [](size_t i) const
+    {
+        return bits & (1u << i);
+    }
+    operator uint32_t () const
+    {
+        return bits;
+    }
+};
 
-    Clock(const Clock& clock, clk_t newClocks) :
-        rate(clock.rate), 
-        clocks(newClocks)
+// Wires from one driver; a bus several blocks drive is a TriStateBus over
+// a BusDriver for each
+template <int SIZE>
+struct Bus: public PackedWires<SIZE>
+{
+    uint16_t nameIndex;
+    Bus(const std::string& name) :
+        nameIndex(InternWireName(name))
     {}
-
-    Clock& operator=(const Clock& clock)
+    const std::string& name() const
     {
-        clocks = clock.clocks;
-        rate = clock.rate;
+        return WireNameTable()[nameIndex];
+    }
+    // Narrower inputs are zero-extended, wider ones truncated
+    template <int OSIZE>
+    const Bus<SIZE>& operator =(const Buffer<OSIZE>& input)
+    {
+        this->bits = input.bits & this->mask;
         return *this;
     }
-
-    Clock& operator+=(clk_t inc)
+    Bus<SIZE>& operator =(uint32_t v)
     {
-        clocks += inc;
+        this->bits = v & this->mask;
         return *this;
     }
-
-    Clock operator+(clk_t inc) const
+    // Only its one driver puts anything on a Bus, so it keeps the last
+    // value when that lets go
+    void drive(uint32_t v)
+    {
+        *this = v;
+    }
+    void release()
     {
-        return Clock(rate, clocks + inc);
     }
-
-    // operator clk_t() const { return clocks; }
 };
 
-constexpr int UIUpdateFrequency = 30;
-
-uint16_t u16from2xu8(uint8_t hi, uint8_t lo)
-{
-    return hi << 8 | lo;
-}
-
-struct Block
+// One block's connection to a bus that others drive too: the value it puts
+// on the bus and, above that, whether it's driving at all.  Each driver is
+// a signal of its own, so the scheduler sees which one changed, and a
+// TriStateBus puts them together.
+template <int SIZE>
+struct BusDriver : public PackedWires<SIZE + 1>
 {
-    std::string name;
-    Block(const std::string& name) :
-        name(name)
+    static constexpr uint32_t driving = 1u << SIZE;
+    uint16_t nameIndex;
+    BusDriver(const std::string& name) :
+        nameIndex(InternWireName(name))
     {}
-    // Evaluate block logic using inputs, return true if any of the
-    // internal state or outputs of this block changed
-    virtual bool Evaluate() = 0;
+    void drive(uint32_t v)
+    {
+        this->bits = driving | (v & (driving - 1));
+    }
+    void release()
+    {
+        this->bits = 0;
+    }
 };
 
-/* XXX should make a struct so it can have a std::string name for debugging and tracing */
-typedef bool Wire;
-
-template <int SIZE> struct Buffer;
-
-// XXX should probably be constructed with tied-high / tied-low / floating state so
-// has the correct values when not asserted from some Block.  But then would need some
-// kind of event to de-assert from Blocks (part of Evaluate on clock falling?) and a
-// method on Bus to un-drive in order to re-assert the tied-high state.
 template <int SIZE>
-struct Bus: public std::array<Wire, SIZE>
+struct Buffer : public PackedWires<SIZE>
 {
-    std::string name;
-    Bus(const std::string& name) :
-        name(name)
+    uint16_t nameIndex;
+    Buffer(const std::string& name) :
+        nameIndex(InternWireName(name))
     {}
+    const std::string& name() const
+    {
+        return WireNameTable()[nameIndex];
+    }
+    Buffer<SIZE>& operator =(uint32_t v)
+    {
+        this->bits = v & this->mask;
+        return *this;
+    }
     template <int OSIZE>
-    const Bus<SIZE>& operator =(const Buffer<OSIZE>& input)
+    const Buffer<SIZE>& operator =(const Bus<OSIZE>& input)
     {
-        for(size_t i = 0; i < std::min(input.size(), this->size()); i++) {
-            (*this)[i] = input[i];
-        }
-        if(this->size() > input.size()) {
-            for(size_t i = input.size(); i < this->size(); i++) {
-                (*this)[i] = 0;
-            }
-        }
+        this->bits = input.bits & this->mask;
         return *this;
     }
-    operator uint32_t ()
+};
+
+// A Wire or the packed wires of a Bus, read as one word to detect changes
+struct SignalRef
+{
+    const bool* wire;
+    const uint32_t* bits;
+    SignalRef(const Wire& wire) :
+        wire(&wire),
+        bits(nullptr)
+    {}
+    template <int SIZE>
+    SignalRef(const PackedWires<SIZE>& bus) :
+        wire(nullptr),
+        bits(&bus.bits)
+    {}
+    uint32_t value() const
+    {
+        return wire ? *wire : *bits;
+    }
+    const void* address() const
     {
-        uint32_t v = 0;
-        for(size_t i = 0; i < SIZE; i++) {
-            v = v | (this->at(i) ? (1 << i) : 0);
-        }
-        return v;
+        return wire ? static_cast<const void*>(wire) : static_cast<const void*>(bits);
     }
-    Bus<SIZE>& operator =(uint32_t v)
+    // Blocks only read signals through a SignalRef; restoring a snapshot is
+    // the one thing that sets them this way
+    void restore(uint32_t v) const
     {
-        for(size_t i = 0; i < SIZE; i++) {
-            (*this)[i] = v & (1 << i);
+        if(wire) {
+            *const_cast<bool*>(wire) = v;
+        } else {
+            *const_cast<uint32_t*>(bits) = v;
         }
-        return *this;
     }
 };
 
-template <int SIZE>
-struct Buffer : public std::array<Wire, SIZE>
+struct Block
 {
     std::string name;
-    Buffer(const std::string& name) :
-        name(name)
+    uint16_t nameIndex;
+    // Signals Evaluate() reads and drives, so System only evaluates
+    // blocks whose inputs changed.  Sampled inputs are only looked at on a
+    // clock edge, through Latch(), so they can't close a loop.
+    std::vector<SignalRef> inputs;
+    std::vector<SignalRef> sampled;
+    std::vector<SignalRef> outputs;
+    // Indices of the outputs in System's signal table, and this block's
+    // position in System's levelized evaluation order
+    std::vector<int> outputSignals;
+    int level = 0;
+    // How often this block was evaluated, and how often it reported a change
+    uint64_t evaluations = 0;
+    uint64_t changes = 0;
+
+    Block(const std::string& name) :
+        name(name),
+        nameIndex(InternWireName(name))
     {}
-    Buffer<SIZE>& operator =(uint32_t v)
+    void SensitiveTo(std::initializer_list<SignalRef> signals)
     {
-        for(size_t i = 0; i < SIZE; i++) {
-            (*this)[i] = v & (1 << i);
-        }
-        return *this;
+        inputs.insert(inputs.end(), signals);
     }
-    operator uint32_t ()
+    void SampledOnEdge(std::initializer_list<SignalRef> signals)
     {
-        uint32_t v = 0;
-        for(size_t i = 0; i < SIZE; i++) {
-            v = v | (this->at(i) ? (1 << i) : 0);
-        }
-        return v;
+        sampled.insert(sampled.end(), signals);
     }
-    template <int OSIZE>
-    const Buffer<SIZE>& operator =(const Bus<OSIZE>& input)
+    void Drives(std::initializer_list<SignalRef> signals)
     {
-        for(size_t i = 0; i < std::min(input.size(), this->size()); i++) {
-            (*this)[i] = input[i];
-        }
-        if(this->size() > input.size()) {
-            for(size_t i = input.size(); i < this->size(); i++) {
-                (*this)[i] = 0;
-            }
-        }
-        return *this;
+        outputs.insert(outputs.end(), signals);
     }
+    // Evaluate block logic using inputs, return true if any of the
+    // internal state or outputs of this block changed
+    virtual bool Evaluate() = 0;
+    // Take the sampled inputs as they are at a clock edge, before any
+    // block reacts to the edge
+    virtual void Latch() {}
+    // Save or restore internal state; signals are System's to save
+    virtual void Snapshot(SnapshotArchive& archive) {}
 };
 
+// Loads on the rising clock edge what was on its input just before, and
+// drives its value onto its outputs while output_enable is high
 template <int SIZE, typename InputBus, typename OutputBus>
 struct Register : public Block
 {
@@ -331,6 +247,10 @@ struct Register : public Block
     InputBus& input;
     std::vector<OutputBus*> outputs;
     Buffer<SIZE> value;
+    bool oldclock = false;
+    // input and input_enable as they were at the edge
+    uint32_t latchedInput = 0;
+    bool latchedInputEnable = false;
 
     Register<SIZE, InputBus, OutputBus>& operator=(uint32_t v)
     {
@@ -348,6 +268,31 @@ struct Register : public Block
         outputs(outputs),
         value(name + "-value")
     {
+        this->SensitiveTo({reset, clock, output_enable});
+        this->SampledOnEdge({input_enable, input});
+        for(auto* output: outputs) {
+            this->Drives({*output});
+        }
+    }
+    virtual void Latch()
+    {
+        latchedInput = input;
+        latchedInputEnable = input_enable;
+    }
+    // Drive or let go of the outputs, returning true if any changed
+    bool DriveOutputs()
+    {
+        bool changed = false;
+        for(auto* output: outputs) {
+            uint32_t old = *output;
+            if(output_enable) {
+                output->drive(value);
+            } else {
+                output->release();
+            }
+            changed = changed || (*output != old);
+        }
+        return changed;
     }
     virtual bool Evaluate()
     {
@@ -355,29 +300,18 @@ struct Register : public Block
         if(reset) {
             changed = value != 0;
             value = 0;
-        } else {
-            if(input_enable) {
-                auto old = value;
-                value = input;
-                changed = value != old;
-                // printf("%s input enable, value now 0x%x\n", this->name.c_str(), (uint32_t)value);
-            }
-        }
-        if(output_enable) {
-            // printf("%s output enable\n", this->name.c_str());
-            if(clock) {
-                // printf("%s clock enable\n", this->name.c_str());
-                for(auto* output: outputs) {
-                    auto old = *output;
-                    changed = changed || (*output != value);
-                    *output = value;
-                    // printf("%s value is 0x%x, output is 0x%x\n", this->name.c_str(), (uint32_t)value, (uint32_t)*output);
-                }
-            }
-            return changed;
-        } else {
-            return false;
+        } else if(!oldclock && clock && latchedInputEnable) {
+            changed = value != (latchedInput & value.mask);
+            value = latchedInput;
         }
+        oldclock = clock;
+        bool outputsChanged = DriveOutputs();
+        return changed || outputsChanged;
+    }
+    virtual void Snapshot(SnapshotArchive& archive)
+    {
+        archive.field(value.bits);
+        archive.field(oldclock);
     }
 };
 
@@ -389,7 +323,9 @@ struct RegisterWithTap : public Register<SIZE, InputBus, OutputBus>
     RegisterWithTap(const std::string& name, Wire& reset, Wire& clock, Wire& input_enable, Wire& output_enable, InputBus& input, std::vector<OutputBus*>outputs, Bus<SIZE>& tap) :
         Register<SIZE, InputBus, OutputBus>(name, reset, clock, input_enable, output_enable, input, outputs),
         tap(tap)
-    { }
+    {
+        this->Drives({tap});
+    }
 
     RegisterWithTap<SIZE, InputBus, OutputBus>& operator=(uint32_t v)
     {
@@ -411,19 +347,26 @@ struct Or : public Block
     Wire& A;
     Wire& B;
     Wire& Out;
-    bool oldOut;
+    bool oldOut = false;
     Or(const std::string& name, Wire& A, Wire& B, Wire& Out) :
         Block(name),
         A(A),
         B(B),
         Out(Out)
-    {}
+    {
+        SensitiveTo({A, B});
+        Drives({Out});
+    }
     virtual bool Evaluate()
     {
         oldOut = Out;
         Out = A || B;
         return Out != oldOut;
     }
+    virtual void Snapshot(SnapshotArchive& archive)
+    {
+        archive.field(oldOut);
+    }
 };
 
 template <int SIZE, typename InputBus, typename OutputBus>
@@ -432,15 +375,20 @@ struct Counter : public Register<SIZE, InputBus, OutputBus>
     Wire& load;
     Wire& increment;
     Wire& carry;
-    bool oldclock = false;
+    bool latchedIncrement = false;
 
-    // Counter<4, Bus<8>, Bus<4>> StepCounter{"StepCounter", StepCounterReset, nclock, nclock, alwaysFalse, alwaysTrue, emptyBusForInputs, {&StepToControlLogicBus}, carry_discarded};
+    // Counter<4, Bus<8>, Bus<4>> StepCounter{"StepCounter", StepCounterReset, nclock, alwaysTrue, alwaysFalse, alwaysTrue, emptyBusForInputs, {&StepToControlLogicBus}, carry_discarded};
     Counter(const std::string& name, Wire& reset, Wire& clock, Wire& increment, Wire& load, Wire& output_enable, InputBus& input, std::vector<OutputBus*> outputs, Wire& carry) :
         Register<SIZE, InputBus, OutputBus>(name, reset, clock, load, output_enable, input, outputs),
         load(load),
         increment(increment),
         carry(carry)
     {
+        // The carry out follows increment straight through, like a
+        // ripple-carry counter's
+        this->SensitiveTo({increment});
+        this->SampledOnEdge({increment});
+        this->Drives({carry});
     }
 
     Counter<SIZE, InputBus, OutputBus>& operator=(uint32_t v)
@@ -449,35 +397,37 @@ struct Counter : public Register<SIZE, InputBus, OutputBus>
         return *this;
     }
 
+    virtual void Latch()
+    {
+        Register<SIZE, InputBus, OutputBus>::Latch();
+        latchedIncrement = increment;
+    }
     virtual bool Evaluate()
     {
         bool changed = false;
+        bool edge = !this->oldclock && this->clock;
         if(this->reset) {
             changed = this->value != 0;
             this->value = 0;
-            printf("reset step counter\n");
-        } else if(!oldclock && this->clock && load) {
-            changed = this->value != this->input;
-            this->value = this->input;
-            printf("load %s counter, now %d\n", this->name.c_str(), (uint32_t) this->value);
-        } else {
-            if(!oldclock && this->clock & increment) {
-                changed = true;
-                carry = (this->value + 1 >= (1 << SIZE));
-                this->value = this->value + 1;
-                printf("increment %s counter, now %d\n", this->name.c_str(), (uint32_t) this->value);
-            }
+            Trace(TraceCounter, TraceCounterReset, this->nameIndex);
+        } else if(edge && this->latchedInputEnable) {
+            // a load wins over an increment
+            changed = this->value != (this->latchedInput & this->value.mask);
+            this->value = this->latchedInput;
+            Trace(TraceCounter, TraceCounterLoad, this->nameIndex, 0, this->value);
+        } else if(edge && latchedIncrement) {
+            changed = true;
+            this->value = this->value + 1;
+            Trace(TraceCounter, TraceCounterIncrement, this->nameIndex, 0, this->value);
         }
-        if(this->clock && this->output_enable) {
-            for(auto* output: this->outputs) {
-                auto old = *output;
-                printf("%s counter, old output value = 0x%x\n", this->name.c_str(), (uint32_t) old);
-                changed = changed || (*output != this->value);
-                *output = this->value;
-                printf("%s counter, new output value = 0x%x\n", this->name.c_str(), (uint32_t) *output);
-            }
+        this->oldclock = this->clock;
+        bool oldCarry = carry;
+        carry = increment && (this->value == this->value.mask);
+        changed = changed || (carry != oldCarry);
+        if(this->DriveOutputs()) {
+            changed = true;
+            Trace(TraceCounter, TraceCounterOutput, this->nameIndex, 0, this->value);
         }
-        oldclock = this->clock;
         return changed;
     }
 };
@@ -488,46 +438,82 @@ struct ConsoleIO : public Block
     Wire& input_enable;
     Wire& output_enable;
     Bus<8>& input;
-    std::vector<Bus<8>*> outputs;
+    std::vector<BusDriver<8>*> outputs;
     bool oldClock = false;
     std::queue<uint8_t> inputBuffer;
-
-    ConsoleIO(const std::string& name, Wire& clock, Wire& input_enable, Wire& output_enable, Bus<8>& input, std::vector<Bus<8>*> outputs) :
+    // the host's end of the UART, if there is one, after inputBuffer
+    UARTBridge *bridge = nullptr;
+    // input, input_enable and output_enable as they were at the edge
+    uint8_t latchedInput = 0;
+    bool latchedInputEnable = false;
+    bool latchedOutputEnable = false;
+
+    ConsoleIO(const std::string& name, Wire& clock, Wire& input_enable, Wire& output_enable, Bus<8>& input, std::vector<BusDriver<8>*> outputs) :
         Block(name),
         clock(clock),
         input_enable(input_enable),
         output_enable(output_enable),
         input(input),
         outputs(outputs)
-    {}
+    {
+        SensitiveTo({clock, output_enable});
+        SampledOnEdge({input_enable, output_enable, input});
+        for(auto* output: outputs) {
+            Drives({*output});
+        }
+    }
+    virtual void Latch()
+    {
+        latchedInput = input;
+        latchedInputEnable = input_enable;
+        latchedOutputEnable = output_enable;
+    }
     virtual bool Evaluate()
     {
         bool changed = false;
-        if(!oldClock && clock && input_enable) {
-            // printf("%s input enabled; input = 0x%x\n", this->name.c_str(), (uint32_t)input);
-            putchar(input);
+        if(!oldClock && clock && latchedInputEnable) {
+            Trace(TraceUART, TraceUARTWrite, this->nameIndex, 0, latchedInput);
+            if(bridge) {
+                bridge->transmit(latchedInput);
+            } else {
+                putchar(latchedInput);
+            }
             changed = true;
         }
-        if(!oldClock && clock && output_enable) {
-            uint8_t value = 0xFF;
+        // the byte shown while output_enable was high is read on the edge
+        if(!oldClock && clock && latchedOutputEnable) {
             if(!inputBuffer.empty()) {
-                value = inputBuffer.front();
-                // printf("requested UART; returned 0x%X from the buffer; XXX implement\n", value);
+                Trace(TraceUART, TraceUARTRead, this->nameIndex, 0, inputBuffer.front());
                 inputBuffer.pop();
                 changed = true;
             } else {
-                // printf("requested UART; nothing available, returning 0xFF\n");
-            }
-            for(auto* output: this->outputs) {
-                auto old = *output;
-                *output = value;
-                // printf("%s output enable, write 0x%x\n", this->name.c_str(), value);
-                changed = changed || (old != value);
+                Trace(TraceUART, TraceUARTReadEmpty, this->nameIndex);
             }
         }
         oldClock = clock;
+        for(auto* output: this->outputs) {
+            uint32_t old = *output;
+            if(output_enable) {
+                uint8_t value = 0xFF;
+                if(inputBuffer.empty() && bridge && bridge->receive(value)) {
+                    inputBuffer.push(value);
+                }
+                if(!inputBuffer.empty()) {
+                    value = inputBuffer.front();
+                }
+                output->drive(value);
+            } else {
+                output->release();
+            }
+            changed = changed || (*output != old);
+        }
         return changed;
     }
+    virtual void Snapshot(SnapshotArchive& archive)
+    {
+        archive.field(oldClock);
+        archive.field(inputBuffer);
+    }
 };
 
 struct Adder : public Block
@@ -537,11 +523,11 @@ struct Adder : public Block
     Bus<8>& FromA;
     Bus<8>& FromB;
     Wire& EO;
-    Bus<8>& ResultOut;
+    BusDriver<8>& ResultOut;
     Bus<3>& FlagsOut;
     Buffer<8> value;
 
-    Adder(const std::string& name, Wire &clock, Wire& ES, Wire& EC, Bus<8>& FromA, Bus<8>& FromB, Wire& EO, Bus<8>& ResultOut, Bus<3>& FlagsOut) :
+    Adder(const std::string& name, Wire &clock, Wire& ES, Wire& EC, Bus<8>& FromA, Bus<8>& FromB, Wire& EO, BusDriver<8>& ResultOut, Bus<3>& FlagsOut) :
         Block(name),
         ES(ES),
         EC(EC),
@@ -551,7 +537,10 @@ struct Adder : public Block
         ResultOut(ResultOut),
         FlagsOut(FlagsOut),
         value(name + "-name")
-    {}
+    {
+        SensitiveTo({ES, EC, FromA, FromB, EO});
+        Drives({ResultOut, FlagsOut});
+    }
     virtual bool Evaluate()
     {
         bool changed = false;
@@ -566,15 +555,20 @@ struct Adder : public Block
         // printf("%s: 0x%x+0x%x+0x%x yielding 0x%x, flags 0x%x\n", this->name.c_str(), carry, A, B, result & 0xFF, flags);
         changed = changed || (flags != FlagsOut);
         FlagsOut = (N << 2) | (C << 1) | (Z << 0);
+        uint32_t old = ResultOut;
         if(EO) {
-            uint8_t value = result & 0xFF;
-            auto old = ResultOut;
-            ResultOut = value;
-            // printf("%s output enable, write 0x%x\n", this->name.c_str(), value);
-            changed = changed || (old != value);
+            ResultOut.drive(result);
+            // printf("%s output enable, write 0x%x\n", this->name.c_str(), result & 0xFF);
+        } else {
+            ResultOut.release();
         }
+        changed = changed || (ResultOut != old);
         return changed;
     }
+    virtual void Snapshot(SnapshotArchive& archive)
+    {
+        archive.field(value.bits);
+    }
 };
 
 struct RAMAndFlash : public Block
@@ -587,11 +581,18 @@ struct RAMAndFlash : public Block
     Bus<8>& memory_address_high;
     Bus<4>& bank;
     Bus<8>& input;
-    std::vector<Bus<8>*> outputs;
+    std::vector<BusDriver<8>*> outputs;
     std::array<uint8_t, RAMSize> RAM;
-    std::array<uint8_t, FlashSize> Flash;
-
-    RAMAndFlash(const std::string& name, Wire& reset, Wire &clock, Wire& input_enable, Wire& output_enable, Bus<8>& memory_address_low, Bus<8>& memory_address_high, Bus<4>& bank, Bus<8>& input, std::vector<Bus<8>*> outputs) :
+    ::Flash Flash;
+    bool oldClock = false;
+    // what's written on the edge, where, and whether it is
+    bool latchedInputEnable = false;
+    uint8_t latchedInput = 0;
+    uint8_t latchedAddressLow = 0;
+    uint8_t latchedAddressHigh = 0;
+    uint8_t latchedBank = 0;
+
+    RAMAndFlash(const std::string& name, Wire& reset, Wire &clock, Wire& input_enable, Wire& output_enable, Bus<8>& memory_address_low, Bus<8>& memory_address_high, Bus<4>& bank, Bus<8>& input, std::vector<BusDriver<8>*> outputs) :
         Block(name),
         reset(reset),
         clock(clock),
@@ -602,41 +603,99 @@ struct RAMAndFlash : public Block
         bank(bank),
         input(input),
         outputs(outputs)
-    {}
+    {
+        // Reads follow the address; writes happen on the clock edge
+        SensitiveTo({clock, output_enable, memory_address_low, memory_address_high, bank});
+        SampledOnEdge({input_enable, memory_address_low, memory_address_high, bank, input});
+        for(auto* output: outputs) {
+            Drives({*output});
+        }
+    }
+    virtual void Latch()
+    {
+        latchedInputEnable = input_enable;
+        latchedInput = input;
+        latchedAddressLow = memory_address_low;
+        latchedAddressHigh = memory_address_high;
+        latchedBank = bank;
+    }
     virtual bool Evaluate()
     {
         bool changed = false;
-        uint16_t is_ram = memory_address_high & 0x80;
-        uint16_t ramaddress = ((memory_address_high & 0x7F) << 8) | (memory_address_low);
-        uint32_t flashaddress = (bank << 11) | ((memory_address_high & 0x7F) << 8) | (memory_address_low);
-        if(input_enable) {
-            printf("%s input enabled; is_ram = %d, MA = 0x%x, ramaddress = 0x%x, flashaddress = 0x%x\n", this->name.c_str(), is_ram ? 1 : 0, (memory_address_high << 8) | (memory_address_low), ramaddress, flashaddress);
-            if(is_ram) {
-                printf("%s input enable, write 0x%x to RAM 0x%x\n", this->name.c_str(), (uint32_t)input, ramaddress);
-                changed = RAM[ramaddress] != input;
-                RAM[ramaddress] = input;
+        if(!oldClock && clock && latchedInputEnable) {
+            uint16_t ramaddress = ((latchedAddressHigh & 0x7F) << 8) | latchedAddressLow;
+            uint32_t flashaddress = (latchedBank << 15) | ramaddress;
+            if(latchedAddressHigh & 0x80) {
+                Trace(TraceMemory, TraceRAMWrite, this->nameIndex, ramaddress, latchedInput);
+                changed = RAM[ramaddress] != latchedInput;
+                RAM[ramaddress] = latchedInput;
             } else {
-                printf("%s input enable, write 0x%x to Flash 0x%x\n", this->name.c_str(), (uint32_t)input, ramaddress);
-                changed = Flash[flashaddress] != input;
-                Flash[flashaddress] = input;
+                Trace(TraceMemory, TraceFlashWrite, this->nameIndex, flashaddress, latchedInput);
+                changed = Flash[flashaddress] != latchedInput;
+                Flash.write(flashaddress, latchedInput);
             }
         }
-        if(output_enable) {
-            uint8_t value;
-            if(!is_ram) {
-                value = Flash[flashaddress];
-                printf("%s output enable, read 0x%x from Flash 0x%x\n", this->name.c_str(), value, flashaddress);
+        oldClock = clock;
+        uint16_t is_ram = memory_address_high & 0x80;
+        uint16_t ramaddress = ((memory_address_high & 0x7F) << 8) | (memory_address_low);
+        uint32_t flashaddress = (bank << 15) | ((memory_address_high & 0x7F) << 8) | (memory_address_low);
+        for(auto* output: this->outputs) {
+            uint32_t old = *output;
+            if(output_enable) {
+                uint8_t value;
+                if(!is_ram) {
+                    value = Flash[flashaddress];
+                    Trace(TraceMemory, TraceFlashRead, this->nameIndex, flashaddress, value);
+                } else {
+                    value = RAM[ramaddress];
+                    Trace(TraceMemory, TraceRAMRead, this->nameIndex, ramaddress, value);
+                }
+                output->drive(value);
+                Trace(TraceBus, TraceBusDriven, this->nameIndex, 0, value);
             } else {
-                value = RAM[ramaddress];
-                printf("%s output enable, read 0x%x from RAM 0x%x\n", this->name.c_str(), value, ramaddress);
+                output->release();
             }
-            for(auto* output: this->outputs) {
-                auto old = *output;
-                *output = value;
-                printf("%s output enable, write 0x%x\n", this->name.c_str(), value);
-                changed = changed || (old != value);
+            changed = changed || (*output != old);
+        }
+        return changed;
+    }
+    virtual void Snapshot(SnapshotArchive& archive)
+    {
+        archive.sparse(RAM.data(), RAM.size());
+        Flash.snapshot(archive);
+        archive.field(oldClock);
+    }
+};
+
+// A bus more than one block can drive, pulled high while none does.  Two
+// driving at once would be contention on the real board; here a bit either
+// pulls low reads low.
+template <int SIZE>
+struct TriStateBus : public Block
+{
+    std::vector<BusDriver<SIZE>*> drivers;
+    Bus<SIZE>& bus;
+
+    TriStateBus(const std::string& name, std::vector<BusDriver<SIZE>*> drivers, Bus<SIZE>& bus) :
+        Block(name),
+        drivers(drivers),
+        bus(bus)
+    {
+        for(auto* driver: drivers) {
+            SensitiveTo({*driver});
+        }
+        Drives({bus});
+    }
+    virtual bool Evaluate()
+    {
+        uint32_t value = bus.mask;
+        for(auto* driver: drivers) {
+            if(*driver & driver->driving) {
+                value &= *driver;
             }
         }
+        bool changed = bus != value;
+        bus = value;
         return changed;
     }
 };
@@ -662,7 +721,7 @@ struct ControlROM : public Block
     Wire& AOSignal;
     Wire& BISignal;
     Wire& BOSignal;
-    uint16_t microcode_word;
+    uint16_t microcode_word = 0;
 
     bool disableForDebug = false;
 
@@ -688,7 +747,10 @@ struct ControlROM : public Block
         AOSignal(AOSignal),
         BISignal(BISignal),
         BOSignal(BOSignal)
-    { }
+    {
+        SensitiveTo({flags, instruction, step});
+        Drives({CISignal, COSignal, CEMESignal, TRSignal, ICSignal, ECSignal, ESSignal, EOFISignal, HISignal, MISignal, RISignal, ROSignal, AISignal, AOSignal, BISignal, BOSignal});
+    }
     bool Evaluate()
     {
         if(disableForDebug) {
@@ -698,25 +760,32 @@ struct ControlROM : public Block
         uint32_t romaddress = (flags << 10) | (instruction << 4) | (step << 0);
         bool changed = romaddress != oldromaddress;
         oldromaddress = romaddress;
-        microcode_word = mEEPROM[romaddress];
-        CISignal = microcode_word & CI;
-        COSignal = microcode_word & CO;
-        CEMESignal = microcode_word & CEME;
-        TRSignal = microcode_word & TR;
-        ICSignal = microcode_word & IC;
-        ECSignal = microcode_word & EC;
-        ESSignal = microcode_word & ES;
-        EOFISignal = microcode_word & EOFI;
-        HISignal = microcode_word & HI;
-        MISignal = microcode_word & MI;
-        RISignal = microcode_word & RI;
-        ROSignal = microcode_word & RO;
-        AISignal = microcode_word & AI;
-        AOSignal = microcode_word & AO;
-        BISignal = microcode_word & BI;
-        BOSignal = microcode_word & BO;
+        uint32_t signals = ControlSignalTable[romaddress];
+        microcode_word = signals;
+        CISignal = signals & CI;
+        COSignal = signals & CO;
+        CEMESignal = signals & CEME;
+        TRSignal = signals & TR;
+        ICSignal = signals & IC;
+        ECSignal = signals & EC;
+        ESSignal = signals & ES;
+        EOFISignal = signals & EOFI;
+        HISignal = signals & HI;
+        MISignal = signals & MI;
+        RISignal = signals & RI;
+        ROSignal = signals & RO;
+        AISignal = signals & AI;
+        AOSignal = signals & AO;
+        BISignal = signals & BI;
+        BOSignal = signals & BO;
         return changed;
     }
+    virtual void Snapshot(SnapshotArchive& archive)
+    {
+        archive.field(microcode_word);
+        archive.field(disableForDebug);
+        archive.field(oldromaddress);
+    }
 };
 
 struct ControlLogic : public Block
@@ -738,13 +807,13 @@ struct ControlLogic : public Block
     Wire& toSignal;
     Wire& iiSignal;
     Wire& kiSignal;
-    bool oldHISignal;
-    bool oldCISignal;
-    bool oldCOSignal;
-    bool oldTRSignal;
-    bool oldMISignal;
-    bool oldCEMESignal;
-    bool oldECSignal;
+    bool oldHISignal = false;
+    bool oldCISignal = false;
+    bool oldCOSignal = false;
+    bool oldTRSignal = false;
+    bool oldMISignal = false;
+    bool oldCEMESignal = false;
+    bool oldECSignal = false;
     ControlLogic(const std::string& name, Wire& HISignal, Wire& CISignal, Wire& COSignal, Wire& MISignal, Wire& TRSignal, Wire& CEMESignal, Wire& ECSignal, Wire& cohSignal, Wire& colSignal, Wire& cihSignal, Wire& cilSignal, Wire& mihSignal, Wire& milSignal, Wire& tiSignal, Wire& toSignal, Wire& iiSignal, Wire& kiSignal) :
         Block(name),
         HISignal(HISignal),
@@ -764,7 +833,10 @@ struct ControlLogic : public Block
         toSignal(toSignal),
         iiSignal(iiSignal),
         kiSignal(kiSignal)
-    {}
+    {
+        SensitiveTo({HISignal, CISignal, COSignal, MISignal, TRSignal, CEMESignal, ECSignal});
+        Drives({cohSignal, colSignal, cihSignal, cilSignal, mihSignal, milSignal, tiSignal, toSignal, iiSignal, kiSignal});
+    }
     bool Evaluate()
     {
         bool changed = false;
@@ -787,11 +859,28 @@ struct ControlLogic : public Block
         kiSignal = ECSignal && HISignal;
         return changed;
     }
+    virtual void Snapshot(SnapshotArchive& archive)
+    {
+        archive.field(oldHISignal);
+        archive.field(oldCISignal);
+        archive.field(oldCOSignal);
+        archive.field(oldTRSignal);
+        archive.field(oldMISignal);
+        archive.field(oldCEMESignal);
+        archive.field(oldECSignal);
+    }
 };
 
 struct System
 {
     Bus<8> MainBus{"MainBus"};
+    BusDriver<8> AToMainBus{"AToMainBus"};
+    BusDriver<8> BToMainBus{"BToMainBus"};
+    BusDriver<8> PCLToMainBus{"PCLToMainBus"};
+    BusDriver<8> PCHToMainBus{"PCHToMainBus"};
+    BusDriver<8> MemoryToMainBus{"MemoryToMainBus"};
+    BusDriver<8> UARTToMainBus{"UARTToMainBus"};
+    BusDriver<8> ALUToMainBus{"ALUToMainBus"};
     Bus<8> AToAdder{"AToAdder"};
     Bus<8> BToAdder{"BToAdder"};
     Bus<8> PCLToMemory{"PCLToMemory"};
@@ -837,123 +926,698 @@ struct System
     Wire reset = true;
     Bus<8> emptyBusForInputs{"emptyBusForInputs"};
 
-    RegisterWithTap<8, Bus<8>, Bus<8>> ARegister{"ARegister", reset, clock, AISignal, AOSignal, MainBus, {&MainBus}, AToAdder};
-    RegisterWithTap<8, Bus<8>, Bus<8>> BRegister{"BRegister", reset, clock, BISignal, BOSignal, MainBus, {&MainBus}, BToAdder};
+    RegisterWithTap<8, Bus<8>, BusDriver<8>> ARegister{"ARegister", reset, clock, AISignal, AOSignal, MainBus, {&AToMainBus}, AToAdder};
+    RegisterWithTap<8, Bus<8>, BusDriver<8>> BRegister{"BRegister", reset, clock, BISignal, BOSignal, MainBus, {&BToMainBus}, BToAdder};
 
-    Wire PCLcarry;
-    Wire PCHcarry_discard;
-    Counter<8, Bus<8>, Bus<8>> PCLRegister{"PCLRegister", reset, clock, CEMESignal, cilSignal, colSignal, MainBus, {&MainBus}, PCLcarry};
-    Counter<8, Bus<8>, Bus<8>> PCHRegister{"PCHRegister", reset, clock, PCLcarry, cihSignal, cohSignal, MainBus, {&MainBus}, PCHcarry_discard};
+    Wire PCLcarry = false;
+    Wire PCHcarry_discard = false;
+    Counter<8, Bus<8>, BusDriver<8>> PCLRegister{"PCLRegister", reset, clock, CEMESignal, cilSignal, colSignal, MainBus, {&PCLToMainBus}, PCLcarry};
+    Counter<8, Bus<8>, BusDriver<8>> PCHRegister{"PCHRegister", reset, clock, PCLcarry, cihSignal, cohSignal, MainBus, {&PCHToMainBus}, PCHcarry_discard};
 
-    Wire MALcarry;
-    Wire MAHcarry_discard;
+    Wire MALcarry = false;
+    Wire MAHcarry_discard = false;
     Counter<8, Bus<8>, Bus<8>> MALRegister{"MALRegister", reset, clock, CEMESignal, milSignal, alwaysTrue, MainBus, {&MALToMemory}, MALcarry};
     Counter<8, Bus<8>, Bus<8>> MAHRegister{"MAHRegister", reset, clock, MALcarry, mihSignal, alwaysTrue, MainBus, {&MAHToMemory}, MAHcarry_discard};
 
     Register<4, Bus<8>, Bus<4>> BANKRegister{"BANKRegister", reset, clock, kiSignal, alwaysTrue, MainBus, {&BANKToMemory}};
 
     Register<3, Bus<3>, Bus<3>> FlagsRegister{"FlagsRegister", reset, clock, EOFISignal, alwaysTrue, AdderFlagsBus, {&FlagsToControlLogicBus}};
-    Register<6, Bus<8>, Bus<6>> InstructionRegister{"InstructionRegister", reset, nclock, iiSignal, alwaysTrue, MainBus, {&InstructionToControlLogicBus}};
+    Register<6, Bus<8>, Bus<6>> InstructionRegister{"InstructionRegister", reset, clock, iiSignal, alwaysTrue, MainBus, {&InstructionToControlLogicBus}};
 
-    Wire StepCounterReset;
+    Wire StepCounterReset = false;
     Or ICOrReset{"ICOrReset", ICSignal, reset, StepCounterReset};
-    Wire carry_discarded;
-    Counter<4, Bus<8>, Bus<4>> StepCounter{"StepCounter", StepCounterReset, nclock, nclock, alwaysFalse, alwaysTrue, emptyBusForInputs, {&StepToControlLogicBus}, carry_discarded};
+    Wire carry_discarded = false;
+    // steps on the falling edge, so the control word has settled by the rising one
+    Counter<4, Bus<8>, Bus<4>> StepCounter{"StepCounter", StepCounterReset, nclock, alwaysTrue, alwaysFalse, alwaysTrue, emptyBusForInputs, {&StepToControlLogicBus}, carry_discarded};
+
+    RAMAndFlash Memory{"Memory", reset, clock, RISignal, ROSignal, MALToMemory, MAHToMemory, BANKToMemory, MainBus, {&MemoryToMainBus}};
 
-    RAMAndFlash Memory{"Memory", reset, clock, RISignal, ROSignal, MALToMemory, MAHToMemory, BANKToMemory, MainBus, {&MainBus}};
+    ConsoleIO UART{"UART", clock, tiSignal, toSignal, MainBus, {&UARTToMainBus}};
 
-    ConsoleIO UART{"UART", clock, tiSignal, toSignal, MainBus, {&MainBus}};
+    Adder ALU{"ALU", clock, ESSignal, ECSignal, AToAdder, BToAdder, EOFISignal, ALUToMainBus, AdderFlagsBus};
 
-    Adder ALU{"ALU", clock, ESSignal, ECSignal, AToAdder, BToAdder, EOFISignal, MainBus, AdderFlagsBus};
+    TriStateBus<8> MainBusDrivers{"MainBusDrivers", {&AToMainBus, &BToMainBus, &PCLToMainBus, &PCHToMainBus, &MemoryToMainBus, &UARTToMainBus, &ALUToMainBus}, MainBus};
 
     ControlROM MicrocodeROM{"MicrocodeROM", FlagsToControlLogicBus, InstructionToControlLogicBus, StepToControlLogicBus, CISignal, COSignal, CEMESignal, TRSignal, ICSignal, ECSignal, ESSignal, EOFISignal, HISignal, MISignal, RISignal, ROSignal, AISignal, AOSignal, BISignal, BOSignal};
 
     ControlLogic Logic{"Logic", HISignal, CISignal, COSignal, MISignal, TRSignal, CEMESignal, ECSignal, cohSignal, colSignal, cihSignal, cilSignal, mihSignal, milSignal, tiSignal, toSignal, iiSignal, kiSignal};
 
-    std::vector<Block*> blocks = {&ICOrReset, &ARegister, &BRegister, &PCLRegister, &PCHRegister, &MALRegister, &MAHRegister, &BANKRegister, &FlagsRegister, &InstructionRegister, &StepCounter, &Memory, &UART, &ALU, &MicrocodeROM, &Logic};
+    std::vector<Block*> blocks = {&ICOrReset, &ARegister, &BRegister, &PCLRegister, &PCHRegister, &MALRegister, &MAHRegister, &BANKRegister, &FlagsRegister, &InstructionRegister, &StepCounter, &Memory, &UART, &ALU, &MicrocodeROM, &Logic, &MainBusDrivers};
 
-    System()
-    {
-    }
+    // Every signal some block reads or drives, the value the scheduler last
+    // saw on it, and the blocks to re-evaluate when it changes
+    std::vector<SignalRef> signals;
+    std::vector<uint32_t> signalValues;
+    std::vector<std::vector<Block*>> signalReaders;
 
-    void Step()
-    {
-        bool changed;
+    // Blocks in levelized order, and the feedback loops found among them;
+    // each loop is a strongly connected set of blocks joined through
+    // combinational (not sampled) inputs
+    std::vector<Block*> order;
+    std::vector<std::vector<Block*>> loops;
 
-        MainBus = 0xFF; // XXX this should be part of bus state? - tied high, tied low, floats?
-        clock = true;
-        nclock = !clock;
-        int cycles = 0;
-        do {
-            if(cycles >= QuiescentEvaluateMaxCycles) {
-                throw std::runtime_error(std::string("Step: exceeded maximum number of cycles to achieve quiescence with clock high"));
+    // Blocks waiting for evaluation, one bit per level
+    uint64_t pending = 0;
+
+    // Sweeps through the levelized order, and how many went back to an
+    // earlier level because a loop fed back
+    uint64_t sweeps = 0;
+    uint64_t extraSweeps = 0;
+
+    // Calls to Step(), for tracing
+    uint64_t steps = 0;
+
+    System()
+    {
+        for(auto* b : blocks) {
+            for(const auto& input : b->inputs) {
+                signalReaders[SignalIndex(input)].push_back(b);
             }
-            if(debug) printf("    clock high in loop:\n");
-            changed = false;
-            for(auto* b : blocks) {
-                bool block_changed = b->Evaluate();
-                changed = changed || block_changed;
-                if(debug && block_changed) printf("        %s output changed\n", b->name.c_str());
+            // only so a snapshot keeps them
+            for(const auto& input : b->sampled) {
+                SignalIndex(input);
             }
-            if(debug) printf("        MainBus = 0x%x:\n", (uint32_t)MainBus);
-            cycles++;
-        } while(changed);
-
-        clock = false;
-        nclock = !clock;
-        cycles = 0;
-        do {
-            if(cycles >= QuiescentEvaluateMaxCycles) {
-                throw std::runtime_error(std::string("Step: exceeded maximum number of cycles to achieve quiescence with clock high"));
+            for(const auto& output : b->outputs) {
+                b->outputSignals.push_back(SignalIndex(output));
             }
-            if(debug) printf("    clock low in loop:\n");
-            changed = false;
-            for(auto* b : blocks) {
-                bool block_changed = b->Evaluate();
-                changed = changed || block_changed;
-                if(debug && block_changed) printf("        %s output changed\n", b->name.c_str());
+        }
+        Levelize();
+#if !EMU_VIRTUAL_BLOCKS
+        // Checked on every build, not only with asserts on: a composed sweep
+        // out of order still runs, just slower or missing a block
+        if(!ComposedBlocksAreLevelized()) {
+            std::string levelized;
+            for(auto* b : order) {
+                levelized += (levelized.empty() ? "" : ", ") + b->name;
             }
-            if(debug) printf("        MainBus = 0x%x:\n", (uint32_t)MainBus);
-            cycles++;
-        } while(changed);
-        reset = false;
+            throw std::runtime_error("System: ComposedBlocks() must list every block in levelized order: " + levelized);
+        }
+#endif
+        // Nothing has been evaluated yet, so everything has to settle once
+        for(auto* b : blocks) {
+            Queue(b);
+        }
     }
-};
 
-void TestSystem()
-{
+    int SignalIndex(const SignalRef& signal)
     {
-        System sys; sys.MicrocodeROM.disableForDebug = true;
-
-        if(debug) printf("Reset test\n");
-        sys.reset = true;
-        sys.Step();
-        sys.reset = false;
-        assert((sys.StepCounter.value == 0) && "reset StepCounter");
-        assert((sys.ARegister.value == 0) && "reset ARegister");
-        assert((sys.BRegister.value == 0) && "reset BRegister");
-        assert((sys.MainBus == 0xFF) && "MainBus unasserted is 0xFF");
-        sys.Step();
-        assert((sys.StepCounter.value == 1) && "increment StepCounter");
+        for(size_t i = 0; i < signals.size(); i++) {
+            if(signals[i].address() == signal.address()) {
+                return i;
+            }
+        }
+        signals.push_back(signal);
+        signalValues.push_back(signal.value());
+        signalReaders.push_back({});
+        return signals.size() - 1;
     }
 
+    int BlockIndex(const Block* b) const
     {
-        System sys; sys.MicrocodeROM.disableForDebug = true; sys.reset = true; sys.Step(); sys.reset = false;
-
-        if(debug) printf("Clock test 1\n");
-        sys.AOSignal = true;
-        sys.BISignal = true;
-        sys.ARegister.value = 0x5a;
-        sys.BRegister.value = 0x00;
-        sys.Step();
-        assert((sys.BRegister.value == 0x5a) && "load BRegister");
-        assert((sys.StepCounter.value == 1) && "increment StepCounter");
+        return std::find(blocks.begin(), blocks.end(), b) - blocks.begin();
     }
 
+    // Blocks whose combinational inputs b drives
+    std::vector<int> Successors(const Block* b) const
     {
-        System sys; sys.MicrocodeROM.disableForDebug = true; sys.reset = true; sys.Step(); sys.reset = false;
-
-        if(debug) printf("PCL PCH test\n");
+        std::vector<int> successors;
+        for(int signal : b->outputSignals) {
+            for(auto* reader : signalReaders[signal]) {
+                successors.push_back(BlockIndex(reader));
+            }
+        }
+        return successors;
+    }
+
+    // Find the combinational loops (Tarjan's strongly connected components)
+    // and order the blocks so each is evaluated after what it depends on.
+    // Loop members keep the order they have in blocks.  Sampled inputs are
+    // latched before anything reacts to the edge, so they don't order
+    // anything.
+    void Levelize()
+    {
+        int n = blocks.size();
+        assert(n <= 64);
+
+        std::vector<int> index(n, -1), lowlink(n, 0), component(n, -1);
+        std::vector<bool> onStack(n, false);
+        std::vector<int> stack;
+        std::vector<std::vector<int>> components;
+        int counter = 0;
+
+        std::function<void(int)> connect = [&](int v) {
+            index[v] = lowlink[v] = counter++;
+            stack.push_back(v);
+            onStack[v] = true;
+            for(int w : Successors(blocks[v])) {
+                if(index[w] < 0) {
+                    connect(w);
+                    lowlink[v] = std::min(lowlink[v], lowlink[w]);
+                } else if(onStack[w]) {
+                    lowlink[v] = std::min(lowlink[v], index[w]);
+                }
+            }
+            if(lowlink[v] == index[v]) {
+                std::vector<int> members;
+                int w;
+                do {
+                    w = stack.back();
+                    stack.pop_back();
+                    onStack[w] = false;
+                    component[w] = components.size();
+                    members.push_back(w);
+                } while(w != v);
+                std::sort(members.begin(), members.end());
+                components.push_back(members);
+            }
+        };
+        for(int v = 0; v < n; v++) {
+            if(index[v] < 0) {
+                connect(v);
+            }
+        }
+
+        for(const auto& members : components) {
+            auto successors = Successors(blocks[members[0]]);
+            bool selfLoop = std::find(successors.begin(), successors.end(), members[0]) != successors.end();
+            if(members.size() > 1 || selfLoop) {
+                loops.push_back({});
+                for(int m : members) {
+                    loops.back().push_back(blocks[m]);
+                }
+            }
+        }
+
+        // Order the components, Kahn's algorithm over combinational edges,
+        // preferring what comes first in blocks
+        int count = components.size();
+        std::vector<std::set<int>> predecessors(count);
+        for(int v = 0; v < n; v++) {
+            for(int w : Successors(blocks[v])) {
+                if(component[v] != component[w]) {
+                    predecessors[component[w]].insert(component[v]);
+                }
+            }
+        }
+        std::vector<bool> placed(count, false);
+        for(int placedCount = 0; placedCount < count; placedCount++) {
+            int choice = -1;
+            for(int c = 0; c < count; c++) {
+                bool ready = !placed[c] && std::all_of(predecessors[c].begin(), predecessors[c].end(), [&](int p) { return placed[p]; });
+                if(ready && ((choice < 0) || (components[c][0] < components[choice][0]))) {
+                    choice = c;
+                }
+            }
+            placed[choice] = true;
+            for(int m : components[choice]) {
+                blocks[m]->level = order.size();
+                order.push_back(blocks[m]);
+            }
+        }
+    }
+
+    void Queue(Block* b)
+    {
+        pending |= 1ull << b->level;
+    }
+
+    void QueueIfChanged(int signal)
+    {
+        uint32_t value = signals[signal].value();
+        if(value != signalValues[signal]) {
+            signalValues[signal] = value;
+            for(auto* b : signalReaders[signal]) {
+                Queue(b);
+            }
+        }
+    }
+
+    // Evaluate one block and queue the readers of whatever it changed
+    template <class T>
+    void EvaluateBlock(T& b)
+    {
+        // Qualified for a concrete block, so the composed System calls its
+        // Evaluate directly and can inline it
+        bool block_changed;
+        if constexpr(std::is_abstract_v<T>) {
+            block_changed = b.Evaluate();
+        } else {
+            block_changed = b.T::Evaluate();
+        }
+        b.evaluations++;
+        if(block_changed) {
+            b.changes++;
+            Trace(TraceStep, TraceBlockChanged, b.nameIndex);
+        }
+        for(int signal : b.outputSignals) {
+            QueueIfChanged(signal);
+        }
+    }
+
+    void CountSweep(int& phaseSweeps, const char *phase)
+    {
+        if(phaseSweeps >= QuiescentEvaluateMaxCycles) {
+            throw std::runtime_error(std::string("Step: exceeded maximum number of sweeps to achieve quiescence with clock ") + phase);
+        }
+        if(phaseSweeps > 0) {
+            extraSweeps++;
+        }
+        phaseSweeps++;
+        sweeps++;
+    }
+
+#if !EMU_VIRTUAL_BLOCKS
+    // The blocks as their concrete types, in the order Levelize() puts them
+    auto ComposedBlocks()
+    {
+        return std::tie(BANKRegister, FlagsRegister, InstructionRegister, ICOrReset, StepCounter, MicrocodeROM, ARegister, BRegister, MALRegister, MAHRegister, Memory, ALU, Logic, PCLRegister, PCHRegister, UART, MainBusDrivers);
+    }
+
+    // Qualified like EvaluateBlock()'s call to Evaluate
+    template <class T>
+    void LatchBlock(T& b)
+    {
+        b.T::Latch();
+    }
+
+    template <class T>
+    void EvaluateIfPending(T& b)
+    {
+        uint64_t bit = 1ull << b.level;
+        if(pending & bit) {
+            pending &= ~bit;
+            EvaluateBlock(b);
+        }
+    }
+
+    // One sweep through the levelized order, unrolled at compile time
+    void Sweep()
+    {
+        std::apply([this](auto&... b) { (EvaluateIfPending(b), ...); }, ComposedBlocks());
+    }
+
+    // The unrolled sweep is only one sweep if it agrees with Levelize(),
+    // and only evaluates every block if it has each of them once
+    bool ComposedBlocksAreLevelized()
+    {
+        int previous = -1;
+        bool levelized = std::tuple_size_v<decltype(ComposedBlocks())> == order.size();
+        std::apply([&](auto&... b) { ((levelized = levelized && (b.level > previous), previous = b.level), ...); }, ComposedBlocks());
+        return levelized && (previous == (int)order.size() - 1);
+    }
+#endif
+
+    // Evaluate blocks whose inputs changed in levelized order.  Without
+    // feedback one sweep settles the phase; a loop feeding back to an
+    // earlier level costs another partial sweep from there.  Every block
+    // first latches what it samples, as it was before any clock edge.
+    void Settle(const char *phase)
+    {
+#if EMU_VIRTUAL_BLOCKS
+        for(auto* b : blocks) {
+            b->Latch();
+        }
+#else
+        std::apply([this](auto&... b) { (LatchBlock(b), ...); }, ComposedBlocks());
+#endif
+        // Pick up clock edges and anything set from outside since last time
+        for(size_t i = 0; i < signals.size(); i++) {
+            QueueIfChanged(i);
+        }
+        Trace(TraceStep, TraceClockPhase, 0, steps, ((steps >> 32) << 1) | clock);
+        int phaseSweeps = 0;
+#if EMU_VIRTUAL_BLOCKS
+        int previousLevel = order.size();
+        while(pending != 0) {
+            int level = __builtin_ctzll(pending);
+            pending &= ~(1ull << level);
+            if(level <= previousLevel) {
+                CountSweep(phaseSweeps, phase);
+            }
+            previousLevel = level;
+            EvaluateBlock(*order[level]);
+        }
+#else
+        while(pending != 0) {
+            CountSweep(phaseSweeps, phase);
+            Sweep();
+        }
+#endif
+        Trace(TraceBus, TraceBusSettled, MainBus.nameIndex, 0, MainBus);
+    }
+
+    void Step()
+    {
+        // Whatever was set from outside since the last Step, a register's
+        // value included, reaches the bus before the edge samples it
+        for(auto* b : blocks) {
+            if(!b->sampled.empty()) {
+                Queue(b);
+            }
+        }
+        Settle("low");
+
+        clock = true;
+        nclock = !clock;
+        Settle("high");
+
+        clock = false;
+        nclock = !clock;
+        Settle("low");
+        reset = false;
+        steps++;
+    }
+
+    // Put program into RAM and flash, in bank, between Steps, as
+    // LoadProgram() does for the instruction engines
+    void Load(const ProgramFile& program, uint32_t bank)
+    {
+        program.forEach(bank, [this](uint32_t offset, uint8_t data) {
+            if(offset >= FlashSize) {
+                Memory.RAM[offset - FlashSize] = data;
+            } else {
+                Memory.Flash.write(offset, data);
+            }
+        });
+        // what's at the address Memory has been driving may be new
+        Queue(&Memory);
+    }
+
+    // Set PC to address between Steps, as --start does; false if PC can't
+    // change yet, while reset holds the counters or before the step
+    // counter comes back round to fetch
+    bool Jump(uint16_t address)
+    {
+        if(reset || (StepCounter.value != 0)) {
+            return false;
+        }
+        PCLRegister.value = address & 0xFF;
+        PCHRegister.value = address >> 8;
+        // so they drive their new value
+        Queue(&PCLRegister);
+        Queue(&PCHRegister);
+        return true;
+    }
+
+    // Save or restore the whole System between Steps: every signal and what
+    // the scheduler last saw on it, what's pending, the counts, and each
+    // block's internal state.  Only a System wired the same way can restore.
+    void Snapshot(SnapshotArchive& archive)
+    {
+        archive.header(SnapshotArchive::GateLevel);
+        uint32_t count = signals.size();
+        archive.field(count);
+        if(count != signals.size()) {
+            throw std::string("snapshot is of a System wired differently");
+        }
+        for(size_t i = 0; i < signals.size(); i++) {
+            uint32_t value = signals[i].value();
+            archive.field(value);
+            if(archive.restoring) {
+                signals[i].restore(value);
+            }
+            archive.field(signalValues[i]);
+        }
+        archive.field(pending);
+        archive.field(sweeps);
+        archive.field(extraSweeps);
+        archive.field(steps);
+        for(auto* b : blocks) {
+            archive.field(b->evaluations);
+            archive.field(b->changes);
+            b->Snapshot(archive);
+        }
+        archive.trailer();
+    }
+
+    void ReportBlockStatistics(FILE *fp)
+    {
+        fprintf(fp, "%-24s %12s %12s\n", "block", "evaluated", "changed");
+        for(auto* b : blocks) {
+            fprintf(fp, "%-24s %12llu %12llu\n", b->name.c_str(), (unsigned long long)b->evaluations, (unsigned long long)b->changes);
+        }
+        fprintf(fp, "%llu sweeps, %llu of them extra sweeps for feedback\n", (unsigned long long)sweeps, (unsigned long long)extraSweeps);
+    }
+
+    // Print the evaluation order and, for each feedback loop, its blocks and
+    // the shortest cycle back to each of them
+    void ReportLevelization(FILE *fp)
+    {
+        fprintf(fp, "evaluation order:\n");
+        for(auto* b : order) {
+            fprintf(fp, "    %2d %s\n", b->level, b->name.c_str());
+        }
+        for(size_t l = 0; l < loops.size(); l++) {
+            fprintf(fp, "feedback loop %zu:", l);
+            for(auto* b : loops[l]) {
+                fprintf(fp, " %s", b->name.c_str());
+            }
+            fprintf(fp, "\n");
+
+            std::set<std::vector<int>> printed;
+            for(auto* start : loops[l]) {
+                // breadth-first search for the shortest way back to start
+                std::vector<int> from(blocks.size(), -1);
+                std::queue<int> frontier;
+                int s = BlockIndex(start);
+                std::vector<int> cycle;
+                for(int w : Successors(start)) {
+                    if(w == s) {
+                        cycle = {s};
+                        break;
+                    }
+                    if(from[w] < 0) {
+                        from[w] = s;
+                        frontier.push(w);
+                    }
+                }
+                while(cycle.empty() && !frontier.empty()) {
+                    int v = frontier.front();
+                    frontier.pop();
+                    for(int w : Successors(blocks[v])) {
+                        if(w == s) {
+                            for(int u = v; u != s; u = from[u]) {
+                                cycle.push_back(u);
+                            }
+                            cycle.push_back(s);
+                            std::reverse(cycle.begin(), cycle.end());
+                            break;
+                        }
+                        if(from[w] < 0) {
+                            from[w] = v;
+                            frontier.push(w);
+                        }
+                    }
+                }
+                std::vector<int> members = cycle;
+                std::sort(members.begin(), members.end());
+                if(cycle.empty() || !printed.insert(members).second) {
+                    continue;
+                }
+                fprintf(fp, "    ");
+                for(int v : cycle) {
+                    fprintf(fp, "%s -> ", blocks[v]->name.c_str());
+                }
+                fprintf(fp, "%s\n", start->name.c_str());
+            }
+        }
+    }
+};
+
+#if EMU_FORK_SERVER
+// Read or write all size bytes, through short counts and interruptions
+bool ReadAll(int fd, void *p, size_t size)
+{
+    uint8_t *b = static_cast<uint8_t *>(p);
+    while(size > 0) {
+        ssize_t n = read(fd, b, size);
+        if((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if(n <= 0) {
+            return false;
+        }
+        b += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool WriteAll(int fd, const void *p, size_t size)
+{
+    const uint8_t *b = static_cast<const uint8_t *>(p);
+    while(size > 0) {
+        ssize_t n = write(fd, b, size);
+        if((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if(n <= 0) {
+            return false;
+        }
+        b += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Run one fork-server job from connection on this machine.  A job is a line
+// "CYCLES INPUT_BYTES" and then that many bytes of UART input.  The reply is
+// a line "OUTPUT_BYTES INSTRUCTIONS CYCLES MICROSECONDS STATUS", STATUS
+// being "ok", or "stopped" if the CPU stopped before its cycles ran out,
+// and then the UART output; a job that can't be read gets "error".
+bool ServeJob(int connection, MinimalEmulator<Memory,Interface>& cpu, Memory& memory, Interface& interface, Clock& systemClock)
+{
+    constexpr size_t MaxInputBytes = 64 * 1024 * 1024;
+    char line[128];
+    size_t length = 0;
+    while(true) {
+        if((length == sizeof(line) - 1) || !ReadAll(connection, &line[length], 1)) {
+            return false;
+        }
+        if(line[length] == '\n') {
+            break;
+        }
+        length++;
+    }
+    line[length] = '\0';
+    unsigned long long cycles;
+    size_t inputBytes;
+    std::vector<uint8_t> input;
+    if((sscanf(line, "%llu %zu", &cycles, &inputBytes) != 2) || (inputBytes > MaxInputBytes) ||
+        (input.resize(inputBytes), !ReadAll(connection, input.data(), input.size())))
+    {
+        WriteAll(connection, "error\n", 6);
+        return false;
+    }
+    for(uint8_t byte : input) {
+        interface.inputBuffer.push(byte);
+    }
+
+    std::vector<uint8_t> output;
+    interface.capture = &output;
+    uint64_t instructions = cpu.instructions;
+    clk_t start = systemClock.clocks;
+    auto then = std::chrono::steady_clock::now();
+    bool finished = RunUntil(cpu, memory, interface, systemClock, start + cycles);
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - then);
+    interface.capture = nullptr;
+
+    char reply[128];
+    int size = snprintf(reply, sizeof(reply), "%zu %llu %llu %lld %s\n", output.size(),
+        (unsigned long long)(cpu.instructions - instructions), (unsigned long long)(systemClock.clocks - start),
+        (long long)elapsed.count(), finished ? "ok" : "stopped");
+    return WriteAll(connection, reply, size) && WriteAll(connection, output.data(), output.size());
+}
+
+// Serve jobs on socket_path, each in a fork of this process so it starts
+// from the machine as it is now, sharing its RAM, flash and decoded code
+// copy-on-write with every other job
+void RunForkServer(const std::string& socket_path, MinimalEmulator<Memory,Interface>& cpu, Memory& memory, Interface& interface, Clock& systemClock)
+{
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if(socket_path.size() >= sizeof(address.sun_path)) {
+        fprintf(stderr, "socket path %s is too long\n", socket_path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+    unlink(socket_path.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if((listener < 0) || (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) || (listen(listener, SOMAXCONN) != 0)) {
+        fprintf(stderr, "couldn't listen on %s: %s\n", socket_path.c_str(), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    // Jobs are reaped as they finish, and one whose client went away just ends
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "serving jobs on %s\n", socket_path.c_str());
+    while(true) {
+        int connection = accept(listener, nullptr, nullptr);
+        if(connection < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "couldn't accept a job: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        // anything still buffered would be written again by the job
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if(pid == 0) {
+            close(listener);
+            ServeJob(connection, cpu, memory, interface, systemClock);
+            // the server's exit handlers, like --save-flash, aren't the job's
+            _exit(EXIT_SUCCESS);
+        }
+        if(pid < 0) {
+            fprintf(stderr, "couldn't fork for a job: %s\n", strerror(errno));
+        }
+        close(connection);
+    }
+}
+#endif
+
+// Count heap allocations so tests can check that hot paths never allocate.
+// The bridge thread allocates too, so the count is atomic.  Kept out of
+// line so the compiler pairs new with delete rather than seeing malloc()
+// meet a library operator delete.
+std::atomic<uint64_t> HeapAllocations {0};
+
+EMU_NOINLINE void* operator new(size_t size)
+{
+    HeapAllocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size);
+    if(!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+EMU_NOINLINE void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+EMU_NOINLINE void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+void TestSystem()
+{
+    {
+        System sys; sys.MicrocodeROM.disableForDebug = true;
+
+        if(debug) printf("Reset test\n");
+        sys.reset = true;
+        sys.Step();
+        sys.reset = false;
+        assert((sys.StepCounter.value == 0) && "reset StepCounter");
+        assert((sys.ARegister.value == 0) && "reset ARegister");
+        assert((sys.BRegister.value == 0) && "reset BRegister");
+        assert((sys.MainBus == 0xFF) && "MainBus unasserted is 0xFF");
+        sys.Step();
+        assert((sys.StepCounter.value == 1) && "increment StepCounter");
+    }
+
+    {
+        System sys; sys.MicrocodeROM.disableForDebug = true; sys.reset = true; sys.Step(); sys.reset = false;
+
+        if(debug) printf("Clock test 1\n");
+        sys.AOSignal = true;
+        sys.BISignal = true;
+        sys.ARegister.value = 0x5a;
+        sys.BRegister.value = 0x00;
+        sys.Step();
+        assert((sys.BRegister.value == 0x5a) && "load BRegister");
+        assert((sys.StepCounter.value == 1) && "increment StepCounter");
+    }
+
+    {
+        System sys; sys.MicrocodeROM.disableForDebug = true; sys.reset = true; sys.Step(); sys.reset = false;
+
+        if(debug) printf("PCL PCH test\n");
 
         sys.AOSignal = true;
         sys.ARegister.value = 0xca;
@@ -1028,12 +1692,12 @@ void TestSystem()
         sys.MAHRegister = 0x13;
         sys.MALRegister = 0x37;
         sys.BANKRegister = 0x5;
-        sys.Memory.Flash[(0x5 << 11) | 0x1337] = 0x5a;
+        sys.Memory.Flash.write((0x5 << 15) | 0x1337, 0x5a);
         sys.AOSignal = true;
         sys.ARegister.value = 0xCA;
         sys.RISignal = true;
         sys.Step();
-        assert((sys.Memory.Flash[(0x5 << 11) | 0x1337] == 0xCA) && "write Flash");
+        assert((sys.Memory.Flash[(0x5 << 15) | 0x1337] == 0xCA) && "write Flash");
     }
 
     {
@@ -1057,10 +1721,10 @@ void TestSystem()
         sys.MAHRegister = 0x06;
         sys.MALRegister = 0x66;
         sys.BANKRegister = 0x6;
-        sys.Memory.Flash[(0x6 << 11) | 0x0666] = 0x3F;
+        sys.Memory.Flash.write((0x6 << 15) | 0x0666, 0x3F);
         sys.ROSignal = true;
         sys.Step();
-        assert((sys.Memory.Flash[(0x6 << 11) | 0x0666] == 0x3F) && "read Flash");
+        assert((sys.Memory.Flash[(0x6 << 15) | 0x0666] == 0x3F) && "read Flash");
     }
 
     {
@@ -1115,220 +1779,1195 @@ void TestSystem()
     testALU("invert 0xFF", 0, 0xFF, false, true, true, 0x0, 1, 1);
     testALU("128+128 overflow, no EOFI", 0x80, 0x80, false, false, false, 0xFF, 3, 0);
     testALU("invert 0x55, no EOFI", 0, 0x55, false, true, false, 0xFF, 4, 0);
+
+    {
+        System sys; sys.MicrocodeROM.disableForDebug = true; sys.reset = true; sys.Step(); sys.reset = false;
+
+        if(debug) printf("Step allocation test\n");
+
+        uint64_t before = HeapAllocations;
+        sys.ARegister.value = 0x5a;
+        sys.AOSignal = true;
+        sys.BISignal = true;
+        sys.CEMESignal = true;
+        sys.Step();
+        sys.Step();
+        sys.AOSignal = false;
+        sys.BISignal = false;
+        sys.ROSignal = true;
+        sys.AISignal = true;
+        sys.Step();
+        sys.ROSignal = false;
+        sys.AISignal = false;
+        sys.EOFISignal = true;
+        sys.Step();
+        assert((HeapAllocations == before) && "Step does not allocate");
+    }
+    {
+        System sys; sys.MicrocodeROM.disableForDebug = true; sys.reset = true; sys.Step(); sys.reset = false;
+
+        if(debug) printf("Trace test\n");
+
+        TraceCategories = TraceCounter;
+        TraceLog.written = 0;
+        sys.CEMESignal = true;
+        sys.Step();
+        sys.CEMESignal = false;
+        TraceCategories = 0;
+        bool incremented = false;
+        for(uint64_t i = 0; i < TraceLog.written; i++) {
+            const TraceRecord& r = TraceLog.records[i];
+            assert((r.event == TraceCounterIncrement) || (r.event == TraceCounterOutput));
+            incremented = incremented || ((r.event == TraceCounterIncrement) && (r.name == sys.PCLRegister.nameIndex) && (r.value == 1));
+        }
+        assert(incremented && "Counter increments are traced");
+        TraceLog.written = 0;
+
+        TraceCategories = TraceStep;
+        sys.steps = 0x123456789ull;
+        sys.Step();
+        TraceCategories = 0;
+        const TraceRecord& phase = TraceLog.records[0];
+        assert((phase.event == TraceClockPhase) && (TraceRing::ClockPhaseStep(phase) == 0x123456789ull) && "step counts past 32 bits are traced whole");
+        TraceLog.written = 0;
+    }
 }
 
-template <class MEMORY, class INTERFACE>
-struct MinimalEmulator
+// The page table, the flash chip's commands and handlers mapped over pages
+void TestMemory()
 {
-    uint64_t cpuClockLengthInSystemClocks;
-    Clock mostRecentSystemClock;
+    if(debug) printf("Memory test\n");
+
+    std::vector<uint8_t> bytes(FlashSize, 0xFF);
+    bytes[3 * 0x8000 + 0x1234] = 0x5A;
+    static auto image = std::make_shared<const FlashImage>(bytes);
+    static Memory memory(image);
+    uint8_t data;
+
+    memory.setBank(3);
+    memory.read(0x1234, data);
+    assert((data == 0x5A) && "BNK maps the bank over the lower 32K");
+    assert(memory.write(0x8123, 0x77) && (memory.RAM[0x0123] == 0x77) && (memory.writtenFirst == FlashSize + 0x0123) && "RAM writes land");
+    memory.read(0x8123, data);
+    assert((data == 0x77) && "RAM reads back");
+
+    assert(!memory.write(0x1234, 0x00) && (memory.flash[3 * 0x8000 + 0x1234] == 0x5A) && "plain flash writes are ignored");
+
+    auto command = [&](uint8_t code) {
+        memory.write(FlashCommands::Unlock1, 0xAA);
+        memory.write(FlashCommands::Unlock2, 0x55);
+        return memory.write(FlashCommands::Unlock1, code);
+    };
+    command(0xA0);
+    assert(memory.write(0x1234, 0x0F) && (memory.flash[3 * 0x8000 + 0x1234] == 0x0A) && (memory.writtenFirst == 3 * 0x8000 + 0x1234) && "programming clears bits");
+    assert(!memory.write(0x1234, 0x00) && (memory.flash[3 * 0x8000 + 0x1234] == 0x0A) && "programming takes one byte");
+    assert((memory.flash.dirtyPages() == 1) && (image->data[3 * 0x8000 + 0x1234] == 0x5A) && "programming copies the page, leaving the image alone");
+    memory.read(0x1233, data);
+    assert((data == 0xFF) && "the copied page keeps the rest of its bytes");
+    memory.read(0x1234, data);
+    assert((data == 0x0A) && "the programmed byte reads back through the remapped page");
+
+    command(0x80);
+    memory.write(FlashCommands::Unlock1, 0xAA);
+    memory.write(FlashCommands::Unlock2, 0x55);
+    assert(memory.write(0x1000, 0x30) && (memory.writtenFirst == 3 * 0x8000 + 0x1000) && (memory.writtenLast == 3 * 0x8000 + 0x1FFF) && "sector erase reports its sector");
+    assert((memory.flash[3 * 0x8000 + 0x1234] == 0xFF) && "sector erase sets bytes to 0xFF");
+    memory.read(0x1234, data);
+    assert((data == 0xFF) && "the erased sector reads back through its remapped pages");
+
+    assert(command(0x90) && "ID entry changes flash");
+    memory.read(0x0000, data);
+    assert((data == FlashCommands::ManufacturerID) && "ID mode reads the manufacturer");
+    memory.read(0x0001, data);
+    assert((data == FlashCommands::DeviceID) && "ID mode reads the device");
+    assert(memory.write(0x0000, 0xF0) && "ID exit changes flash");
+    memory.read(0x1234, data);
+    assert((data == 0xFF) && "flash reads again after ID exit");
+
+    struct CountingHandler : public MemoryHandler
+    {
+        int reads = 0;
+        int writes = 0;
+        virtual bool read(Memory& memory, uint16_t address, uint8_t& data) { reads++; data = address & 0xFF; return true; }
+        virtual bool write(Memory& memory, uint16_t address, uint8_t data) { writes++; return false; }
+    } handler;
+    memory.mapHandler(0xFE00, Memory::PageSize, &handler);
+    memory.read(0xFE42, data);
+    memory.write(0xFE42, 0x99);
+    assert((data == 0x42) && (handler.reads == 1) && (handler.writes == 1) && (memory.RAM[0x7E42] != 0x99) && "handlers take their pages");
+    memory.mapHandler(0xFE00, Memory::PageSize, nullptr);
+    memory.write(0xFE42, 0x99);
+    assert((memory.RAM[0x7E42] == 0x99) && "unmapping a handler restores RAM");
+
+    static Memory copy;
+    copy = memory;
+    copy.write(0x8123, 0x11);
+    assert((memory.RAM[0x0123] == 0x77) && (copy.RAM[0x0123] == 0x11) && "copies have their own pages");
+
+    // Many machines on one image each keep just RAM and the pages they wrote
+    static_assert(sizeof(Memory) < RAMSize + 16 * 1024, "Memory doesn't hold flash");
+    std::vector<std::unique_ptr<Memory>> machines;
+    long users = image.use_count();
+    for(int i = 0; i < 1000; i++) {
+        machines.push_back(std::make_unique<Memory>(image));
+    }
+    assert((image.use_count() == users + 1000) && "machines share the image");
+    Memory& programmed = *machines[500];
+    programmed.setBank(3);
+    programmed.write(FlashCommands::Unlock1, 0xAA);
+    programmed.write(FlashCommands::Unlock2, 0x55);
+    programmed.write(FlashCommands::Unlock1, 0xA0);
+    programmed.write(0x1234, 0x00);
+    machines[501]->setBank(3);
+    machines[501]->read(0x1234, data);
+    assert((programmed.flash[3 * 0x8000 + 0x1234] == 0x00) && (data == 0x5A) && "a machine's flash writes are its own");
+    assert((programmed.flash.dirtyPages() == 1) && (machines[501]->flash.dirtyPages() == 0) && "only the machine that wrote has a dirty page");
+    machines.clear();
+    assert((image.use_count() == users) && "machines let go of the image");
+}
 
-    enum StepResult {
-        CONTINUE,
-        EXIT,
+// Load programs from binary and Intel HEX straight into memory under a
+// running CPU, and into the gate-level System
+void TestProgramLoad()
+{
+    if(debug) printf("Program load test\n");
+
+    auto text = [](const std::string& s) { return std::vector<uint8_t>(s.begin(), s.end()); };
+    // LDI 'B'; OUT; JPA 0x8003 at 0x8000 and a start address of 0x8000
+    ProgramFile hex = ProgramFile::Parse(text(":088000000E420214038000008F\r\n:040000050000800077\n:00000001FF\n"), 0, "test.hex");
+    assert((hex.segments.size() == 1) && (hex.segments[0].address == 0x8000) && (hex.segments[0].bytes.size() == 8) && "Intel HEX data records load");
+    assert(hex.hasStart && (hex.start == 0x8000) && "Intel HEX start address records load");
+    assert((ProgramFile::Parse(text(":040000050000800077\n"), 0x10, "test.hex").start == 0x8010) && "start addresses move with the load");
+    auto refuses = [&](const std::string& contents, uint16_t address) {
+        try {
+            ProgramFile::Parse(text(contents), address, "bad");
+        } catch(const std::string& error) {
+            return true;
+        }
+        return false;
     };
+    assert(refuses(":088000000E4202140380000090\n", 0) && "bad checksums are refused");
+    assert(refuses(":020000040001F9\n", 0) && "addresses past 64K are refused");
+    assert(refuses("0123456789", 0xFFFA) && "binaries running past 0xFFFF are refused");
+
+    // LDI 'A'; OUT; JPA 0x8003 runs, then the HEX program goes over it
+    static Memory memory;
+    ProgramFile binary = ProgramFile::Parse({OpLDI, 'A', OpOUT, OpJPA, 0x03, 0x80}, 0x8000, "test.bin");
+    for(int engine = 0; engine < 3; engine++) {
+        memory = Memory();
+        Clock systemClock(SystemClockRate);
+        Interface interface(systemClock);
+        std::vector<uint8_t> output;
+        interface.capture = &output;
+        MinimalEmulator<Memory, Interface> cpu(CPUClockRate, systemClock);
+        if(engine == 1) {
+            cpu.enableTranslationCache();
+        } else if(engine == 2) {
+#if EMU_JIT
+            cpu.enableJit();
+            cpu.jitThreshold = 1;
+#else
+            cpu.enableFusion();
+#endif
+        }
+        LoadProgram(cpu, memory, binary, 0, true, 0x8000);
+        RunUntil(cpu, memory, interface, systemClock, 1000);
+        LoadProgram(cpu, memory, hex, 0, true, hex.start);
+        RunUntil(cpu, memory, interface, systemClock, 2000);
+        assert((output == std::vector<uint8_t>{'A', 'B'}) && "a loaded program runs in place of the one it replaces");
+    }
 
-    MinimalEmulator(uint64_t CPUClockRate, const Clock& systemClock) :
-        mostRecentSystemClock(systemClock)
-    {
-        assert(systemClock.rate % CPUClockRate == 0);
-        cpuClockLengthInSystemClocks = systemClock.rate / CPUClockRate;
+    // flash goes in the bank asked for
+    memory = Memory();
+    memory.load(ProgramFile::Parse({0x12, 0x34}, 0x7FFF, "test.bin"), 5);
+    assert((memory.flash[5 * 0x8000 + 0x7FFF] == 0x12) && (memory.RAM[0] == 0x34) && "loads go to flash in a bank and on into RAM");
+
+    System sys;
+    sys.Load(ProgramFile::Parse({0x12, 0x34}, 0x7FFF, "test.bin"), 5);
+    assert((sys.Memory.Flash[(0x5 << 15) | 0x7FFF] == 0x12) && (sys.Memory.RAM[0] == 0x34) && "gate-level loads land where RAMAndFlash reads");
+    assert((sys.Memory.Flash[0x2FFF] != 0x12) && "a bank's flash doesn't overlap another's");
+
+    // --start on the gate level waits for reset, then runs on from there
+    System jumping;
+    // NOPs to run on through
+    jumping.Memory.RAM.fill(0);
+    assert(!jumping.Jump(0x8000) && "no jump while reset holds PC");
+    jumping.Step();
+    assert(jumping.Jump(0x8000) && "jump once out of reset");
+    for(int i = 0; i < 16; i++) {
+        jumping.Step();
     }
+    uint16_t pc = (jumping.PCHRegister.value << 8) | jumping.PCLRegister.value;
+    assert((pc > 0x8000) && (pc < 0x8010) && "gate level runs on from the jump");
+}
+
+// Snapshot machines part way through a run, restore them into fresh ones,
+// and check both carry on exactly alike
+void TestSnapshot()
+{
+    if(debug) printf("Snapshot test\n");
+
+    std::vector<uint8_t> bytes(FlashSize, 0xFF);
+    static auto image = std::make_shared<const FlashImage>(bytes);
 
-    StepResult step(MEMORY& memory, INTERFACE& interface, const Clock& systemClock)
     {
-        abort();
-        return CONTINUE;
+        // Code in RAM programs 0x0200 in flash to 0, then loops on INP;
+        // STA 0x8100; INW 0x8102; JPA 0x8014
+        static Memory memory(image), restoredMemory(image);
+        const uint8_t program[] = {
+            OpLDI, 0xAA, OpSTA, 0x55, 0x55, OpLDI, 0x55, OpSTA, 0xAA, 0x2A, OpLDI, 0xA0, OpSTA, 0x55, 0x55,
+            OpLDI, 0x00, OpSTA, 0x00, 0x02,
+            OpINP, OpSTA, 0x00, 0x81, OpINW, 0x02, 0x81, OpJPA, 0x14, 0x80,
+        };
+        std::copy(std::begin(program), std::end(program), memory.RAM.begin());
+        Clock systemClock(SystemClockRate), restoredClock(SystemClockRate);
+        Interface interface(systemClock), restoredInterface(restoredClock);
+        for(int i = 0; i < 64; i++) {
+            interface.inputBuffer.push('a' + (i % 26));
+        }
+        MinimalEmulator<Memory, Interface> cpu(CPUClockRate, systemClock);
+        MinimalEmulator<Memory, Interface> restored(CPUClockRate, restoredClock);
+        restored.enableTranslationCache();
+        cpu.PC = 0x8000;
+
+        auto run = [&](clk_t until) {
+            cpu.updatePastClock(memory, interface, Clock(systemClock, until - 1));
+            systemClock.clocks = until;
+            restored.updatePastClock(restoredMemory, restoredInterface, Clock(restoredClock, until - 1));
+            restoredClock.clocks = until;
+        };
+        run(1500);
+        SnapshotArchive saved;
+        SnapshotMachine(saved, cpu, memory, interface, systemClock);
+        assert((memory.flash.dirtyPages() == 1) && !interface.inputBuffer.empty() && "snapshot taken mid-run");
+        assert((saved.data.size() < 2048) && "snapshot keeps flash as a hash and dirty pages, and only RAM in use");
+
+        SnapshotArchive archive(saved.data);
+        SnapshotMachine(archive, restored, restoredMemory, restoredInterface, restoredClock);
+        for(int chunk = 1; chunk <= 10; chunk++) {
+            run(1500 + chunk * 300);
+            assert((cpu.A == restored.A) && (cpu.PC == restored.PC) && (cpu.flags == restored.flags) && "restored registers match");
+            assert((cpu.instructions == restored.instructions) && (cpu.mostRecentSystemClock.clocks == restored.mostRecentSystemClock.clocks) && "restored clocks match");
+            assert((memory.RAM == restoredMemory.RAM) && (restoredMemory.flash[0x0200] == 0x00) && "restored memory matches");
+            assert((interface.inputBuffer == restoredInterface.inputBuffer) && "restored UART input matches");
+        }
+        SnapshotArchive after, restoredAfter;
+        SnapshotMachine(after, cpu, memory, interface, systemClock);
+        SnapshotMachine(restoredAfter, restored, restoredMemory, restoredInterface, restoredClock);
+        assert((after.data == restoredAfter.data) && "restored machine is bit for bit the same");
+
+        auto refuses = [&](std::vector<uint8_t> data, Memory& target) {
+            static Memory scratch;
+            scratch = target;
+            Clock clock(SystemClockRate);
+            Interface scratchInterface(clock);
+            MinimalEmulator<Memory, Interface> scratchCPU(CPUClockRate, clock);
+            SnapshotArchive archive(std::move(data));
+            try {
+                SnapshotMachine(archive, scratchCPU, scratch, scratchInterface, clock);
+            } catch(const std::string& error) {
+                return true;
+            }
+            return false;
+        };
+        static Memory blank;
+        assert(refuses(saved.data, blank) && "snapshots only restore onto their own flash image");
+        assert(refuses(std::vector<uint8_t>(saved.data.begin(), saved.data.end() - 1), restoredMemory) && "truncated snapshots are refused");
+        std::vector<uint8_t> newer = saved.data;
+        newer[sizeof(SnapshotArchive::Magic)]++;
+        assert(refuses(newer, restoredMemory) && "other versions are refused");
     }
 
-    // Return the next system clock tick at which the CPU will have transitioned one CPU clock,
-    // that is to say return the least clock for which the CPU has to do some work.
-    clk_t calculateNextActivity()
     {
-        clk_t next = (mostRecentSystemClock.clocks + cpuClockLengthInSystemClocks - 1) / cpuClockLengthInSystemClocks * cpuClockLengthInSystemClocks;
-        // XXX debug printf("CPU next is %llu\n", next);
-        return next;
+        System sys; sys.MicrocodeROM.disableForDebug = true; sys.reset = true; sys.Step(); sys.reset = false;
+        sys.Memory.Flash = Flash(image);
+        sys.Memory.Flash.write(0x1234, 0x00);
+        sys.UART.inputBuffer.push('x');
+        sys.UART.inputBuffer.push('y');
+
+        // store A at successive RAM addresses
+        sys.MAHRegister = 0x80;
+        sys.MALRegister = 0x10;
+        sys.ARegister.value = 0x5A;
+        sys.AOSignal = true;
+        sys.RISignal = true;
+        sys.CEMESignal = true;
+        sys.Step();
+        sys.Step();
+
+        SnapshotArchive saved;
+        sys.Snapshot(saved);
+        System restored;
+        restored.Memory.Flash = Flash(image);
+        SnapshotArchive archive(saved.data);
+        restored.Snapshot(archive);
+        assert((restored.steps == sys.steps) && (restored.UART.inputBuffer.size() == 2) && "restored System matches");
+        for(int i = 0; i < 4; i++) {
+            sys.Step();
+            restored.Step();
+        }
+        assert((restored.Memory.RAM[0x0015] == 0x5A) && (restored.Memory.Flash[0x1234] == 0x00) && "restored System runs on");
+        SnapshotArchive after, restoredAfter;
+        sys.Snapshot(after);
+        restored.Snapshot(restoredAfter);
+        assert((after.data == restoredAfter.data) && "restored System is bit for bit the same");
+    }
+}
+
+#if EMU_FORK_SERVER
+// Serve a job over a socket pair, on this process's machine rather than a fork
+void TestForkServer()
+{
+    if(debug) printf("Fork server job test\n");
+
+    // INP; BEQ 0x8000; OUT; JPA 0x8000 echoes UART input
+    static Memory memory;
+    const uint8_t echo[] = { OpINP, OpBEQ, 0x00, 0x80, OpOUT, OpJPA, 0x00, 0x80 };
+    std::copy(std::begin(echo), std::end(echo), memory.RAM.begin());
+    Clock systemClock(SystemClockRate);
+    Interface interface(systemClock);
+    MinimalEmulator<Memory, Interface> cpu(CPUClockRate, systemClock);
+    cpu.PC = 0x8000;
+
+    int fds[2];
+    assert((socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) && "socket pair for the job");
+    const char job[] = "20000 5\nhello";
+    WriteAll(fds[0], job, strlen(job));
+    assert(ServeJob(fds[1], cpu, memory, interface, systemClock) && "job served");
+    close(fds[1]);
+    std::string reply;
+    char c;
+    while(ReadAll(fds[0], &c, 1)) {
+        reply += c;
     }
+    close(fds[0]);
+    unsigned long long outputBytes, instructions, cycles;
+    char status[16];
+    assert((sscanf(reply.c_str(), "%llu %llu %llu %*d %15s", &outputBytes, &instructions, &cycles, status) == 4) && "job reply");
+    assert((outputBytes == 5) && (reply.substr(reply.size() - 5) == "hello") && "job returns UART output");
+    assert((cycles == 20000) && (instructions > 0) && (strcmp(status, "ok") == 0) && "job returns statistics");
+    assert((interface.capture == nullptr) && "job output goes back to stdout after");
+}
+#endif
+
+#if EMU_UART_BRIDGE
+// Pass bytes through a ring between two threads, then echo bytes from a
+// pipe back out through a bridge
+void TestUARTBridge()
+{
+    if(debug) printf("UART bridge test\n");
 
-    // Do work associated with CPU clock transitioning to active,
-    // after mostRecentSystemClock and up to and including systemClock.
-    // Do not repeat work if called twice with same clock.
-    StepResult updatePastClock(MEMORY& memory, INTERFACE& interface, const Clock& systemClock)
     {
-        for(uint64_t clock = calculateNextActivity(); clock <= systemClock.clocks; clock += cpuClockLengthInSystemClocks) {
-            StepResult result = step(memory, interface, Clock(systemClock, clock));
-            if(result != CONTINUE) {
-                return result;
+        static ByteRing<256> ring;
+        constexpr uint32_t Count = 100000;
+        std::thread producer([]() {
+            for(uint32_t i = 0; i < Count; ) {
+                uint8_t bytes[7];
+                size_t size = std::min<uint32_t>(sizeof(bytes), Count - i);
+                for(size_t j = 0; j < size; j++) {
+                    bytes[j] = (i + j) * 31;
+                }
+                size_t pushed = ring.push(bytes, size);
+                if(pushed == 0) {
+                    std::this_thread::yield();
+                }
+                i += pushed;
+            }
+        });
+        bool inOrder = true;
+        for(uint32_t i = 0; i < Count; ) {
+            uint8_t byte;
+            if(ring.pop(byte)) {
+                inOrder = inOrder && (byte == (uint8_t)(i * 31));
+                i++;
+            } else {
+                std::this_thread::yield();
             }
         }
-        mostRecentSystemClock = systemClock + 1;
-        // XXX debug printf("systemClock is %llu, most recent is now %llu\n", systemClock.clocks, mostRecentSystemClock.clocks);
-        return CONTINUE;
+        producer.join();
+        assert(inOrder && "ring passes bytes in order between threads");
     }
-};
 
-struct Memory
+    // INP; BEQ 0x8000; OUT; JPA 0x8000 echoes UART input
+    static Memory memory;
+    const uint8_t echo[] = { OpINP, OpBEQ, 0x00, 0x80, OpOUT, OpJPA, 0x00, 0x80 };
+    std::copy(std::begin(echo), std::end(echo), memory.RAM.begin());
+    Clock systemClock(SystemClockRate);
+    Interface interface(systemClock);
+    MinimalEmulator<Memory, Interface> cpu(CPUClockRate, systemClock);
+    cpu.PC = 0x8000;
+
+    int input[2], output[2];
+    assert((pipe(input) == 0) && (pipe(output) == 0) && "pipes for the bridge");
+    std::string sent = "bridged";
+    {
+        auto bridge = UARTBridge::Open(input[0], output[1]);
+        interface.bridge = bridge.get();
+        assert(write(input[1], sent.data(), sent.size()) == (ssize_t)sent.size());
+        // the machine polls until the bridge thread has passed the input on
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while((bridge->received.tail.load() < sent.size()) && (std::chrono::steady_clock::now() < deadline)) {
+            RunUntil(cpu, memory, interface, systemClock, systemClock.clocks + 1000);
+        }
+        RunUntil(cpu, memory, interface, systemClock, systemClock.clocks + 10000);
+        interface.bridge = nullptr;
+        // the bridge writes what's left as it goes
+    }
+    close(output[1]);
+    std::string echoed;
+    char c;
+    while(read(output[0], &c, 1) == 1) {
+        echoed += c;
+    }
+    close(input[0]);
+    close(input[1]);
+    close(output[0]);
+    assert((echoed == sent) && "bridge carries input in and output out");
+}
+#endif
+
+// Clock the UART's line: output goes at the baud rate, input waits in the
+// FIFO, and a full FIFO does what it was told to with more
+void TestUARTTiming()
 {
-    std::array<uint8_t, FlashSize> flash;
-    std::array<uint8_t, RAMSize> RAM;
-    uint32_t bank = 0;
-    bool succeeded = false;
+    if(debug) printf("UART timing test\n");
+
+    // 9600 baud, 10 bits a frame: 960 frames a second
+    UARTTiming timing = UARTTiming::Parse("9600,8N1,4,drop");
+    assert((timing.baud == 9600) && (timing.frameBits() == 10) && (timing.fifoDepth == 4) && "UART timing parses");
 
-    Memory(const std::string& flash_file)
     {
-        FILE *fp = fopen(flash_file.c_str(), "rb");
-        if(!fp) {
-            throw "couldn't open " + flash_file;
+        // LDI 'A'; OUT; JPA 0x8000 sends faster than the line goes
+        static Memory memory;
+        const uint8_t program[] = { OpLDI, 'A', OpOUT, OpJPA, 0x00, 0x80 };
+        std::copy(std::begin(program), std::end(program), memory.RAM.begin());
+        Clock systemClock(SystemClockRate);
+        Interface interface(systemClock);
+        std::vector<uint8_t> output;
+        interface.capture = &output;
+        interface.setTiming(timing, systemClock.rate);
+        MinimalEmulator<Memory, Interface> cpu(CPUClockRate, systemClock);
+        cpu.PC = 0x8000;
+        RunUntil(cpu, memory, interface, systemClock, systemClock.rate);
+        assert((output.size() >= 958) && (output.size() <= 960) && "UART sends at the baud rate");
+        assert((interface.mostQueued > 1000) && "UART queues what it can't send yet");
+    }
+
+    // JPA 0x8000 never reads, so ten bytes in overrun a FIFO of four
+    for(auto overrun : { UARTTiming::OverrunDrop, UARTTiming::OverrunOverwrite, UARTTiming::OverrunHold }) {
+        static Memory memory;
+        const uint8_t program[] = { OpJPA, 0x00, 0x80 };
+        std::copy(std::begin(program), std::end(program), memory.RAM.begin());
+        Clock systemClock(SystemClockRate);
+        Interface interface(systemClock);
+        timing.overrun = overrun;
+        interface.setTiming(timing, systemClock.rate);
+        for(uint8_t byte = 0; byte < 10; byte++) {
+            interface.inputBuffer.push(byte);
+        }
+        MinimalEmulator<Memory, Interface> cpu(CPUClockRate, systemClock);
+        cpu.PC = 0x8000;
+        RunUntil(cpu, memory, interface, systemClock, 20 * interface.frameClocks);
+        std::vector<uint8_t> received;
+        uint8_t data;
+        while(interface.readUART(data)) {
+            received.push_back(data);
+        }
+        if(overrun == UARTTiming::OverrunDrop) {
+            assert((received == std::vector<uint8_t>{0, 1, 2, 3}) && (interface.overruns == 6) && "overrun drops what comes after");
+        } else if(overrun == UARTTiming::OverrunOverwrite) {
+            assert((received == std::vector<uint8_t>{0, 1, 2, 9}) && (interface.overruns == 6) && "overrun overwrites the newest");
+        } else {
+            assert((received == std::vector<uint8_t>{0, 1, 2, 3}) && (interface.overruns == 0) && (interface.inputBuffer.size() == 6) && "overrun holds the rest back");
         }
-        fseek(fp, 0, SEEK_END);
-        long size = ftell(fp);
-        assert(size == FlashSize);
-        fseek(fp, 0, SEEK_SET);
-        fread(flash.data(), flash.size(), 1, fp);
-        fclose(fp);
-        succeeded = true;
     }
 
-    void setBank(uint8_t bank_)
     {
-        assert(bank_ < 16);
-        bank = bank_;
+        // INP; BEQ 0x8000; OUT; JPA 0x8000 echoes a frame behind
+        static Memory memory;
+        const uint8_t program[] = { OpINP, OpBEQ, 0x00, 0x80, OpOUT, OpJPA, 0x00, 0x80 };
+        std::copy(std::begin(program), std::end(program), memory.RAM.begin());
+        Clock systemClock(SystemClockRate);
+        Interface interface(systemClock);
+        std::vector<uint8_t> output;
+        interface.capture = &output;
+        interface.setTiming(UARTTiming::Parse("115200,7E1"), systemClock.rate);
+        std::string sent = "Hello, world";
+        for(char c : sent) {
+            interface.inputBuffer.push(c | 0x80);
+        }
+        MinimalEmulator<Memory, Interface> cpu(CPUClockRate, systemClock);
+        cpu.PC = 0x8000;
+        RunUntil(cpu, memory, interface, systemClock, sent.size() * interface.frameClocks);
+        assert((output.size() < sent.size()) && "echo takes a frame each way");
+        RunUntil(cpu, memory, interface, systemClock, (sent.size() + 4) * interface.frameClocks);
+        assert((std::string(output.begin(), output.end()) == sent) && "seven data bits drop the eighth");
     }
+}
 
-    bool read(uint16_t address, uint8_t& data)
+// Record a session's UART input as it comes from the host at odd times,
+// then replay it on every engine with the line untimed and timed: the
+// bytes go in between the same two instructions, so the machines all end
+// up exactly where the recorded one did
+void TestUARTJournal()
+{
+    if(debug) printf("UART journal test\n");
+
+    // INB 0x8100; INP; BEQ 0x0000; OUT; LDA 0x8100; OUT; JPA 0x0000 sends
+    // back each byte and how many times it polled, which depends on just
+    // when the byte came; LDA 0x8100; INP; BEQ 0x0000; OUT; JPA 0x0000
+    // echoes, skipping the waits
+    const std::vector<std::vector<uint8_t>> programs = {
+        { OpINB, 0x00, 0x81, OpINP, OpBEQ, 0x00, 0x00, OpOUT, OpLDA, 0x00, 0x81, OpOUT, OpJPA, 0x00, 0x00 },
+        { OpLDA, 0x00, 0x81, OpINP, OpBEQ, 0x00, 0x00, OpOUT, OpJPA, 0x00, 0x00 },
+    };
+    const std::string typed = "replay me";
+    const clk_t end = SystemClockRate / 2;
+    for(const auto& program : programs) {
+        auto image = std::make_shared<const FlashImage>(program);
+        uint64_t hash = HashBytes(image->data, FlashSize);
+        for(bool timed : { false, true }) {
+            static Memory memory;
+            memory = Memory(image);
+            Clock systemClock(SystemClockRate);
+            Interface interface(systemClock);
+            std::vector<uint8_t> output;
+            interface.capture = &output;
+            if(timed) {
+                interface.setTiming(UARTTiming::Parse("9600"), systemClock.rate);
+            }
+            UARTBridge bridge;
+            interface.bridge = &bridge;
+            UARTJournal journal(systemClock.rate, hash);
+            interface.journal = &journal;
+            MinimalEmulator<Memory, Interface> cpu(CPUClockRate, systemClock);
+            // the host's bytes come in whenever its thread gets to them
+            for(size_t i = 0; i < typed.size(); i++) {
+                RunUntil(cpu, memory, interface, systemClock, systemClock.clocks + 12345 + 6789 * i);
+                bridge.received.push(typed[i]);
+            }
+            RunUntil(cpu, memory, interface, systemClock, end);
+            interface.bridge = nullptr;
+            std::string echoed;
+            for(size_t i = 0; i < output.size(); i += (program[0] == OpINB) ? 2 : 1) {
+                echoed += output[i];
+            }
+            assert((echoed == typed) && "recording passes input through");
+            assert((journal.data.size() <= 28 + typed.size() * 4) && "journal is a few bytes a byte");
+
+            for(int engine = 0; engine < 4; engine++) {
+                static Memory replayMemory;
+                replayMemory = Memory(image);
+                Clock replayClock(SystemClockRate);
+                Interface replayInterface(replayClock);
+                std::vector<uint8_t> replayOutput;
+                replayInterface.capture = &replayOutput;
+                if(timed) {
+                    replayInterface.setTiming(UARTTiming::Parse("9600"), replayClock.rate);
+                }
+                UARTJournal replay(journal.data, replayClock.rate, hash);
+                replayInterface.journal = &replay;
+                MinimalEmulator<Memory, Interface> replayed(CPUClockRate, replayClock);
+                if(engine == 1) {
+                    replayed.enableTranslationCache();
+                } else if(engine == 2) {
+                    replayed.enableFusion();
+                } else if(engine == 3) {
+#if EMU_JIT
+                    replayed.enableJit();
+                    replayed.jitThreshold = 1;
+#else
+                    replayed.enableTranslationCache();
+#endif
+                }
+                RunUntil(replayed, replayMemory, replayInterface, replayClock, end);
+                assert(replay.finished() && "replay fed all the input");
+                assert((replayOutput == output) && "replay sends what the session did");
+                assert((replayed.instructions == cpu.instructions) && (replayed.A == cpu.A) && (replayed.PC == cpu.PC) && (replayed.flags == cpu.flags) && "replay ends where the session did");
+                assert((replayMemory.RAM == memory.RAM) && "replay leaves memory as the session did");
+            }
+        }
+        auto refuses = [&](std::vector<uint8_t> data, uint64_t imageHash) {
+            try {
+                UARTJournal replay(std::move(data), SystemClockRate, imageHash);
+                while(replay.pending) {
+                    replay.advance();
+                }
+            } catch(const std::string& error) {
+                return true;
+            }
+            return false;
+        };
+        UARTJournal journal(SystemClockRate, hash);
+        journal.record(100000, 'x');
+        assert(!refuses(journal.data, hash) && "journal replays");
+        assert(refuses(journal.data, hash + 1) && "journals only replay onto their own flash image");
+        assert(refuses(std::vector<uint8_t>(journal.data.begin(), journal.data.end() - 1), hash) && "truncated journals are refused");
+    }
+}
+
+// A UART for the engine tests, fed from inputBuffer and writing to output
+struct TestInterface
+{
+    std::queue<uint8_t> inputBuffer;
+    std::vector<uint8_t> output;
+    void writeUART(uint8_t data) { output.push_back(data); }
+    bool readUART(uint8_t& data)
     {
-        if(address < 0x8000) {
-            data = flash.at(bank * 0x8000 + address);
-            return true;
+        if(inputBuffer.empty()) {
+            return false;
         }
-        data = RAM[address - 0x8000];
+        data = inputBuffer.front();
+        inputBuffer.pop();
         return true;
     }
-    bool write(uint16_t address, uint8_t data)
+};
+
+// Random bytes from a linear congruential generator, so a test's random
+// code and data are the same on every run
+struct TestRandom
+{
+    uint32_t seed;
+    uint32_t operator()()
     {
-        if(address >= 0x8000) {
-            data = RAM[address - 0x8000] = data;
-            return true;
-        }
-        return false;
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 16) & 0xFF;
     }
 };
 
-struct Interface
+// Run the instruction interpreter against the microcode engine on random
+// code and data and check that every instruction has the same effect.
+void TestEngines()
+{
+    if(debug) printf("Instruction interpreter and unrolled microcode versus microcode test\n");
+
+    TestRandom random{0x1337};
+
+    // The memories stay identical from trial to trial as long as the engines agree
+    std::vector<uint8_t> bytes(FlashSize);
+    for(auto& byte: bytes) { byte = random(); }
+    static auto image = std::make_shared<const FlashImage>(bytes);
+    static Memory memory1(image), memory2, memory3;
+    for(auto& byte: memory1.RAM) { byte = random(); }
+    memory2 = memory1;
+    memory3 = memory1;
+
+    for(int trial = 0; trial < 20000; trial++) {
+        uint8_t bank = random() & 0xF;
+        memory1.setBank(bank);
+        memory2.setBank(bank);
+        memory3.setBank(bank);
+
+        TestInterface interface1, interface2, interface3;
+        for(int i = 0; i < 4; i++) {
+            uint8_t c = random();
+            interface1.inputBuffer.push(c);
+            interface2.inputBuffer.push(c);
+            interface3.inputBuffer.push(c);
+        }
+
+        Clock clock(SystemClockRate);
+        MinimalEmulator<Memory, TestInterface> minimal(CPUClockRate, clock);
+        MicrocodeEmulator<Memory, TestInterface> microcode(CPUClockRate, clock);
+        UnrolledMicrocodeEmulator<Memory, TestInterface> unrolled(CPUClockRate, clock);
+        minimal.PC = microcode.PC = unrolled.PC = (random() << 8) | random();
+        minimal.A = microcode.A = unrolled.A = random();
+        minimal.flags = microcode.flags = unrolled.flags = random() & 0x7;
+        microcode.BANK = unrolled.BANK = bank;
+
+        for(int i = 0; i < 16; i++) {
+            clk_t before = minimal.mostRecentSystemClock.clocks;
+            minimal.step(memory1, interface1, Clock(clock, before));
+            int cycles = microcode.instruction(memory2, interface2);
+            assert((minimal.A == microcode.A) && "A matches microcode");
+            assert((minimal.PC == microcode.PC) && "PC matches microcode");
+            assert((minimal.flags == microcode.flags) && "flags match microcode");
+            assert((minimal.mostRecentSystemClock.clocks - before == (clk_t)cycles) && "cycles match microcode");
+            assert((memory1.bank == memory2.bank) && "BANK matches microcode");
+            assert((memory1.RAM == memory2.RAM) && "RAM matches microcode");
+            assert((interface1.output == interface2.output) && "UART output matches microcode");
+
+            int unrolledCycles = unrolled.instruction(memory3, interface3);
+            assert((unrolled.A == microcode.A) && (unrolled.B == microcode.B) && "A and B match microcode");
+            assert((unrolled.PC == microcode.PC) && (unrolled.MAR == microcode.MAR) && "PC and MAR match microcode");
+            assert((unrolled.flags == microcode.flags) && (unrolled.IR == microcode.IR) && "flags and IR match microcode");
+            assert((unrolledCycles == cycles) && "unrolled cycles match microcode");
+            assert((unrolled.BANK == microcode.BANK) && (memory3.RAM == memory2.RAM) && "BANK and RAM match microcode");
+            assert((interface3.output == interface2.output) && "unrolled UART output matches microcode");
+        }
+    }
+}
+
+// Run the instruction interpreter with and without the translation cache,
+// and with the JIT compiling every block, on random code, which writes over
+// itself and switches banks freely, and on a loop that rewrites its own
+// immediate operand.
+void TestTranslationCache()
 {
-    bool succeeded = false;
-    Clock mostRecentSystemClock;
+    if(debug) printf("Translation cache test\n");
+
+    TestRandom random{0x5eed};
+
+    std::vector<uint8_t> bytes(FlashSize);
+    for(auto& byte: bytes) { byte = random(); }
+    static auto image = std::make_shared<const FlashImage>(bytes);
+    static Memory memory1(image), memory2, memory3;
+    for(auto& byte: memory1.RAM) { byte = random(); }
+    memory2 = memory1;
+    memory3 = memory1;
+
+    auto check = [](auto& plain, auto& other, Memory& plainMemory, Memory& otherMemory, TestInterface& plainInterface, TestInterface& otherInterface) {
+        assert((plain.A == other.A) && (plain.PC == other.PC) && (plain.flags == other.flags) && "translated registers match");
+        assert((plain.instructions == other.instructions) && "translated instruction count matches");
+        assert((plain.mostRecentSystemClock.clocks == other.mostRecentSystemClock.clocks) && "translated cycles match");
+        assert((plainMemory.bank == otherMemory.bank) && (plainMemory.RAM == otherMemory.RAM) && "translated memory matches");
+        assert((plainInterface.output == otherInterface.output) && "translated UART output matches");
+    };
+
+    for(int trial = 0; trial < 200; trial++) {
+        TestInterface interface1, interface2, interface3;
+        Clock clock(SystemClockRate);
+        MinimalEmulator<Memory, TestInterface> plain(CPUClockRate, clock);
+        MinimalEmulator<Memory, TestInterface> translated(CPUClockRate, clock);
+        MinimalEmulator<Memory, TestInterface> compiled(CPUClockRate, clock);
+        translated.enableTranslationCache();
+#if EMU_JIT
+        compiled.enableJit();
+        compiled.jitThreshold = 1;
+#else
+        compiled.enableTranslationCache();
+#endif
+        plain.PC = translated.PC = compiled.PC = (random() << 8) | random();
+        // run some in RAM, where stores land on code
+        if(trial & 1) {
+            plain.PC = translated.PC = compiled.PC = plain.PC | 0x8000;
+        }
+
+        for(int chunk = 1; chunk <= 8; chunk++) {
+            Clock until(clock, chunk * 500);
+            plain.updatePastClock(memory1, interface1, until);
+            translated.updatePastClock(memory2, interface2, until);
+            compiled.updatePastClock(memory3, interface3, until);
+            check(plain, translated, memory1, memory2, interface1, interface2);
+            check(plain, compiled, memory1, memory3, interface1, interface3);
+        }
+    }
 
-    bool attemptIterate()
     {
-        return true;
+        // A counting loop the JIT compiles whole, LDI 0; INB 0x8100;
+        // LDA 0x8100; ADI 3; CPI 0x10; BNE 2; ADA 0x8100; JPA 0x0002
+        static auto image = std::make_shared<const FlashImage>(std::vector<uint8_t>{ OpLDI, 0, OpINB, 0x00, 0x81, OpLDA, 0x00, 0x81, OpADI, 3, OpCPI, 0x10, OpBNE, 0x02, 0x00, OpADA, 0x00, 0x81, OpJPA, 0x02, 0x00 });
+        static Memory plainMemory(image), compiledMemory(image);
+        TestInterface plainInterface, compiledInterface;
+        Clock clock(SystemClockRate);
+        MinimalEmulator<Memory, TestInterface> plain(CPUClockRate, clock);
+        MinimalEmulator<Memory, TestInterface> compiled(CPUClockRate, clock);
+#if EMU_JIT
+        compiled.enableJit();
+#else
+        compiled.enableTranslationCache();
+#endif
+        for(int chunk = 1; chunk <= 20; chunk++) {
+            Clock until(clock, chunk * 1000);
+            plain.updatePastClock(plainMemory, plainInterface, until);
+            compiled.updatePastClock(compiledMemory, compiledInterface, until);
+            check(plain, compiled, plainMemory, compiledMemory, plainInterface, compiledInterface);
+        }
+#if EMU_JIT
+        // Filling the code buffer throws all native code away; the loop is
+        // hot, so it's compiled again rather than left to the interpreter
+        uint32_t generation = compiled.jit->generation;
+        compiled.jit->add(std::vector<uint8_t>(JitCodeBuffer::Size, 0xC3));
+        assert((compiled.jit->generation == generation + 1) && "a full code buffer wraps");
+        for(int chunk = 21; chunk <= 30; chunk++) {
+            Clock until(clock, chunk * 1000);
+            plain.updatePastClock(plainMemory, plainInterface, until);
+            compiled.updatePastClock(compiledMemory, compiledInterface, until);
+            check(plain, compiled, plainMemory, compiledMemory, plainInterface, compiledInterface);
+        }
+        const TranslationCache::Block& loop = compiled.cache->blocks[compiled.cache->find(TranslationCache::Key(0, 0x0002))];
+        assert(loop.native && (loop.nativeGeneration == compiled.jit->generation) && "hot blocks are compiled again after the code buffer wraps");
+
+        // The loop's INB is traced the same with the JIT as without
+        auto RAMWrites = [&](MinimalEmulator<Memory, TestInterface>& cpu, Memory& memory) {
+            TestInterface interface;
+            TraceCategories = TraceMemory;
+            TraceLog.written = 0;
+            cpu.updatePastClock(memory, interface, Clock(clock, 5000));
+            TraceCategories = 0;
+            uint64_t writes = 0;
+            for(uint64_t i = 0; i < TraceLog.written; i++) {
+                writes += (TraceLog.records[i].event == TraceRAMWrite);
+            }
+            TraceLog.written = 0;
+            return writes;
+        };
+        static Memory interpretedMemory(image), tracedMemory(image);
+        MinimalEmulator<Memory, TestInterface> interpreted(CPUClockRate, clock);
+        MinimalEmulator<Memory, TestInterface> traced(CPUClockRate, clock);
+        traced.enableJit();
+        traced.jitThreshold = 1;
+        uint64_t writes = RAMWrites(interpreted, interpretedMemory);
+        assert((writes > 0) && (RAMWrites(traced, tracedMemory) == writes) && "the JIT's RAM writes are traced");
+#endif
+
+        // The same loop as emu-minimal-aot would write it, leaving LDI 0
+        // to the interpreter
+        typedef MinimalEmulator<Memory, TestInterface> CPU;
+        CPU::CompiledBlock loopTop = [](CPU& cpu, Memory& memory, TestInterface& interface, uint64_t& clock, uint64_t limit) {
+            const uint64_t len = cpu.cpuClockLengthInSystemClocks;
+            cpu.PC = 0x0005;
+            clock += cpu.execute(memory, interface, OpINB, 0x8100) * len;
+            cpu.instructions++;
+            if(clock > limit) return;
+            cpu.PC = 0x0008;
+            clock += cpu.execute(memory, interface, OpLDA, 0x8100) * len;
+            cpu.instructions++;
+            if(clock > limit) return;
+            cpu.PC = 0x000A;
+            clock += cpu.execute(memory, interface, OpADI, 0x0003) * len;
+            cpu.instructions++;
+            if(clock > limit) return;
+            cpu.PC = 0x000C;
+            clock += cpu.execute(memory, interface, OpCPI, 0x0010) * len;
+            cpu.instructions++;
+            if(clock > limit) return;
+            cpu.PC = 0x000F;
+            clock += cpu.execute(memory, interface, OpBNE, 0x0002) * len;
+            cpu.instructions++;
+        };
+        CPU::CompiledBlock loopBottom = [](CPU& cpu, Memory& memory, TestInterface& interface, uint64_t& clock, uint64_t limit) {
+            const uint64_t len = cpu.cpuClockLengthInSystemClocks;
+            cpu.PC = 0x0012;
+            clock += cpu.execute(memory, interface, OpADA, 0x8100) * len;
+            cpu.instructions++;
+            if(clock > limit) return;
+            cpu.PC = 0x0015;
+            clock += cpu.execute(memory, interface, OpJPA, 0x0002) * len;
+            cpu.instructions++;
+        };
+        static Memory aotMemory(image);
+        TestInterface aotInterface;
+        CPU reference(CPUClockRate, clock), aot(CPUClockRate, clock);
+        aot.enableCompiledBlocks({{TranslationCache::Key(0, 0x0002), loopTop}, {TranslationCache::Key(0, 0x000F), loopBottom}});
+        static Memory referenceMemory(image);
+        TestInterface referenceInterface;
+        for(int chunk = 1; chunk <= 20; chunk++) {
+            Clock until(clock, chunk * 777);
+            reference.updatePastClock(referenceMemory, referenceInterface, until);
+            aot.updatePastClock(aotMemory, aotInterface, until);
+            check(reference, aot, referenceMemory, aotMemory, referenceInterface, aotInterface);
+        }
     }
 
-    Interface(const Clock& systemClock) :
-        mostRecentSystemClock(systemClock)
     {
-        succeeded = true;
+        // LDI 0, OUT, INB 0x8001, JPA 0x8000: each pass increments LDI's operand
+        static Memory memory;
+        const uint8_t loop[] = { OpLDI, 0, OpOUT, OpINB, 0x01, 0x80, OpJPA, 0x00, 0x80 };
+        std::copy(std::begin(loop), std::end(loop), memory.RAM.begin());
+        TestInterface interface;
+        Clock clock(SystemClockRate);
+        MinimalEmulator<Memory, TestInterface> translated(CPUClockRate, clock);
+#if EMU_JIT
+        translated.enableJit();
+        translated.jitThreshold = 1;
+#else
+        translated.enableTranslationCache();
+#endif
+        translated.PC = 0x8000;
+        translated.updatePastClock(memory, interface, Clock(clock, 2000));
+        assert((interface.output.size() > 2) && "self-modifying loop ran");
+        for(size_t i = 0; i < interface.output.size(); i++) {
+            assert((interface.output[i] == (uint8_t)i) && "self-modifying loop sees its own writes");
+        }
     }
 
-    clk_t calculateNextActivity()
     {
-        // clk_t next = (mostRecentSystemClock.clocks + audioOutputSampleLengthInSystemClocks - 1) / audioOutputSampleLengthInSystemClocks * audioOutputSampleLengthInSystemClocks;
-        clk_t next = mostRecentSystemClock.clocks + 10000000;
-        // XXX debug printf("interface next is %llu\n", next);
-        return next;
+        // Code in RAM calls 0x0100 in flash, LDI 'a'; OUT; RTS, then
+        // programs LDI's operand down to 'A' and calls it again
+        std::vector<uint8_t> bytes(FlashSize, 0xFF);
+        const uint8_t routine[] = { OpLDI, 'a', OpOUT, OpRTS };
+        std::copy(std::begin(routine), std::end(routine), bytes.begin() + 0x0100);
+        static auto image = std::make_shared<const FlashImage>(bytes);
+        static Memory plainMemory(image), compiledMemory;
+        const uint8_t program[] = {
+            OpLDI, 0xFE, OpSTA, 0xFF, 0xFF, OpJPS, 0x00, 0x01,
+            OpLDI, 0xAA, OpSTA, 0x55, 0x55, OpLDI, 0x55, OpSTA, 0xAA, 0x2A, OpLDI, 0xA0, OpSTA, 0x55, 0x55,
+            OpLDI, 'A', OpSTA, 0x01, 0x01, OpJPS, 0x00, 0x01, OpJPA, 0x1F, 0x80,
+        };
+        std::copy(std::begin(program), std::end(program), plainMemory.RAM.begin());
+        compiledMemory = plainMemory;
+        TestInterface plainInterface, compiledInterface;
+        Clock clock(SystemClockRate);
+        MinimalEmulator<Memory, TestInterface> plain(CPUClockRate, clock);
+        MinimalEmulator<Memory, TestInterface> compiled(CPUClockRate, clock);
+#if EMU_JIT
+        compiled.enableJit();
+        compiled.jitThreshold = 1;
+#else
+        compiled.enableTranslationCache();
+#endif
+        plain.PC = compiled.PC = 0x8000;
+        for(int chunk = 1; chunk <= 10; chunk++) {
+            Clock until(clock, chunk * 100);
+            plain.updatePastClock(plainMemory, plainInterface, until);
+            compiled.updatePastClock(compiledMemory, compiledInterface, until);
+            check(plain, compiled, plainMemory, compiledMemory, plainInterface, compiledInterface);
+        }
+        assert((compiledInterface.output == std::vector<uint8_t>{'a', 'A'}) && "code programmed into flash is translated again");
     }
 
-// Do not repeat work if called twice with same clock.
+    {
+        // Every fused idiom, with batches ending inside them:
+        // 0000 LDI '0'; OUT; LDA 0x8100; ADI 1; STA 0x8100; CPI 0x40; BNE 0x0000
+        // 0010 INP; CPI 'A'; BEQ 0x0000; JPA 0x0010
+        static auto image = std::make_shared<const FlashImage>(std::vector<uint8_t>{
+            OpLDI, '0', OpOUT, OpLDA, 0x00, 0x81, OpADI, 1, OpSTA, 0x00, 0x81, OpCPI, 0x40, OpBNE, 0x00, 0x00,
+            OpINP, OpCPI, 'A', OpBEQ, 0x00, 0x00, OpJPA, 0x10, 0x00,
+        });
+        static Memory plainMemory(image), fusedMemory(image);
+        TestInterface plainInterface, fusedInterface;
+        for(const char *input = "xAyzAA"; *input; input++) {
+            plainInterface.inputBuffer.push(*input);
+            fusedInterface.inputBuffer.push(*input);
+        }
+        Clock clock(SystemClockRate);
+        MinimalEmulator<Memory, TestInterface> plain(CPUClockRate, clock);
+        MinimalEmulator<Memory, TestInterface> fused(CPUClockRate, clock);
+        fused.enableFusion();
+        for(int chunk = 1; chunk <= 200; chunk++) {
+            Clock until(clock, chunk * 333);
+            plain.updatePastClock(plainMemory, plainInterface, until);
+            fused.updatePastClock(fusedMemory, fusedInterface, until);
+            check(plain, fused, plainMemory, fusedMemory, plainInterface, fusedInterface);
+        }
+        assert(plainInterface.inputBuffer.empty() && "fused polling loop read all its input");
+        // batches ending mid-block start blocks part way through, so just
+        // check the blocks the loop starts with
+        auto idioms = [&](uint16_t address) {
+            int count = 0;
+            for(const auto& decoded : fused.cache->blocks[fused.cache->find(TranslationCache::Key(0, address))].code) {
+                count += (decoded.fusion != TranslationCache::FuseNone);
+            }
+            return count;
+        };
+        assert((idioms(0x0000) == 3) && (idioms(0x0010) == 1) && "every idiom was fused");
+    }
 
-    void updatePastClock(const Clock& systemClock)
     {
+        // Waiting for input: LDA 0x8100; INP; BEQ 0x0000; OUT; JPA 0x0000.
+        // Every engine skips the waits and ends up where running them would.
+        static auto image = std::make_shared<const FlashImage>(std::vector<uint8_t>{
+            OpLDA, 0x00, 0x81, OpINP, OpBEQ, 0x00, 0x00, OpOUT, OpJPA, 0x00, 0x00,
+        });
+        for(int engine = 0; engine < 4; engine++) {
+            static Memory plainMemory, idleMemory;
+            plainMemory = Memory(image);
+            idleMemory = Memory(image);
+            TestInterface plainInterface, idleInterface;
+            Clock clock(SystemClockRate);
+            MinimalEmulator<Memory, TestInterface> plain(CPUClockRate, clock);
+            MinimalEmulator<Memory, TestInterface> idle(CPUClockRate, clock);
+            plain.skipIdle = false;
+            if(engine == 1) {
+                idle.enableTranslationCache();
+            } else if(engine == 2) {
+                idle.enableFusion();
+            } else if(engine == 3) {
+#if EMU_JIT
+                idle.enableJit();
+                idle.jitThreshold = 1;
+#else
+                idle.enableTranslationCache();
+#endif
+            }
+            for(int chunk = 1; chunk <= 40; chunk++) {
+                if(chunk % 10 == 0) {
+                    plainInterface.inputBuffer.push('0' + chunk / 10);
+                    idleInterface.inputBuffer.push('0' + chunk / 10);
+                }
+                Clock until(clock, chunk * 100003);
+                plain.updatePastClock(plainMemory, plainInterface, until);
+                idle.updatePastClock(idleMemory, idleInterface, until);
+                check(plain, idle, plainMemory, idleMemory, plainInterface, idleInterface);
+            }
+            assert((idleInterface.output == std::vector<uint8_t>{'1', '2', '3', '4'}) && "input still comes through while idle");
+            assert((plain.idleClocks == 0) && (idle.idleClocks > 40 * 100003 * 9 / 10) && "waiting for input is skipped");
+        }
     }
-};
+}
+
+// Print the opcode pairs and triples that ran most, of all instructions
+// run, marking the ones the fused engine already runs as one handler
+void ReportNgrams(FILE *fp, const NgramProfile& profile)
+{
+    auto report = [&](const std::vector<uint64_t>& counts, int n) {
+        std::vector<uint32_t> ngrams;
+        for(uint32_t ngram = 0; ngram < counts.size(); ngram++) {
+            if(counts[ngram] > 0) {
+                ngrams.push_back(ngram);
+            }
+        }
+        std::sort(ngrams.begin(), ngrams.end(), [&](uint32_t a, uint32_t b) { return counts[a] > counts[b]; });
+        ngrams.resize(std::min<size_t>(ngrams.size(), 16));
+        fprintf(fp, "most frequent %d-instruction sequences of %llu instructions:\n", n, (unsigned long long)profile.instructions);
+        for(uint32_t ngram : ngrams) {
+            uint8_t ops[3] = { 0xFF, 0xFF, 0xFF };
+            std::string sequence;
+            for(int i = 0; i < n; i++) {
+                ops[i] = (ngram >> (6 * (n - 1 - i))) & 0x3F;
+                sequence += (i ? "+" : "") + InstructionToMnemonic[ops[i]];
+            }
+            int count;
+            TranslationCache::FusionFor(ops[0], ops[1], ops[2], count);
+            fprintf(fp, "    %-12s %12llu %6.2f%%%s\n", sequence.c_str(), (unsigned long long)counts[ngram],
+                100.0 * counts[ngram] / std::max<uint64_t>(profile.instructions, 1), (count == n) ? " (fused)" : "");
+        }
+    };
+    report(profile.pairs, 2);
+    report(profile.triples, 3);
+}
 
 void usage(const char *name)
 {
-    fprintf(stderr, "usage: %s flash.bin\n", name);
-    // fprintf(stderr, "usage: %s [options] flash.bin\n", name);
-    // fprintf(stderr, "options:\n");
+    fprintf(stderr, "usage: %s [options] flash.bin\n", name);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "\t--engine NAME      - run the CPU with NAME, one of:\n");
+    fprintf(stderr, "\t                       instruction - one whole instruction at a time (default)\n");
+    fprintf(stderr, "\t                       microcode - one microcode word per clock\n");
+    fprintf(stderr, "\t                       unrolled - microcode compiled into one handler per instruction and flags\n");
+    fprintf(stderr, "\t                       translated - instruction, running cached pre-decoded basic blocks\n");
+    fprintf(stderr, "\t                       fused - translated, running common idioms like CPI+BNE as one handler\n");
+    fprintf(stderr, "\t                       jit - translated, compiling hot blocks to native code where supported\n");
+    fprintf(stderr, "\t                       gates - the gate-level System\n");
+    fprintf(stderr, "\t--test             - run the self tests and exit\n");
+    fprintf(stderr, "\t--uart SPEC        - connect the UART to the host through SPEC, one of:\n");
+    fprintf(stderr, "\t                       stdio - stdin and stdout, from a thread of its own (default)\n");
+    fprintf(stderr, "\t                       pty - a new pseudo-terminal, whose name is printed\n");
+    fprintf(stderr, "\t                       unix:PATH - a client at a time on the Unix socket PATH\n");
+    fprintf(stderr, "\t                       direct - stdout only, written as the CPU sends it\n");
+    fprintf(stderr, "\t--uart-timing SPEC - send and receive at a baud rate, SPEC being BAUD[,FRAME[,FIFO[,OVERRUN]]],\n");
+    fprintf(stderr, "\t                       like 9600,8N1,16,drop; OVERRUN is drop, overwrite or hold.\n");
+    fprintf(stderr, "\t                       Prints what crossed the line on exit.\n");
+    fprintf(stderr, "\t--record FILE      - write the UART input from the host to the journal FILE, with the clock\n");
+    fprintf(stderr, "\t                       each byte came in at\n");
+    fprintf(stderr, "\t--replay FILE      - feed the UART the input journaled in FILE at the same clocks, as fast as\n");
+    fprintf(stderr, "\t                       the host goes, then carry on with input from the host.  Start the same\n");
+    fprintf(stderr, "\t                       way as the recording; instruction, translated, fused and jit replay alike\n");
+    fprintf(stderr, "\t--save-flash FILE  - on exit, write flash with whatever the CPU programmed to FILE\n");
+    fprintf(stderr, "\t--load SECONDS FILE [BANK:]ADDRESS - at SECONDS of emulated time, write FILE straight into memory\n");
+    fprintf(stderr, "\t                       at ADDRESS (hex), flash below 0x8000 going in BANK (default 0).  FILE is\n");
+    fprintf(stderr, "\t                       binary, or Intel HEX at its own addresses plus ADDRESS; may be repeated\n");
+    fprintf(stderr, "\t--start ADDRESS    - jump to ADDRESS (hex) once the last --load is done; without it, the last\n");
+    fprintf(stderr, "\t                       --load jumps to its start address if it's Intel HEX with one\n");
+    fprintf(stderr, "\t--snapshot-at SECONDS FILE - run for SECONDS of emulated time, save the machine to FILE and exit\n");
+    fprintf(stderr, "\t--restore FILE     - start from a snapshot FILE taken with the same flash image\n");
+    fprintf(stderr, "\t                       (snapshots are of instruction, translated, fused and jit runs)\n");
+    fprintf(stderr, "\t--fork-server SECONDS SOCKET - run for SECONDS of emulated time, then serve jobs on the\n");
+    fprintf(stderr, "\t                       Unix socket SOCKET, each in a fork of the booted machine\n");
+    fprintf(stderr, "\t--trace LIST       - record events in LIST, comma separated from\n");
+    fprintf(stderr, "\t                       counter, memory, bus, step, uart or all,\n");
+    fprintf(stderr, "\t                       and print the most recent on exit\n");
+    fprintf(stderr, "\t--profile-ngrams SECONDS - run the instruction engine for SECONDS of emulated time,\n");
+    fprintf(stderr, "\t                       then print the opcode sequences worth fusing and exit\n");
+    fprintf(stderr, "\t--report-loops     - print the gate-level evaluation order and feedback loops and exit\n");
     // fprintf(stderr, "\t--rate N           - issue N instructions per 60Hz field\n");
     // --clock mhz
 }
 
-std::vector<std::string> InstructionToMnemonic =
+// --load: a program to put into memory at a point in emulated time
+struct ProgramLoad
 {
-    "NOP",
-    "BNK",
-    "OUT",
-    "CLC",
-    "SEC",
-    "LSL",
-    "ROL",
-    "LSR",
-    "ROR",
-    "ASR",
-    "INP",
-    "NEG",
-    "Inc",
-    "Dec",
-    "LDI",
-    "ADI",
-    "SBI",
-    "CPI",
-    "ACI",
-    "SCI",
-    "JPA",
-    "LDA",
-    "STA",
-    "ADA",
-    "SBA",
-    "CPA",
-    "ACA",
-    "SCA",
-    "JPR",
-    "LDR",
-    "STR",
-    "ADR",
-    "SBR",
-    "CPR",
-    "ACR",
-    "SCR",
-    "CLB",
-    "NEB",
-    "INB",
-    "DEB",
-    "ADB",
-    "SBB",
-    "ACB",
-    "SCB",
-    "CLW",
-    "NEW",
-    "INW",
-    "DEW",
-    "ADW",
-    "SBW",
-    "ACW",
-    "SCW",
-    "LDS",
-    "STS",
-    "PHS",
-    "PLS",
-    "JPS",
-    "RTS",
-    "BNE",
-    "BEQ",
-    "BCC",
-    "BCS",
-    "BPL",
-    "BMI",
+    clk_t at;
+    ProgramFile program;
+    uint32_t bank;
 };
 
+// Run the gate-level model, printing its state on every clock.  Loads are
+// in time order; the last one sets PC if setPC
+void RunGateLevel(std::shared_ptr<const FlashImage> image, UARTBridge *bridge, const std::vector<ProgramLoad>& loads, bool setPC, uint16_t start)
+{
+    System sys;
+    sys.Memory.Flash = Flash(image);
+    sys.UART.bridge = bridge;
+    size_t loaded = 0;
+    while(1) {
+        clk_t clock = sys.steps * (SystemClockRate / CPUClockRate);
+        while((loaded < loads.size()) && (loads[loaded].at <= clock)) {
+            sys.Load(loads[loaded].program, loads[loaded].bank);
+            loaded++;
+        }
+        if(setPC && (loaded == loads.size()) && sys.Jump(start)) {
+            setPC = false;
+        }
+        uint16_t pc = (sys.PCHRegister.value << 8) | sys.PCLRegister.value;
+        printf("0x%04X : 0x%02X\n", pc, sys.Memory.Flash[pc]);
+        printf("    instruction 0x%02X (%s)\n", (uint32_t)sys.InstructionRegister.value,
+            InstructionToMnemonic[(uint32_t)sys.InstructionRegister.value & 0x3F].c_str());
+        printf("    flags %d\n", (uint32_t)sys.FlagsRegister.value);
+        printf("    step %d\n", (uint32_t)sys.StepCounter.value);
+        printf("    microcode %04X ", (uint32_t)sys.MicrocodeROM.microcode_word);
+        if(sys.MicrocodeROM.microcode_word & AI) { printf("AI "); }
+        if(sys.MicrocodeROM.microcode_word & AO) { printf("AO "); }
+        if(sys.MicrocodeROM.microcode_word & BI) { printf("BI "); }
+        if(sys.MicrocodeROM.microcode_word & BO) { printf("BO "); }
+        if(sys.MicrocodeROM.microcode_word & CI) { printf("CI "); }
+        if(sys.MicrocodeROM.microcode_word & CO) { printf("CO "); }
+        if(sys.MicrocodeROM.microcode_word & EC) { printf("EC "); }
+        if(sys.MicrocodeROM.microcode_word & ES) { printf("ES "); }
+        if(sys.MicrocodeROM.microcode_word & CEME) { printf("CEME "); }
+        if(sys.MicrocodeROM.microcode_word & EOFI) { printf("EOFI "); }
+        if(sys.MicrocodeROM.microcode_word & HI) { printf("HI "); }
+        if(sys.MicrocodeROM.microcode_word & IC) { printf("IC "); }
+        if(sys.MicrocodeROM.microcode_word & MI) { printf("MI "); }
+        if(sys.MicrocodeROM.microcode_word & RI) { printf("RI "); }
+        if(sys.MicrocodeROM.microcode_word & RO) { printf("RO "); }
+        if(sys.MicrocodeROM.microcode_word & TR) { printf("TR "); }
+        if(sys.cilSignal) { printf("cil "); }
+        if(sys.colSignal) { printf("col "); }
+        if(sys.cihSignal) { printf("cih "); }
+        if(sys.cohSignal) { printf("coh "); }
+        if(sys.milSignal) { printf("mil "); }
+        if(sys.mihSignal) { printf("mih "); }
+        if(sys.kiSignal) { printf("ki "); }
+        if(sys.iiSignal) { printf("ii "); }
+        if(sys.tiSignal) { printf("ti "); }
+        if(sys.toSignal) { printf("to "); }
+        puts("");
+        try {
+            sys.Step();
+        } catch(const std::runtime_error& e) {
+            fprintf(stderr, "%s\n", e.what());
+            sys.ReportBlockStatistics(stderr);
+            sys.ReportLevelization(stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
 int main(int argc, char **argv)
 {
     const char *progname = argv[0];
     argc -= 1;
     argv += 1;
 
-    while((argc > 1) && (argv[0][0] == '-')) {
+    std::string engine = "instruction";
+    double profileSeconds = 0;
+    static std::string saveFlashFile;
+    double snapshotSeconds = 0;
+    std::string snapshotFile;
+    std::string restoreFile;
+    double forkServerSeconds = 0;
+    std::string forkServerSocket;
+    std::string uart = EMU_UART_BRIDGE ? "stdio" : "direct";
+    std::string uartTiming;
+    std::string recordFile;
+    std::string replayFile;
+    std::vector<ProgramLoad> loads;
+    bool setPC = false;
+    uint16_t start = 0;
+
+    while((argc > 0) && (argv[0][0] == '-')) {
         if(
             (strcmp(argv[0], "-help") == 0) ||
             (strcmp(argv[0], "-h") == 0) ||
@@ -1336,6 +2975,147 @@ int main(int argc, char **argv)
         {
             usage(progname);
             exit(EXIT_SUCCESS);
+        } else if(strcmp(argv[0], "--test") == 0) {
+            TestSystem();
+            TestMemory();
+            TestProgramLoad();
+            TestSnapshot();
+#if EMU_FORK_SERVER
+            TestForkServer();
+#endif
+#if EMU_UART_BRIDGE
+            TestUARTBridge();
+#endif
+            TestUARTTiming();
+            TestUARTJournal();
+            TestEngines();
+            TestTranslationCache();
+            printf("tests passed\n");
+            exit(EXIT_SUCCESS);
+        } else if(strcmp(argv[0], "--report-loops") == 0) {
+            System sys;
+            sys.ReportLevelization(stdout);
+            exit(EXIT_SUCCESS);
+        } else if(strcmp(argv[0], "--engine") == 0) {
+            if(argc < 2) {
+                fprintf(stderr, "--engine requires an engine name\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            engine = argv[1];
+            argc -= 2;
+            argv += 2;
+        } else if(strcmp(argv[0], "--profile-ngrams") == 0) {
+            if((argc < 2) || ((profileSeconds = atof(argv[1])) <= 0)) {
+                fprintf(stderr, "--profile-ngrams requires a number of seconds\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            argc -= 2;
+            argv += 2;
+        } else if(strcmp(argv[0], "--save-flash") == 0) {
+            if(argc < 2) {
+                fprintf(stderr, "--save-flash requires a file name\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            saveFlashFile = argv[1];
+            argc -= 2;
+            argv += 2;
+        } else if(strcmp(argv[0], "--snapshot-at") == 0) {
+            if((argc < 3) || ((snapshotSeconds = atof(argv[1])) <= 0)) {
+                fprintf(stderr, "--snapshot-at requires a number of seconds and a file name\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            snapshotFile = argv[2];
+            argc -= 3;
+            argv += 3;
+        } else if(strcmp(argv[0], "--restore") == 0) {
+            if(argc < 2) {
+                fprintf(stderr, "--restore requires a file name\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            restoreFile = argv[1];
+            argc -= 2;
+            argv += 2;
+        } else if(strcmp(argv[0], "--fork-server") == 0) {
+            char *end = nullptr;
+            if((argc < 3) || ((forkServerSeconds = strtod(argv[1], &end)) < 0) || (*end != '\0')) {
+                fprintf(stderr, "--fork-server requires a number of seconds and a socket path\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            forkServerSocket = argv[2];
+            argc -= 3;
+            argv += 3;
+        } else if(strcmp(argv[0], "--uart") == 0) {
+            if(argc < 2) {
+                fprintf(stderr, "--uart requires stdio, pty, unix:PATH or direct\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            uart = argv[1];
+            argc -= 2;
+            argv += 2;
+        } else if(strcmp(argv[0], "--load") == 0) {
+            double seconds = -1;
+            unsigned int bank = 0, address = 0;
+            bool parsed = (argc >= 4) && ((seconds = atof(argv[1])) >= 0) &&
+                ((sscanf(argv[3], "%u:%x", &bank, &address) == 2) || ((bank = 0), sscanf(argv[3], "%x", &address) == 1)) &&
+                (bank <= 15) && (address <= 0xFFFF);
+            if(!parsed) {
+                fprintf(stderr, "--load requires a number of seconds, a file name and [BANK:]ADDRESS\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            try {
+                loads.push_back({clk_t(seconds * SystemClockRate), ProgramFile::Load(argv[2], address), bank});
+            } catch(const std::string& error) {
+                fprintf(stderr, "%s\n", error.c_str());
+                exit(EXIT_FAILURE);
+            }
+            argc -= 4;
+            argv += 4;
+        } else if(strcmp(argv[0], "--start") == 0) {
+            unsigned int address;
+            if((argc < 2) || (sscanf(argv[1], "%x", &address) != 1) || (address > 0xFFFF)) {
+                fprintf(stderr, "--start requires an address\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            setPC = true;
+            start = address;
+            argc -= 2;
+            argv += 2;
+        } else if(strcmp(argv[0], "--uart-timing") == 0) {
+            if(argc < 2) {
+                fprintf(stderr, "--uart-timing requires a baud rate and optionally frame, FIFO depth and overrun\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            uartTiming = argv[1];
+            argc -= 2;
+            argv += 2;
+        } else if((strcmp(argv[0], "--record") == 0) || (strcmp(argv[0], "--replay") == 0)) {
+            if(argc < 2) {
+                fprintf(stderr, "%s requires a file name\n", argv[0]);
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            ((strcmp(argv[0], "--record") == 0) ? recordFile : replayFile) = argv[1];
+            argc -= 2;
+            argv += 2;
+        } else if(strcmp(argv[0], "--trace") == 0) {
+            if((argc < 2) || !ParseTraceCategories(argv[1], TraceCategories)) {
+                fprintf(stderr, "--trace requires a list of categories\n");
+                usage(progname);
+                exit(EXIT_FAILURE);
+            }
+            atexit([]() { TraceLog.Dump(stderr); });
+            argc -= 2;
+            argv += 2;
 	} else {
 	    fprintf(stderr, "unknown parameter \"%s\"\n", argv[0]);
             usage(progname);
@@ -1350,108 +3130,190 @@ int main(int argc, char **argv)
 
     std::string flash_file = argv[0];
 
+    if(setPC && loads.empty()) {
+        fprintf(stderr, "--start needs a program to --load\n");
+        exit(EXIT_FAILURE);
+    }
+    if(!recordFile.empty() && !replayFile.empty()) {
+        fprintf(stderr, "--record and --replay can't both be given\n");
+        exit(EXIT_FAILURE);
+    }
+    if((!recordFile.empty() || !replayFile.empty()) && (engine == "gates")) {
+        fprintf(stderr, "--record and --replay need an engine run by the scheduler, not gates\n");
+        exit(EXIT_FAILURE);
+    }
+    if(!recordFile.empty() && ((snapshotSeconds > 0) || !forkServerSocket.empty())) {
+        fprintf(stderr, "snapshots and the fork server run without the host, so there's nothing to --record\n");
+        exit(EXIT_FAILURE);
+    }
+    std::stable_sort(loads.begin(), loads.end(), [](const ProgramLoad& a, const ProgramLoad& b) { return a.at < b.at; });
+    // an Intel HEX start address record does what --start would
+    if(!setPC && !loads.empty() && loads.back().program.hasStart) {
+        setPC = true;
+        start = loads.back().program.start;
+    }
+
     Clock systemClock(SystemClockRate);
 
-    Interface interface(systemClock);
+    static Interface interface(systemClock);
     if(!interface.succeeded) {
         fprintf(stderr, "opening the user interface failed.\n");
         exit(EXIT_FAILURE);
     }
+    if(!uartTiming.empty()) {
+        if(engine == "gates") {
+            fprintf(stderr, "--uart-timing needs an engine run by the scheduler, not gates\n");
+            exit(EXIT_FAILURE);
+        }
+        try {
+            interface.setTiming(UARTTiming::Parse(uartTiming), systemClock.rate);
+        } catch(const std::string& error) {
+            fprintf(stderr, "%s\n", error.c_str());
+            exit(EXIT_FAILURE);
+        }
+        atexit([]() {
+            fprintf(stderr, "UART: %llu bytes sent, %llu received, %llu overruns, at most %zu waiting to send, in %.3f emulated seconds\n",
+                (unsigned long long)interface.bytesSent, (unsigned long long)interface.bytesReceived, (unsigned long long)interface.overruns,
+                interface.mostQueued, (double)interface.mostRecentSystemClock.clocks / interface.mostRecentSystemClock.rate);
+        });
+    }
 
-    Memory memory(flash_file);
-
-    MinimalEmulator<Memory,Interface> minimal(CPUClockRate, systemClock);
+    // Loaded once and shared by whichever engine runs
+    std::shared_ptr<const FlashImage> image;
+    try {
+        image = std::make_shared<FlashImage>(flash_file);
+    } catch(const std::string& error) {
+        fprintf(stderr, "%s\n", error.c_str());
+        exit(EXIT_FAILURE);
+    }
+    static Memory memory(image);
+    // destroyed on exit, which writes out the rest of a recording
+    static std::unique_ptr<UARTJournal> journal;
+    if(!recordFile.empty()) {
+        journal = std::make_unique<UARTJournal>(systemClock.rate, HashBytes(image->data, FlashSize));
+        if(!journal->open(recordFile)) {
+            fprintf(stderr, "couldn't open %s\n", recordFile.c_str());
+            exit(EXIT_FAILURE);
+        }
+    } else if(!replayFile.empty()) {
+        try {
+            journal = UARTJournal::Load(replayFile, systemClock.rate, HashBytes(image->data, FlashSize));
+        } catch(const std::string& error) {
+            fprintf(stderr, "%s: %s\n", replayFile.c_str(), error.c_str());
+            exit(EXIT_FAILURE);
+        }
+    }
+    interface.journal = journal.get();
+    if(!saveFlashFile.empty()) {
+        atexit([]() {
+            if(!memory.flash.flush(saveFlashFile)) {
+                fprintf(stderr, "couldn't save flash to %s\n", saveFlashFile.c_str());
+            }
+        });
+    }
 
-    std::chrono::time_point<std::chrono::system_clock> interfaceThen = std::chrono::system_clock::now();
+    if(profileSeconds > 0) {
+        MinimalEmulator<Memory,Interface> minimal(CPUClockRate, systemClock);
+        minimal.profile = std::make_unique<NgramProfile>();
+        RunEmulator(minimal, memory, interface, systemClock, systemClock.clocks + profileSeconds * systemClock.rate);
+        ReportNgrams(stdout, *minimal.profile);
+        exit(EXIT_SUCCESS);
+    }
 
-    if(false) {
-        TestSystem();
-        if(false) {
+    // Snapshots and the fork server run without the host; everything else
+    // talks to it through the bridge, if there's one
+    static std::unique_ptr<UARTBridge> uartBridge;
+    if((uart != "direct") && (snapshotSeconds == 0) && forkServerSocket.empty()) {
+#if EMU_UART_BRIDGE
+        try {
+            uartBridge = UARTBridge::Open(uart);
+        } catch(const std::string& error) {
+            fprintf(stderr, "%s\n", error.c_str());
             exit(EXIT_FAILURE);
         }
+        if(uart != "stdio") {
+            fprintf(stderr, "UART on %s\n", uartBridge->name.c_str());
+        }
+        interface.bridge = uartBridge.get();
+#else
+        fprintf(stderr, "built without the UART bridge, only --uart direct\n");
+        exit(EXIT_FAILURE);
+#endif
     }
 
-    System sys;
-    {
-        FILE *fp = fopen(flash_file.c_str(), "rb");
-        if(!fp) {
-            throw "couldn't open " + flash_file;
-        }
-        fseek(fp, 0, SEEK_END);
-        long size = ftell(fp);
-        assert(size == FlashSize);
-        fseek(fp, 0, SEEK_SET);
-        fread(sys.Memory.Flash.data(), sys.Memory.Flash.size(), 1, fp);
-        fclose(fp);
+    bool instructionLevel = (engine == "instruction") || (engine == "translated") || (engine == "fused") || (engine == "jit");
+    if((snapshotSeconds > 0 || !restoreFile.empty() || !forkServerSocket.empty()) && !instructionLevel) {
+        fprintf(stderr, "snapshots and the fork server need the instruction, translated, fused or jit engine\n");
+        exit(EXIT_FAILURE);
     }
-    while(1) {
-        uint16_t pc = (sys.PCHRegister.value << 8) | sys.PCLRegister.value;
-        printf("0x%04X : 0x%02X\n", pc, sys.Memory.Flash[pc]);
-        printf("    instruction 0x%02X (%s)\n", (uint32_t)sys.InstructionRegister.value,
-            InstructionToMnemonic[(uint32_t)sys.InstructionRegister.value & 0x3F].c_str());
-        printf("    flags %d\n", (uint32_t)sys.FlagsRegister.value);
-        printf("    step %d\n", (uint32_t)sys.StepCounter.value);
-        printf("    microcode %04X ", (uint32_t)sys.MicrocodeROM.microcode_word);
-        if(sys.MicrocodeROM.microcode_word & AI) { printf("AI "); }
-        if(sys.MicrocodeROM.microcode_word & AO) { printf("AO "); }
-        if(sys.MicrocodeROM.microcode_word & BI) { printf("BI "); }
-        if(sys.MicrocodeROM.microcode_word & BO) { printf("BO "); }
-        if(sys.MicrocodeROM.microcode_word & CI) { printf("CI "); }
-        if(sys.MicrocodeROM.microcode_word & CO) { printf("CO "); }
-        if(sys.MicrocodeROM.microcode_word & EC) { printf("EC "); }
-        if(sys.MicrocodeROM.microcode_word & ES) { printf("ES "); }
-        if(sys.MicrocodeROM.microcode_word & CEME) { printf("CEME "); }
-        if(sys.MicrocodeROM.microcode_word & EOFI) { printf("EOFI "); }
-        if(sys.MicrocodeROM.microcode_word & HI) { printf("HI "); }
-        if(sys.MicrocodeROM.microcode_word & IC) { printf("IC "); }
-        if(sys.MicrocodeROM.microcode_word & MI) { printf("MI "); }
-        if(sys.MicrocodeROM.microcode_word & RI) { printf("RI "); }
-        if(sys.MicrocodeROM.microcode_word & RO) { printf("RO "); }
-        if(sys.MicrocodeROM.microcode_word & TR) { printf("TR "); }
-        if(sys.cilSignal) { printf("cil "); }
-        if(sys.colSignal) { printf("col "); }
-        if(sys.cihSignal) { printf("cih "); }
-        if(sys.cohSignal) { printf("coh "); }
-        if(sys.milSignal) { printf("mil "); }
-        if(sys.mihSignal) { printf("mih "); }
-        if(sys.kiSignal) { printf("ki "); }
-        if(sys.iiSignal) { printf("ii "); }
-        if(sys.tiSignal) { printf("ti "); }
-        if(sys.toSignal) { printf("to "); }
-        puts("");
-        sys.Step();
+    // the microcode engines stop between clocks, not instructions
+    if(!loads.empty() && !instructionLevel && (engine != "gates")) {
+        fprintf(stderr, "--load needs the instruction, translated, fused, jit or gates engine\n");
+        exit(EXIT_FAILURE);
     }
 
-    printf("Power up.\n");
-    bool done = false;
-    while(!done) {
-
-        uint64_t newClock = systemClock.clocks + systemClock.rate / 240; // XXX I dunno, 4 chunks of a 60Hz tick???
-        while(systemClock.clocks < newClock) {
-            uint64_t nextCPU = minimal.calculateNextActivity();
-            uint64_t nextInterface = interface.calculateNextActivity();
-            // XXX debug printf("cpu : %llu, interface: %llu\n", nextCPU, nextInterface);
-            if(nextCPU < nextInterface) {
-                // XXX debug printf("do cpu\n");
-                MinimalEmulator<Memory,Interface>::StepResult result = minimal.updatePastClock(memory, interface, systemClock);
-                if(result != MinimalEmulator<Memory,Interface>::CONTINUE) {
-                    // XXX debug printf("exit on unsupported instruction\n");
-                    exit(EXIT_SUCCESS);
-                }
-                systemClock.clocks = nextCPU;
-            } else {
-                // XXX debug printf("do interface\n");
-                interface.updatePastClock(systemClock);
-                systemClock.clocks = nextInterface;
+    if(instructionLevel) {
+        MinimalEmulator<Memory,Interface> minimal(CPUClockRate, systemClock);
+        if(engine == "translated") {
+            minimal.enableTranslationCache();
+        } else if(engine == "fused") {
+            minimal.enableFusion();
+        } else if(engine == "jit") {
+#if EMU_JIT
+            if(!minimal.enableJit()) {
+                fprintf(stderr, "no executable memory for the JIT, running translated blocks only\n");
             }
+#else
+            fprintf(stderr, "built without the JIT, running translated blocks only\n");
+            minimal.enableTranslationCache();
+#endif
         }
-
-        std::chrono::time_point<std::chrono::system_clock> interfaceNow = std::chrono::system_clock::now();
-        auto elapsed = std::chrono::duration_cast<std::chrono::duration<float>>(interfaceNow - interfaceThen);
-        float dt = elapsed.count();
-        if(dt > (.9f * 1.0f / UIUpdateFrequency)) {
-            done = !interface.attemptIterate();
-            interfaceThen = interfaceNow;
+        if(!restoreFile.empty()) {
+            try {
+                SnapshotArchive archive = SnapshotArchive::Load(restoreFile);
+                SnapshotMachine(archive, minimal, memory, interface, systemClock);
+            } catch(const std::string& error) {
+                fprintf(stderr, "%s: %s\n", restoreFile.c_str(), error.c_str());
+                exit(EXIT_FAILURE);
+            }
+        }
+        for(size_t i = 0; i < loads.size(); i++) {
+            if(!RunUntil(minimal, memory, interface, systemClock, loads[i].at)) {
+                exit(EXIT_SUCCESS);
+            }
+            LoadProgram(minimal, memory, loads[i].program, loads[i].bank, setPC && (i + 1 == loads.size()), start);
         }
+        if(snapshotSeconds > 0) {
+            RunEmulator(minimal, memory, interface, systemClock, systemClock.clocks + snapshotSeconds * systemClock.rate);
+            SnapshotArchive archive;
+            SnapshotMachine(archive, minimal, memory, interface, systemClock);
+            if(!archive.save(snapshotFile)) {
+                fprintf(stderr, "couldn't save a snapshot to %s\n", snapshotFile.c_str());
+                exit(EXIT_FAILURE);
+            }
+            exit(EXIT_SUCCESS);
+        }
+        if(!forkServerSocket.empty()) {
+#if EMU_FORK_SERVER
+            RunEmulator(minimal, memory, interface, systemClock, systemClock.clocks + forkServerSeconds * systemClock.rate);
+            RunForkServer(forkServerSocket, minimal, memory, interface, systemClock);
+#else
+            fprintf(stderr, "built without the fork server\n");
+            exit(EXIT_FAILURE);
+#endif
+        }
+        RunEmulator(minimal, memory, interface, systemClock);
+    } else if(engine == "microcode") {
+        MicrocodeEmulator<Memory,Interface> microcode(CPUClockRate, systemClock);
+        RunEmulator(microcode, memory, interface, systemClock);
+    } else if(engine == "unrolled") {
+        UnrolledMicrocodeEmulator<Memory,Interface> unrolled(CPUClockRate, systemClock);
+        RunEmulator(unrolled, memory, interface, systemClock);
+    } else if(engine == "gates") {
+        RunGateLevel(image, interface.bridge, loads, setPC, start);
+    } else {
+        fprintf(stderr, "unknown engine \"%s\"\n", engine.c_str());
+        usage(progname);
+        exit(EXIT_FAILURE);
     }
 }
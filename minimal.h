@@ -0,0 +1,4039 @@
+// Instruction-level core of the Minimal UART CPU emulator: microcode tables,
+// the interpreter, translation cache and JIT, Memory and the UART Interface.
+// Shared by emu-minimal and the programs emu-minimal-aot generates.
+#ifndef MINIMAL_H
+#define MINIMAL_H
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <queue>
+#include <array>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cassert>
+#include <cstring>
+#include <cctype>
+#include <chrono>
+#include <functional>
+#include <set>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+#include <new>
+#include <cstddef>
+#include <limits>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Native code generation for hot translated blocks, on by default where the
+// JIT can emit code; build with EMU_JIT=0 to leave it out
+#ifndef EMU_JIT
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define EMU_JIT 1
+#else
+#define EMU_JIT 0
+#endif
+#endif
+#if EMU_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Map flash images from their files instead of reading them, where there's mmap
+#ifndef EMU_MMAP
+#if defined(__unix__) || defined(__APPLE__)
+#define EMU_MMAP 1
+#else
+#define EMU_MMAP 0
+#endif
+#endif
+#if EMU_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Connect the UART to the host through a thread of its own, where there are
+// poll(), ptys and Unix domain sockets
+#ifndef EMU_UART_BRIDGE
+#if defined(__unix__) || defined(__APPLE__)
+#define EMU_UART_BRIDGE 1
+#else
+#define EMU_UART_BRIDGE 0
+#endif
+#endif
+#if EMU_UART_BRIDGE
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// For the instruction interpreter's execute(), so callers passing a constant
+// opcode, like the blocks emu-minimal-aot writes, get just that case
+#if defined(__GNUC__)
+#define EMU_ALWAYS_INLINE __attribute__((always_inline))
+#else
+#define EMU_ALWAYS_INLINE
+#endif
+
+#if defined(__GNUC__)
+#define EMU_NOINLINE __attribute__((noinline))
+#else
+#define EMU_NOINLINE
+#endif
+
+constexpr uint64_t SystemClockRate = 3686400;
+constexpr uint64_t CPUClockRate = 3686400;
+
+constexpr size_t FlashSize = 512 * 1024;
+constexpr size_t RAMSize = 32 * 1024;
+
+constexpr uint32_t AI   = 0x0001; // latch bus into A
+constexpr uint32_t AO   = 0x0002; // enable output from A
+constexpr uint32_t BI   = 0x0004; // latch bus into B
+constexpr uint32_t BO   = 0x0008; // enable output from B
+constexpr uint32_t CI   = 0x0010; // latch bus into program counter low or high byte
+constexpr uint32_t CO   = 0x0020; // enable output from program counter low or high byte
+constexpr uint32_t EC   = 0x0040; // enable carry, also latch into BANK register if HI
+constexpr uint32_t ES   = 0x0080; // negate B input to ALU
+constexpr uint32_t CEME = 0x0100; // represents both CE/chipenable and ME/memoryenable
+constexpr uint32_t EOFI = 0x0200; // represents both EO/accumulator-buffer-output-enable and FI/latch-flags-from-buffer
+constexpr uint32_t HI   = 0x0400; // whether I/O is for low or high byte
+constexpr uint32_t IC   = 0x0800; // reset microcode step register
+constexpr uint32_t MI   = 0x1000; // latch bus into memory address low or high byte register (MAH,MAL)
+constexpr uint32_t RI   = 0x2000; // latch bus into memory data  (RAM or ROM/Flash) using MAH,MAL,BANK registers
+constexpr uint32_t RO   = 0x4000; // enable output from memory data using MAH,MAL,BANK registers
+constexpr uint32_t TR   = 0x8000; // I/O transfer in and out depending on HI
+
+/*
+------------------------------------------------------------------------------
+MIT License
+Copyright (c) 2021 Carsten Herting
+------------------------------------------------------------------------------
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+------------------------------------------------------------------------------
+*/
+
+// XXX grantham - changed Out to OUT
+
+// MINIMAL CPU SYSTEM - MICROCODE VERSION 1.5 written by Carsten Herting 17.04.2021
+// Use for board revisions 1.3 and higher.
+
+#define NOP     CO|MI, CO|MI|HI, RO|HI|CEME, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define BNK     CO|MI, CO|MI|HI, RO|HI|CEME, AO|EC|HI, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define OUT     CO|MI, CO|MI|HI, RO|HI|CEME, AO|TR|HI, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define CLC     CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI, EOFI|ES,        IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define SEC     CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI, EOFI|ES|EC,     IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define LSL     CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI,  EOFI|AI,       IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define ROL0    CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI,  EOFI|AI,       IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define ROL1    CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI,  EOFI|AI|EC,    IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define LSR0    CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI,  EOFI|ES,       EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    IC, 0, 0
+#define LSR1    CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI,  EOFI|ES,       EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, IC, 0, 0
+#define ROR0    CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI,  EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    IC,            0,  0, 0
+#define ROR1    CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI,  EOFI|AI|BI|EC, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, IC,            0,  0, 0
+#define ASR00x  CO|MI, CO|MI|HI, RO|HI|CEME, BI, EOFI|EC, AO|BI,    EOFI|ES,       EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    IC
+#define ASR01x  CO|MI, CO|MI|HI, RO|HI|CEME, BI, EOFI|EC, AO|BI,    EOFI|ES,       EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, IC
+#define ASR10x  CO|MI, CO|MI|HI, RO|HI|CEME, BI, EOFI|EC, AO|BI,    EOFI|ES|EC,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    EOFI|AI|BI,    IC
+#define ASR11x  CO|MI, CO|MI|HI, RO|HI|CEME, BI, EOFI|EC, AO|BI,    EOFI|ES|EC,    EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, EOFI|EC|AI|BI, IC
+#define INP     CO|MI, CO|MI|HI, RO|HI|CEME, TR|AI|BI, EOFI|ES|BI, EOFI|ES|EC, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define NEG     CO|MI, CO|MI|HI, RO|HI|CEME, AO|BI, EOFI|ES|EC|AI, EOFI|ES|EC|AI, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define Inc     CO|MI, CO|MI|HI, RO|HI|CEME, BI, EOFI|ES|EC|AI, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define Dec     CO|MI, CO|MI|HI, RO|HI|CEME, BI, EOFI|AI, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+
+#define LDI     CO|MI, CO|MI|HI, RO|HI|CEME, RO|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define ADI     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI, EOFI|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define SBI     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI, EOFI|ES|EC|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define CPI     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI, EOFI|ES|EC|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define ACI0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI, EOFI|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define ACI1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI, EOFI|EC|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define SCI0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI, EOFI|ES|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define SCI1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI, EOFI|ES|EC|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+
+#define JPA     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|CI|HI, BO|CI, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0
+#define LDA     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0
+#define STA     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|RI, CEME, IC, 0, 0, 0, 0, 0, 0, 0
+#define ADA     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0
+#define SBA     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|ES|EC|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0
+#define CPA     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|ES|EC|CEME, IC, 0, 0, 0, 0, 0, 0, 0
+#define ACA0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0
+#define ACA1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|EC|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0
+#define SCA0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|ES|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0
+#define SCA1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|ES|EC|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0
+
+#define JPR     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|CI|HI, BO|CI, IC, 0, 0, 0, 0, 0, 0
+#define LDR     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI, IC, 0, 0, 0, 0, 0
+#define STR     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, AO|RI, IC, 0, 0, 0, 0, 0
+#define ADR     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|AI, IC, 0, 0, 0, 0
+#define SBR     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|ES|EC|AI, IC, 0, 0, 0, 0
+#define CPR     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|ES|EC, IC, 0, 0, 0, 0
+#define ACR0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|AI, IC, 0, 0, 0, 0
+#define ACR1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|EC|AI, IC, 0, 0, 0, 0
+#define SCR0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|ES|AI, IC, 0, 0, 0, 0
+#define SCR1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|ES|EC|AI, IC, 0, 0, 0, 0
+
+#define CLB     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI|AI, EOFI|ES|EC|RI, EOFI|ES|EC|AI|CEME, IC, 0, 0, 0, 0, 0, 0, 0
+#define NEB     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|AI, EOFI|ES|EC|RI, EOFI|ES|EC|AI|CEME, IC, 0, 0, 0, 0, 0
+#define INB     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|BI, EOFI|EC|RI, EOFI|EC|AI|CEME, IC, 0, 0, 0, 0, 0
+#define DEB     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|BI, EOFI|ES|RI, EOFI|ES|AI|CEME, IC, 0, 0, 0, 0, 0
+#define ADB     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|RI, CEME, IC, 0, 0, 0, 0, 0, 0
+#define SBB     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|BI, RO|AI, EOFI|ES|EC|RI, BO|AI|CEME, IC, 0, 0, 0, 0, 0
+#define ACB0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|AI,    AO|RI, CEME, IC, 0, 0, 0, 0, 0
+#define ACB1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI, EOFI|EC|AI, AO|RI, CEME, IC, 0, 0, 0, 0, 0
+#define SCB0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|BI, RO|AI, EOFI|ES|AI,    AO|RI, BO|AI|CEME, IC, 0, 0, 0, 0
+#define SCB1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|BI, RO|AI, EOFI|ES|EC|AI, AO|RI, BO|AI|CEME, IC, 0, 0, 0, 0
+
+#define CLW     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|BI,    EOFI|ES|EC|RI, CEME, EOFI|ES|EC|RI, IC, 0, 0, 0, 0, 0
+#define NEW0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|AI, EOFI|ES|EC|RI, CEME, RO|BI, EOFI|ES|AI,     AO|RI, IC, 0, 0
+#define NEW1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|AI, EOFI|ES|EC|RI, CEME, RO|BI, EOFI|ES|EC|AI, AO|RI, IC, 0, 0
+#define INW0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|BI, EOFI|EC|RI, CEME|BI, RO|AI, EOFI|ES|AI,     AO|RI, IC, 0, 0
+#define INW1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|BI, EOFI|EC|RI, CEME|BI, RO|AI, EOFI|ES|EC|AI, AO|RI, IC, 0, 0
+#define DEW0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|BI, EOFI|ES|RI, CEME|BI, RO|AI, EOFI|AI,       AO|RI, IC, 0, 0
+#define DEW1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|AI|BI, EOFI|ES|EC|BI, EOFI|ES|RI, CEME|BI, RO|AI, EOFI|EC|AI,     AO|RI, IC, 0, 0
+#define ADW0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI,    EOFI|RI, CEME|BI, RO|AI, EOFI|ES|AI,    AO|RI, IC, 0, 0, 0
+#define ADW1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI,    EOFI|RI, CEME|BI, RO|AI, EOFI|ES|EC|AI, AO|RI, IC, 0, 0, 0
+#define SBW0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|BI,    RO|AI, EOFI|ES|EC|RI, CEME|BI, RO|AI, EOFI|AI,    AO|RI, IC, 0, 0
+#define SBW1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|BI,    RO|AI, EOFI|ES|EC|RI, CEME|BI, RO|AI, EOFI|EC|AI, AO|RI, IC, 0, 0
+#define ACW0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI,    EOFI|BI,    BO|RI, CEME|BI, RO|AI, EOFI|ES|AI,    AO|RI, IC, 0, 0
+#define ACW1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, RO|BI,    EOFI|EC|BI, BO|RI, CEME|BI, RO|AI, EOFI|ES|EC|AI, AO|RI, IC, 0, 0
+#define SCW0    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|BI,    RO|AI, EOFI|ES|BI,    BO|RI, CEME|BI, RO|AI, EOFI|AI,     AO|RI, IC, 0
+#define SCW1    CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|MI|HI, BO|MI, AO|BI,    RO|AI, EOFI|ES|EC|BI, BO|RI, CEME|BI, RO|AI, EOFI|EC|AI, AO|RI, IC, 0
+
+#define LDS     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, MI|HI, MI, RO|AI, EOFI|MI, RO|AI, IC, 0, 0, 0, 0, 0, 0
+#define STS     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, MI|HI, MI, RO|MI, AO|RI, MI, RO|AI, EOFI|BI, MI, RO|MI, RO|AI, BO|MI, AO|RI
+#define PHS     CO|MI, CO|MI|HI, RO|HI|CEME, MI|HI, MI, RO|MI|BI, AO|RI, BO|AI,  EOFI|ES|BI|MI, EOFI|RI, AO|MI, RO|AI, IC, 0, 0, 0
+#define PLS     CO|MI, CO|MI|HI, RO|HI|CEME, MI|HI, MI|BI, RO|AI, EOFI|ES|EC|AI, AO|RI, AO|MI, RO|AI, IC, 0, 0, 0, 0, 0
+#define JPS     CO|MI, CO|MI|HI, RO|HI|CEME, MI|HI, MI|BI, RO|AI|MI, CO|RI, EOFI|AI|MI, CO|RI|HI, BO|MI, EOFI|RI, CO|MI, CO|MI|HI, RO|BI|CEME, RO|CI|HI, BO|CI
+#define RTS     CO|MI, CO|MI|HI, RO|HI|CEME, MI|HI, MI|BI, RO|AI|MI, EOFI|ES|EC|AI|MI, RO|CI|HI, EOFI|ES|EC|AI|MI, RO|CI, BO|MI, AO|RI, CEME, CEME, IC, 0
+
+#define BRA     CO|MI, CO|MI|HI, RO|HI|CEME, RO|BI|CEME, RO|CI|HI, BO|CI, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0    // branching
+#define ___     CO|MI, CO|MI|HI, RO|HI|CEME, CEME, CEME, IC, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0                  // non-branching
+
+constexpr uint16_t mEEPROM[8192]    // microcode depending on flags, opcode and stepcounter
+{
+  /*NCZ    target: A, operand: none                                                       target: A, operand: immediate      target: A, operand:  byte at abs address    target: A, operand:  byte at rel address    target: byte at abs address, operand: A      target: word at abs address, operand: A          stack operations                BNE  BEQ  BCC  BCS  BPL  BMI */
+  /*---*/  NOP, BNK, OUT, CLC, SEC, LSL, ROL0, LSR0, ROR0, ASR00x, INP,  NEG, Inc, Dec,   LDI, ADI, SBI, CPI, ACI0, SCI0,    JPA, LDA, STA, ADA, SBA, CPA, ACA0, SCA0,   JPR, LDR, STR, ADR, SBR, CPR, ACR0, SCR0,   CLB, NEB, INB, DEB, ADB, SBB, ACB0, SCB0,    CLW, NEW0, INW0, DEW0, ADW0, SBW0, ACW0, SCW0,   LDS, STS, PHS, PLS, JPS, RTS,   BRA, ___, BRA, ___, BRA, ___,
+  /*--1*/  NOP, BNK, OUT, CLC, SEC, LSL, ROL0, LSR0, ROR0, ASR00x, INP,  NEG, Inc, Dec,   LDI, ADI, SBI, CPI, ACI0, SCI0,    JPA, LDA, STA, ADA, SBA, CPA, ACA0, SCA0,   JPR, LDR, STR, ADR, SBR, CPR, ACR0, SCR0,   CLB, NEB, INB, DEB, ADB, SBB, ACB0, SCB0,    CLW, NEW0, INW0, DEW0, ADW0, SBW0, ACW0, SCW0,   LDS, STS, PHS, PLS, JPS, RTS,   ___, BRA, BRA, ___, BRA, ___,
+  /*-1-*/  NOP, BNK, OUT, CLC, SEC, LSL, ROL1, LSR1, ROR1, ASR01x, INP,  NEG, Inc, Dec,   LDI, ADI, SBI, CPI, ACI1, SCI1,    JPA, LDA, STA, ADA, SBA, CPA, ACA1, SCA1,   JPR, LDR, STR, ADR, SBR, CPR, ACR1, SCR1,   CLB, NEB, INB, DEB, ADB, SBB, ACB1, SCB1,    CLW, NEW1, INW1, DEW1, ADW1, SBW1, ACW1, SCW1,   LDS, STS, PHS, PLS, JPS, RTS,   BRA, ___, ___, BRA, BRA, ___,
+  /*-11*/  NOP, BNK, OUT, CLC, SEC, LSL, ROL1, LSR1, ROR1, ASR01x, INP,  NEG, Inc, Dec,   LDI, ADI, SBI, CPI, ACI1, SCI1,    JPA, LDA, STA, ADA, SBA, CPA, ACA1, SCA1,   JPR, LDR, STR, ADR, SBR, CPR, ACR1, SCR1,   CLB, NEB, INB, DEB, ADB, SBB, ACB1, SCB1,    CLW, NEW1, INW1, DEW1, ADW1, SBW1, ACW1, SCW1,   LDS, STS, PHS, PLS, JPS, RTS,   ___, BRA, ___, BRA, BRA, ___,
+  /*1--*/  NOP, BNK, OUT, CLC, SEC, LSL, ROL0, LSR0, ROR0, ASR10x, INP,  NEG, Inc, Dec,   LDI, ADI, SBI, CPI, ACI0, SCI0,    JPA, LDA, STA, ADA, SBA, CPA, ACA0, SCA0,   JPR, LDR, STR, ADR, SBR, CPR, ACR0, SCR0,   CLB, NEB, INB, DEB, ADB, SBB, ACB0, SCB0,    CLW, NEW0, INW0, DEW0, ADW0, SBW0, ACW0, SCW0,   LDS, STS, PHS, PLS, JPS, RTS,   BRA, ___, BRA, ___, ___, BRA,
+  /*1-1*/  NOP, BNK, OUT, CLC, SEC, LSL, ROL0, LSR0, ROR0, ASR10x, INP,  NEG, Inc, Dec,   LDI, ADI, SBI, CPI, ACI0, SCI0,    JPA, LDA, STA, ADA, SBA, CPA, ACA0, SCA0,   JPR, LDR, STR, ADR, SBR, CPR, ACR0, SCR0,   CLB, NEB, INB, DEB, ADB, SBB, ACB0, SCB0,    CLW, NEW0, INW0, DEW0, ADW0, SBW0, ACW0, SCW0,   LDS, STS, PHS, PLS, JPS, RTS,   ___, BRA, BRA, ___, ___, BRA,
+  /*11-*/  NOP, BNK, OUT, CLC, SEC, LSL, ROL1, LSR1, ROR1, ASR11x, INP,  NEG, Inc, Dec,   LDI, ADI, SBI, CPI, ACI1, SCI1,    JPA, LDA, STA, ADA, SBA, CPA, ACA1, SCA1,   JPR, LDR, STR, ADR, SBR, CPR, ACR1, SCR1,   CLB, NEB, INB, DEB, ADB, SBB, ACB1, SCB1,    CLW, NEW1, INW1, DEW1, ADW1, SBW1, ACW1, SCW1,   LDS, STS, PHS, PLS, JPS, RTS,   BRA, ___, ___, BRA, ___, BRA,
+  /*111*/  NOP, BNK, OUT, CLC, SEC, LSL, ROL1, LSR1, ROR1, ASR11x, INP,  NEG, Inc, Dec,   LDI, ADI, SBI, CPI, ACI1, SCI1,    JPA, LDA, STA, ADA, SBA, CPA, ACA1, SCA1,   JPR, LDR, STR, ADR, SBR, CPR, ACR1, SCR1,   CLB, NEB, INB, DEB, ADB, SBB, ACB1, SCB1,    CLW, NEW1, INW1, DEW1, ADW1, SBW1, ACW1, SCW1,   LDS, STS, PHS, PLS, JPS, RTS,   ___, BRA, ___, BRA, ___, BRA,
+};
+
+/* End of snippet by Carsten Herting */
+
+/* instruction must be 6 bits */
+/* step must be 4 bits */
+constexpr uint16_t GetMicrocodeWord(uint8_t instruction, uint8_t N, uint8_t C, uint8_t Z, uint8_t step)
+{
+    return mEEPROM[(N << 12) | (C << 11) | (Z << 10) | (instruction << 4) | (step << 0)];
+}
+
+/* Opcodes in microcode column order, same as InstructionToMnemonic */
+/* Prefixed because the microcode macros above already use the bare mnemonics */
+enum Opcode : uint8_t
+{
+    OpNOP, OpBNK, OpOUT, OpCLC, OpSEC, OpLSL, OpROL, OpLSR, OpROR, OpASR, OpINP, OpNEG, OpINC, OpDEC,
+    OpLDI, OpADI, OpSBI, OpCPI, OpACI, OpSCI,
+    OpJPA, OpLDA, OpSTA, OpADA, OpSBA, OpCPA, OpACA, OpSCA,
+    OpJPR, OpLDR, OpSTR, OpADR, OpSBR, OpCPR, OpACR, OpSCR,
+    OpCLB, OpNEB, OpINB, OpDEB, OpADB, OpSBB, OpACB, OpSCB,
+    OpCLW, OpNEW, OpINW, OpDEW, OpADW, OpSBW, OpACW, OpSCW,
+    OpLDS, OpSTS, OpPHS, OpPLS, OpJPS, OpRTS,
+    OpBNE, OpBEQ, OpBCC, OpBCS, OpBPL, OpBMI,
+};
+
+/* Flags as they are latched in the flags register and index the microcode */
+constexpr uint8_t FlagN = 0x4;
+constexpr uint8_t FlagC = 0x2;
+constexpr uint8_t FlagZ = 0x1;
+
+/* flags must be 3 bits, N C Z */
+/* IC clears the step counter asynchronously, so the step holding IC costs
+ * no clock and the instruction takes as many clocks as the steps before it.
+ * Instructions with no IC wrap the step counter after all 16 steps. */
+constexpr int GetInstructionCycles(uint8_t instruction, uint8_t flags)
+{
+    for(int step = 0; step < 16; step++) {
+        if(GetMicrocodeWord(instruction, (flags >> 2) & 1, (flags >> 1) & 1, flags & 1, step) & IC) {
+            return step;
+        }
+    }
+    return 16;
+}
+
+/* Signals the control logic derives from the microcode word and HI, in the
+ * bits above the microcode word */
+constexpr uint32_t CIH  = 0x010000; // latch bus into program counter high byte
+constexpr uint32_t CIL  = 0x020000; // latch bus into program counter low byte
+constexpr uint32_t COH  = 0x040000; // enable output from program counter high byte
+constexpr uint32_t COL  = 0x080000; // enable output from program counter low byte
+constexpr uint32_t MIH  = 0x100000; // latch bus into MAH
+constexpr uint32_t MIL  = 0x200000; // latch bus into MAL
+constexpr uint32_t TI   = 0x400000; // UART transmits the bus
+constexpr uint32_t TO   = 0x800000; // UART receive onto the bus
+constexpr uint32_t II   = 0x1000000; // latch bus into instruction register
+constexpr uint32_t KI   = 0x2000000; // latch bus into BANK register
+
+/* Every primary and derived control signal for each microcode address,
+ * decoded at compile time so each step is one load.  Indexed like mEEPROM. */
+constexpr std::array<uint32_t, 8192> DecodeControlSignals()
+{
+    std::array<uint32_t, 8192> table{};
+    for(size_t address = 0; address < table.size(); address++) {
+        uint32_t word = mEEPROM[address];
+        bool hi = word & HI;
+        uint32_t signals = word;
+        if(word & CI) { signals |= hi ? CIH : CIL; }
+        if(word & CO) { signals |= hi ? COH : COL; }
+        if(word & MI) { signals |= hi ? MIH : MIL; }
+        if(word & TR) { signals |= hi ? TI : TO; }
+        if((word & CEME) && hi) { signals |= II; }
+        if((word & EC) && hi) { signals |= KI; }
+        table[address] = signals;
+    }
+    return table;
+}
+
+constexpr std::array<uint32_t, 8192> ControlSignalTable = DecodeControlSignals();
+
+typedef uint64_t clk_t;
+
+struct Clock
+{
+    clk_t rate;
+    clk_t clocks;
+
+    Clock(clk_t rate) :
+        rate(rate),
+        clocks(0)
+    {}
+
+    Clock(const Clock& clock) :
+        rate(clock.rate), 
+        clocks(clock.clocks)
+    {}
+
+    Clock(const Clock& clock, clk_t newClocks) :
+        rate(clock.rate), 
+        clocks(newClocks)
+    {}
+
+    Clock& operator=(const Clock& clock)
+    {
+        clocks = clock.clocks;
+        rate = clock.rate;
+        return *this;
+    }
+
+    Clock& operator+=(clk_t inc)
+    {
+        clocks += inc;
+        return *this;
+    }
+
+    Clock operator+(clk_t inc) const
+    {
+        return Clock(rate, clocks + inc);
+    }
+
+    // operator clk_t() const { return clocks; }
+};
+
+// A machine's state as a versioned binary snapshot.  Each part of a machine
+// passes its fields through one snapshot() that writes them when saving and
+// reads them back when restoring, so saving and restoring can't drift
+// apart.  Fields are in host byte order; a snapshot is for carrying on a
+// run later on the same kind of host, not for interchange.  Restoring
+// throws a std::string describing what's wrong with the snapshot.
+struct SnapshotArchive
+{
+    static constexpr char Magic[8] = {'M', 'I', 'N', 'I', 'S', 'N', 'A', 'P'};
+    static constexpr uint32_t Version = 3;
+    enum Kind : uint32_t {
+        InstructionLevel = 1,
+        GateLevel = 2,
+    };
+    // RAM is saved in pages this size, leaving out the ones all zero
+    static constexpr size_t SparsePageSize = 256;
+
+    bool restoring;
+    std::vector<uint8_t> data;
+    // where restoring has got to in data
+    size_t position = 0;
+
+    // An empty archive to save into
+    SnapshotArchive() :
+        restoring(false)
+    {}
+
+    // An archive to restore from data
+    SnapshotArchive(std::vector<uint8_t> data_) :
+        restoring(true),
+        data(std::move(data_))
+    {}
+
+    static SnapshotArchive Load(const std::string& snapshot_file)
+    {
+        FILE *fp = fopen(snapshot_file.c_str(), "rb");
+        if(!fp) {
+            throw "couldn't open " + snapshot_file;
+        }
+        std::vector<uint8_t> data;
+        uint8_t buffer[65536];
+        size_t size;
+        while((size = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+            data.insert(data.end(), buffer, buffer + size);
+        }
+        bool failed = ferror(fp);
+        fclose(fp);
+        if(failed) {
+            throw "couldn't read " + snapshot_file;
+        }
+        return SnapshotArchive(std::move(data));
+    }
+
+    // Write what was saved to snapshot_file, by way of a temporary file so
+    // a snapshot being replaced is never left half written
+    bool save(const std::string& snapshot_file) const
+    {
+        std::string temporary = snapshot_file + ".tmp";
+        FILE *fp = fopen(temporary.c_str(), "wb");
+        if(!fp) {
+            return false;
+        }
+        bool written = data.empty() || (fwrite(data.data(), data.size(), 1, fp) == 1);
+        written = (fclose(fp) == 0) && written;
+        if(!written || (std::rename(temporary.c_str(), snapshot_file.c_str()) != 0)) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    void bytes(void *p, size_t size)
+    {
+        if(restoring) {
+            if(size > data.size() - position) {
+                throw std::string("snapshot is truncated");
+            }
+            memcpy(p, data.data() + position, size);
+            position += size;
+        } else {
+            const uint8_t *b = static_cast<const uint8_t *>(p);
+            data.insert(data.end(), b, b + size);
+        }
+    }
+
+    template <class T>
+    void field(T& value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "snapshot fields are copied as bytes");
+        bytes(&value, sizeof(value));
+    }
+
+    // Restoring a bool from a byte that isn't 0 or 1 would be undefined
+    void field(bool& value)
+    {
+        uint8_t byte = value;
+        field(byte);
+        if(byte > 1) {
+            throw std::string("snapshot is corrupt");
+        }
+        value = byte;
+    }
+
+    void field(Clock& clock)
+    {
+        clk_t rate = clock.rate;
+        field(rate);
+        if(rate != clock.rate) {
+            throw std::string("snapshot was taken with a different clock rate");
+        }
+        field(clock.clocks);
+    }
+
+    void field(std::queue<uint8_t>& queue)
+    {
+        uint32_t count = queue.size();
+        field(count);
+        std::queue<uint8_t> copy;
+        if(restoring) {
+            queue = {};
+        } else {
+            copy = queue;
+        }
+        for(uint32_t i = 0; i < count; i++) {
+            uint8_t byte = restoring ? 0 : copy.front();
+            field(byte);
+            if(restoring) {
+                queue.push(byte);
+            } else {
+                copy.pop();
+            }
+        }
+    }
+
+    // size bytes at p, keeping only the pages that aren't all zero
+    void sparse(uint8_t *p, size_t size)
+    {
+        assert(size % SparsePageSize == 0);
+        uint32_t pages = size / SparsePageSize;
+        std::vector<uint32_t> used;
+        if(!restoring) {
+            for(uint32_t page = 0; page < pages; page++) {
+                const uint8_t *bytes = p + page * SparsePageSize;
+                if(std::any_of(bytes, bytes + SparsePageSize, [](uint8_t b) { return b != 0; })) {
+                    used.push_back(page);
+                }
+            }
+        } else {
+            std::fill(p, p + size, 0);
+        }
+        uint32_t count = used.size();
+        field(count);
+        for(uint32_t i = 0; i < count; i++) {
+            uint32_t page = restoring ? 0 : used[i];
+            field(page);
+            if(page >= pages) {
+                throw std::string("snapshot is corrupt");
+            }
+            bytes(p + page * SparsePageSize, SparsePageSize);
+        }
+    }
+
+    // Start a snapshot of a kind of machine, checking it's one we can read
+    void header(Kind kind)
+    {
+        char magic[8];
+        uint32_t version = Version;
+        uint32_t savedKind = kind;
+        memcpy(magic, Magic, sizeof(magic));
+        if(restoring && (data.size() < sizeof(magic))) {
+            throw std::string("not a snapshot");
+        }
+        bytes(magic, sizeof(magic));
+        if(memcmp(magic, Magic, sizeof(magic)) != 0) {
+            throw std::string("not a snapshot");
+        }
+        field(version);
+        if(version != Version) {
+            throw "snapshot is version " + std::to_string(version) + ", this emulator reads version " + std::to_string(Version);
+        }
+        field(savedKind);
+        if(savedKind != kind) {
+            throw std::string("snapshot is of a different kind of machine");
+        }
+    }
+
+    // End a snapshot; anything left over means it wasn't the machine we read
+    void trailer()
+    {
+        if(restoring && (position != data.size())) {
+            throw std::string("snapshot is corrupt");
+        }
+    }
+};
+
+constexpr int UIUpdateFrequency = 30;
+
+inline uint16_t u16from2xu8(uint8_t hi, uint8_t lo)
+{
+    return hi << 8 | lo;
+}
+
+// Debug names of buses, buffers and blocks, interned so the value types stay a
+// couple of words, copying or comparing them never touches the heap, and
+// trace records can name them with an index
+inline std::vector<std::string>& WireNameTable()
+{
+    static std::vector<std::string> names;
+    return names;
+}
+
+inline uint16_t InternWireName(const std::string& name)
+{
+    auto& names = WireNameTable();
+    auto found = std::find(names.begin(), names.end(), name);
+    if(found != names.end()) {
+        return found - names.begin();
+    }
+    names.push_back(name);
+    return names.size() - 1;
+}
+
+// Tracing.  Categories are switched on at runtime with --trace; a disabled
+// category costs a test of one global word.  Enabled events are appended to
+// a ring of fixed-size binary records and only formatted when dumped.
+enum TraceCategory : uint32_t
+{
+    TraceCounter = 0x01,
+    TraceMemory = 0x02,
+    TraceBus = 0x04,
+    TraceStep = 0x08,
+    TraceUART = 0x10,
+};
+
+inline uint32_t TraceCategories = 0;
+
+enum TraceEvent : uint8_t
+{
+    TraceCounterReset,
+    TraceCounterLoad,
+    TraceCounterIncrement,
+    TraceCounterOutput,
+    TraceRAMRead,
+    TraceRAMWrite,
+    TraceFlashRead,
+    TraceFlashWrite,
+    TraceFlashErase,
+    TraceBusDriven,
+    TraceBusSettled,
+    TraceClockPhase,
+    TraceBlockChanged,
+    TraceUARTWrite,
+    TraceUARTRead,
+    TraceUARTReadEmpty,
+    TraceUARTOverrun,
+};
+
+struct TraceRecord
+{
+    uint16_t name;
+    TraceEvent event;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t value;
+};
+
+struct TraceRing
+{
+    static constexpr size_t Size = 1 << 16;
+    std::array<TraceRecord, Size> records;
+    uint64_t written = 0;
+
+    void Add(uint16_t name, TraceEvent event, uint32_t address, uint32_t value)
+    {
+        records[written % Size] = {name, event, 0, address, value};
+        written++;
+    }
+
+    // A TraceClockPhase record holds the 64-bit step count with its low
+    // half in address and its high half in value, above the clock
+    static uint64_t ClockPhaseStep(const TraceRecord& r)
+    {
+        return ((uint64_t)(r.value >> 1) << 32) | r.address;
+    }
+
+    static void Format(FILE *fp, const TraceRecord& r)
+    {
+        const char *name = WireNameTable()[r.name].c_str();
+        switch(r.event) {
+            case TraceCounterReset: fprintf(fp, "%s counter reset\n", name); break;
+            case TraceCounterLoad: fprintf(fp, "%s counter load, now 0x%x\n", name, r.value); break;
+            case TraceCounterIncrement: fprintf(fp, "%s counter increment, now 0x%x\n", name, r.value); break;
+            case TraceCounterOutput: fprintf(fp, "%s counter output 0x%x\n", name, r.value); break;
+            case TraceRAMRead: fprintf(fp, "%s read 0x%02x from RAM 0x%04x\n", name, r.value, r.address); break;
+            case TraceRAMWrite: fprintf(fp, "%s write 0x%02x to RAM 0x%04x\n", name, r.value, r.address); break;
+            case TraceFlashRead: fprintf(fp, "%s read 0x%02x from Flash 0x%05x\n", name, r.value, r.address); break;
+            case TraceFlashWrite: fprintf(fp, "%s write 0x%02x to Flash 0x%05x\n", name, r.value, r.address); break;
+            case TraceFlashErase: fprintf(fp, "%s erase Flash 0x%05x to 0x%05x\n", name, r.address, r.value); break;
+            case TraceBusDriven: fprintf(fp, "%s drives 0x%x\n", name, r.value); break;
+            case TraceBusSettled: fprintf(fp, "%s settled at 0x%x\n", name, r.value); break;
+            case TraceClockPhase: fprintf(fp, "step %llu clock %s\n", (unsigned long long)ClockPhaseStep(r), (r.value & 1) ? "high" : "low"); break;
+            case TraceBlockChanged: fprintf(fp, "    %s output changed\n", name); break;
+            case TraceUARTWrite: fprintf(fp, "%s transmit 0x%02x\n", name, r.value); break;
+            case TraceUARTRead: fprintf(fp, "%s receive 0x%02x\n", name, r.value); break;
+            case TraceUARTReadEmpty: fprintf(fp, "%s receive, nothing waiting\n", name); break;
+            case TraceUARTOverrun: fprintf(fp, "%s overrun, 0x%02x lost\n", name, r.value); break;
+        }
+    }
+
+    // Format what's in the ring, oldest first, and empty it
+    void Dump(FILE *fp)
+    {
+        uint64_t first = (written > Size) ? (written - Size) : 0;
+        if(first > 0) {
+            fprintf(fp, "trace: %llu older records were overwritten\n", (unsigned long long)first);
+        }
+        for(uint64_t i = first; i < written; i++) {
+            Format(fp, records[i % Size]);
+        }
+        written = 0;
+    }
+};
+
+inline TraceRing TraceLog;
+
+inline bool Tracing(uint32_t category)
+{
+    return __builtin_expect((TraceCategories & category) != 0, 0);
+}
+
+inline void Trace(uint32_t category, TraceEvent event, uint16_t name, uint32_t address = 0, uint32_t value = 0)
+{
+    if(Tracing(category)) {
+        TraceLog.Add(name, event, address, value);
+    }
+}
+
+// Parse a --trace list like "counter,memory" or "all"; false if a name is unknown
+inline bool ParseTraceCategories(const char *list, uint32_t& categories)
+{
+    static const std::pair<const char*, uint32_t> names[] = {
+        {"counter", TraceCounter},
+        {"memory", TraceMemory},
+        {"bus", TraceBus},
+        {"step", TraceStep},
+        {"uart", TraceUART},
+        {"all", TraceCounter | TraceMemory | TraceBus | TraceStep | TraceUART},
+    };
+    categories = 0;
+    std::string remaining = list;
+    while(!remaining.empty()) {
+        size_t comma = remaining.find(',');
+        std::string name = remaining.substr(0, comma);
+        remaining = (comma == std::string::npos) ? "" : remaining.substr(comma + 1);
+        auto found = std::find_if(std::begin(names), std::end(names), [&](const auto& n) { return name == n.first; });
+        if(found == std::end(names)) {
+            return false;
+        }
+        categories |= found->second;
+    }
+    return true;
+}
+
+// Bytes of operand an instruction fetches after its opcode, before it does
+// anything else.  JPS only reads its operand after pushing its address, so
+// it's left to read it itself.
+constexpr int GetOperandBytes(uint8_t instruction)
+{
+    if((instruction >= OpLDI) && (instruction <= OpSCI)) {
+        return 1;
+    }
+    if((instruction >= OpJPA) && (instruction <= OpSCW)) {
+        return 2;
+    }
+    if((instruction == OpLDS) || (instruction == OpSTS)) {
+        return 1;
+    }
+    if(instruction >= OpBNE) {
+        return 2;
+    }
+    return 0;
+}
+
+// Whatever follows these depends on more than the next address in the same bank
+constexpr bool EndsBasicBlock(uint8_t instruction)
+{
+    return (instruction == OpBNK) || (instruction == OpJPA) || (instruction == OpJPR) || (instruction == OpJPS) || (instruction == OpRTS) || (instruction >= OpBNE);
+}
+
+// Pre-decoded basic blocks of CPU code, keyed by where they were decoded
+// from: the 16 flash banks and RAM, as seen at an address in (bank, PC).
+// Blocks are kept in slots and remember the last blocks that followed them,
+// so a loop runs from block to block without looking anything up.  Writing a
+// 256-byte page drops every block decoded from it.
+struct TranslationCache
+{
+    static constexpr uint32_t Regions = 17; // 16 flash banks, then RAM
+    static constexpr uint32_t Keys = Regions << 15;
+    static constexpr size_t MaxBlockInstructions = 64;
+
+    // Idioms the fused engine runs as one handler
+    enum Fusion : uint8_t {
+        FuseNone,
+        FuseCPIBranch,    // CPI, BEQ or BNE
+        FuseLDIOUT,       // LDI, OUT
+        FuseINPCPIBranch, // INP, CPI, BEQ or BNE
+        FuseLDAADISTA,    // LDA, ADI, STA
+    };
+
+    struct Instruction
+    {
+        uint8_t instruction;
+        uint16_t operand;
+        uint16_t next; // address after the opcode and operand
+        // Set on the first instruction of an idiom when fusing: which, how
+        // many instructions it covers, and the clocks before the last one
+        Fusion fusion = FuseNone;
+        uint8_t fusedCount = 1;
+        uint8_t fusedLeadCycles = 0;
+    };
+
+    struct Link
+    {
+        uint32_t key = 0;
+        int32_t slot = -1;
+        uint32_t epoch = 0;
+    };
+
+    struct Block
+    {
+        std::vector<Instruction> code;
+        uint32_t key = 0;
+        // changes whenever the slot is dropped, so stale links can be spotted
+        uint32_t epoch = 0;
+        bool valid = false;
+        Link links[2];
+        int nextLink = 0;
+        // Runs, and native code for the first nativeInstructions of code
+        // once it gets hot, valid while nativeGeneration matches the JIT's
+        uint32_t executions = 0;
+        void *native = nullptr;
+        uint32_t nativeInstructions = 0;
+        uint32_t nativeGeneration = 0;
+        // whether that code stores to memory
+        bool nativeStores = false;
+        // CPU clocks from the start of the block to the start of the last
+        // native instruction, which has to start by the end of a batch
+        uint32_t nativeLeadCycles = 0;
+    };
+
+    std::vector<Block> blocks;
+    std::vector<int32_t> freeSlots;
+    std::vector<int32_t> blockAt;
+    // (slot, epoch) of blocks decoded from each page
+    std::vector<std::vector<std::pair<int32_t, uint32_t>>> pageBlocks;
+    // nonzero where pageBlocks isn't empty, for native code to test
+    std::vector<uint8_t> codePages;
+
+    uint64_t translations = 0;
+    uint64_t invalidations = 0;
+    // Mark idioms in blocks as they're decoded
+    bool fusing = false;
+
+    TranslationCache() :
+        blockAt(Keys, -1),
+        pageBlocks(Keys >> 8),
+        codePages(Keys >> 8, 0)
+    {}
+
+    static uint32_t Key(uint32_t bank, uint16_t address)
+    {
+        return (((address & 0x8000) ? 16 : bank) << 15) | (address & 0x7FFF);
+    }
+
+    int32_t find(uint32_t key) const
+    {
+        return blockAt[key];
+    }
+
+    // Follow from's link to the block at key, if it still holds
+    int32_t follow(int32_t from, uint32_t key) const
+    {
+        for(const auto& link : blocks[from].links) {
+            if((link.key == key) && (link.slot >= 0) && (blocks[link.slot].epoch == link.epoch)) {
+                return link.slot;
+            }
+        }
+        return -1;
+    }
+
+    void link(int32_t from, int32_t to)
+    {
+        Block& block = blocks[from];
+        block.links[block.nextLink] = {blocks[to].key, to, blocks[to].epoch};
+        block.nextLink = (block.nextLink + 1) % 2;
+    }
+
+    int32_t allocate(uint32_t key)
+    {
+        int32_t slot;
+        if(!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            slot = blocks.size();
+            blocks.push_back({});
+        }
+        Block& block = blocks[slot];
+        block.code.clear();
+        block.key = key;
+        block.valid = true;
+        block.links[0] = block.links[1] = {};
+        block.executions = 0;
+        block.native = nullptr;
+        block.nativeGeneration = 0;
+        blockAt[key] = slot;
+        translations++;
+        return slot;
+    }
+
+    // Record that slot was decoded from the bytes at keys first to last
+    void covers(int32_t slot, uint32_t first, uint32_t last)
+    {
+        for(uint32_t page = first >> 8; page <= (last >> 8); page++) {
+            pageBlocks[page].push_back({slot, blocks[slot].epoch});
+            codePages[page] = 1;
+        }
+    }
+
+    void drop(int32_t slot)
+    {
+        Block& block = blocks[slot];
+        if(blockAt[block.key] == slot) {
+            blockAt[block.key] = -1;
+        }
+        block.valid = false;
+        block.epoch++;
+        freeSlots.push_back(slot);
+        invalidations++;
+    }
+
+    // The idiom starting with the opcodes first, second and third, if any,
+    // and how many of them it covers; pass 0xFF for opcodes past the end
+    static Fusion FusionFor(uint8_t first, uint8_t second, uint8_t third, int& count)
+    {
+        bool secondTestsZ = (second == OpBEQ) || (second == OpBNE);
+        bool thirdTestsZ = (third == OpBEQ) || (third == OpBNE);
+        if((first == OpINP) && (second == OpCPI) && thirdTestsZ) {
+            count = 3;
+            return FuseINPCPIBranch;
+        }
+        if((first == OpLDA) && (second == OpADI) && (third == OpSTA)) {
+            count = 3;
+            return FuseLDAADISTA;
+        }
+        if((first == OpCPI) && secondTestsZ) {
+            count = 2;
+            return FuseCPIBranch;
+        }
+        if((first == OpLDI) && (second == OpOUT)) {
+            count = 2;
+            return FuseLDIOUT;
+        }
+        count = 1;
+        return FuseNone;
+    }
+
+    // Mark the idioms in slot's code.  Only a branch, last, takes clocks
+    // that depend on flags, so the lead before it is fixed.
+    void fuse(int32_t slot)
+    {
+        auto& code = blocks[slot].code;
+        auto opcode = [&](size_t i) { return (i < code.size()) ? code[i].instruction : 0xFF; };
+        for(size_t i = 0; i < code.size(); ) {
+            int count;
+            code[i].fusion = FusionFor(opcode(i), opcode(i + 1), opcode(i + 2), count);
+            code[i].fusedCount = count;
+            code[i].fusedLeadCycles = 0;
+            for(int k = 0; k < count - 1; k++) {
+                code[i].fusedLeadCycles += GetInstructionCycles(code[i + k].instruction, 0);
+            }
+            i += count;
+        }
+    }
+
+    // Bytes at keys first to last were written
+    void written(uint32_t first, uint32_t last)
+    {
+        for(uint32_t page = first >> 8; page <= (last >> 8); page++) {
+            written(page << 8);
+        }
+    }
+
+    // A byte at key was written; drop anything decoded from its page
+    void written(uint32_t key)
+    {
+        auto& decoded = pageBlocks[key >> 8];
+        if(decoded.empty()) {
+            return;
+        }
+        for(auto [slot, epoch] : decoded) {
+            if(blocks[slot].epoch == epoch) {
+                drop(slot);
+            }
+        }
+        decoded.clear();
+        codePages[key >> 8] = 0;
+    }
+};
+
+// How often each pair and triple of opcodes runs back to back within a
+// basic block, for finding idioms worth fusing
+struct NgramProfile
+{
+    std::vector<uint64_t> pairs;
+    std::vector<uint64_t> triples;
+    uint64_t instructions = 0;
+    // the last two opcodes, most recent in the low six bits, and how many
+    // of them are in the current basic block
+    uint32_t history = 0;
+    int length = 0;
+
+    NgramProfile() :
+        pairs(64 * 64, 0),
+        triples(64 * 64 * 64, 0)
+    {}
+
+    void count(uint8_t instruction)
+    {
+        instructions++;
+        if(length >= 1) {
+            pairs[((history & 0x3F) << 6) | instruction]++;
+        }
+        if(length >= 2) {
+            triples[(history << 6) | instruction]++;
+        }
+        history = ((history << 6) | instruction) & 0xFFF;
+        length = EndsBasicBlock(instruction) ? 0 : std::min(length + 1, 2);
+    }
+};
+
+#if EMU_JIT
+// What native code for a translated block reads on entry and leaves on exit.
+// executed is how many of the block's instructions ran, cycles how many CPU
+// clocks they took, and writtenKey the translation-cache key of a write to a
+// page holding translated code, or NoWrite.
+struct JitState
+{
+    uint8_t A;
+    uint8_t flags;
+    uint16_t PC;
+    uint32_t executed;
+    uint64_t cycles;
+    uint32_t writtenKey;
+
+    static constexpr uint32_t NoWrite = 0xFFFFFFFF;
+};
+
+typedef void (*JitFunction)(JitState *state);
+
+// Executable memory for native code, handed out from one mapping.  When it
+// fills up everything is thrown away and generation moves on, which makes
+// every block's native pointer stale until it is compiled again.  No page
+// is ever writable and executable at once: the mapping is executable, and
+// add() makes just the pages it copies code into writable while it does.
+struct JitCodeBuffer
+{
+    static constexpr size_t Size = 16 * 1024 * 1024;
+    uint8_t *base = nullptr;
+    size_t used = 0;
+    uint32_t generation = 1;
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+
+    JitCodeBuffer()
+    {
+        void *mapped = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mapped == MAP_FAILED) {
+            return;
+        }
+        // where the system won't make mapped memory executable, there's no JIT
+        if(mprotect(mapped, Size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(mapped, Size);
+            return;
+        }
+        base = static_cast<uint8_t*>(mapped);
+    }
+    ~JitCodeBuffer()
+    {
+        if(base) {
+            munmap(base, Size);
+        }
+    }
+    JitCodeBuffer(const JitCodeBuffer&) = delete;
+    JitCodeBuffer& operator=(const JitCodeBuffer&) = delete;
+
+    bool succeeded() const
+    {
+        return base != nullptr;
+    }
+
+    // Copy code in, returning where it went, or nullptr if its pages
+    // couldn't be made writable and then executable again
+    void *add(const std::vector<uint8_t>& code)
+    {
+        if(used + code.size() > Size) {
+            used = 0;
+            generation++;
+        }
+        uint8_t *native = base + used;
+        uint8_t *first = base + (used & ~(pageSize - 1));
+        size_t length = (native + code.size()) - first;
+        if(mprotect(first, length, PROT_READ | PROT_WRITE) != 0) {
+            return nullptr;
+        }
+        memcpy(native, code.data(), code.size());
+        if(mprotect(first, length, PROT_READ | PROT_EXEC) != 0) {
+            return nullptr;
+        }
+        used += code.size();
+        return native;
+    }
+};
+
+// Just enough of an x86-64 assembler for translated blocks.  The CPU's A
+// lives in r8d and its flags in r9d; rdi points at the JitState.
+struct JitAssembler
+{
+    std::vector<uint8_t> code;
+
+    void bytes(std::initializer_list<uint8_t> b)
+    {
+        code.insert(code.end(), b);
+    }
+    void imm32(uint32_t v)
+    {
+        for(int i = 0; i < 4; i++) { code.push_back(v >> (i * 8)); }
+    }
+    void imm64(uint64_t v)
+    {
+        for(int i = 0; i < 8; i++) { code.push_back(v >> (i * 8)); }
+    }
+
+    void loadState()
+    {
+        bytes({0x44, 0x0F, 0xB6, 0x47, offsetof(JitState, A)});     // movzx r8d, byte [rdi+A]
+        bytes({0x44, 0x0F, 0xB6, 0x4F, offsetof(JitState, flags)}); // movzx r9d, byte [rdi+flags]
+    }
+    void exit(uint16_t PC, uint32_t executed, uint32_t cycles, uint32_t writtenKey)
+    {
+        bytes({0x44, 0x88, 0x47, offsetof(JitState, A)});           // mov [rdi+A], r8b
+        bytes({0x44, 0x88, 0x4F, offsetof(JitState, flags)});       // mov [rdi+flags], r9b
+        bytes({0x66, 0xC7, 0x47, offsetof(JitState, PC), uint8_t(PC), uint8_t(PC >> 8)}); // mov word [rdi+PC], PC
+        bytes({0xC7, 0x47, offsetof(JitState, executed)}); imm32(executed);
+        bytes({0x48, 0xC7, 0x47, offsetof(JitState, cycles)}); imm32(cycles);
+        bytes({0xC7, 0x47, offsetof(JitState, writtenKey)}); imm32(writtenKey);
+        bytes({0xC3});                                                // ret
+    }
+
+    void addressInRax(const uint8_t *p) { bytes({0x48, 0xB8}); imm64(reinterpret_cast<uint64_t>(p)); }
+    void eaxFromA() { bytes({0x44, 0x89, 0xC0}); }                  // mov eax, r8d
+    void eaxFromImmediate(uint32_t v) { bytes({0xB8}); imm32(v); }  // mov eax, v
+    void eaxFromMemoryAtRax() { bytes({0x0F, 0xB6, 0x00}); }        // movzx eax, byte [rax]
+    void ecxFromMemoryAtRax() { bytes({0x0F, 0xB6, 0x08}); }        // movzx ecx, byte [rax]
+    void invertEcxByte() { bytes({0xF7, 0xD1, 0x0F, 0xB6, 0xC9}); } // not ecx; movzx ecx, cl
+    void eaxPlusEcx() { bytes({0x01, 0xC8}); }                       // add eax, ecx
+    void eaxPlusImmediate(uint32_t v) { bytes({0x05}); imm32(v); }  // add eax, v
+    void eaxPlusCarry()
+    {
+        bytes({0x44, 0x89, 0xC9});  // mov ecx, r9d
+        bytes({0xD1, 0xE9});        // shr ecx, 1
+        bytes({0x83, 0xE1, 0x01});  // and ecx, 1
+        eaxPlusEcx();
+    }
+    void eaxDouble() { bytes({0x01, 0xC0}); }                        // add eax, eax
+    void ecxFromA() { bytes({0x44, 0x89, 0xC1}); }                  // mov ecx, r8d
+    void AFromAl() { bytes({0x44, 0x0F, 0xB6, 0xC0}); }             // movzx r8d, al
+    void AFromImmediate(uint8_t v) { bytes({0x41, 0xB8}); imm32(v); } // mov r8d, v
+    void AFromMemoryAtRax() { bytes({0x44, 0x0F, 0xB6, 0x00}); }    // movzx r8d, byte [rax]
+    void AToMemoryAtRax() { bytes({0x44, 0x88, 0x00}); }             // mov [rax], r8b
+    void addressInR10(const uint8_t *p) { bytes({0x49, 0xBA}); imm64(reinterpret_cast<uint64_t>(p)); }
+    void eaxFromMemoryAtR10() { bytes({0x41, 0x0F, 0xB6, 0x02}); }  // movzx eax, byte [r10]
+    void AToMemoryAtR10() { bytes({0x45, 0x88, 0x02}); }             // mov [r10], r8b
+    void flagsFromImmediate(uint8_t v) { bytes({0x41, 0xB9}); imm32(v); } // mov r9d, v
+    // N, C and Z of the sum in eax, as alu() latches them
+    void flagsFromEax()
+    {
+        bytes({0x89, 0xC1, 0xC1, 0xE9, 0x07, 0x83, 0xE1, 0x02}); // mov ecx, eax; shr ecx, 7; and ecx, 2
+        bytes({0x89, 0xC2, 0xC1, 0xEA, 0x05, 0x83, 0xE2, 0x04}); // mov edx, eax; shr edx, 5; and edx, 4
+        bytes({0x09, 0xD1});                                     // or ecx, edx
+        bytes({0x84, 0xC0, 0x0F, 0x94, 0xC2, 0x0F, 0xB6, 0xD2}); // test al, al; sete dl; movzx edx, dl
+        bytes({0x09, 0xD1, 0x41, 0x89, 0xC9});                   // or ecx, edx; mov r9d, ecx
+    }
+    // Jump if the byte at rax is nonzero, or if (flags & mask) is nonzero
+    // or zero; returns where to patch in the target
+    size_t jumpIfMemoryAtRaxNonzero()
+    {
+        bytes({0x80, 0x38, 0x00, 0x0F, 0x85}); // cmp byte [rax], 0; jne
+        imm32(0);
+        return code.size() - 4;
+    }
+    size_t jumpOnFlags(uint8_t mask, bool ifSet)
+    {
+        bytes({0x41, 0xF7, 0xC1}); imm32(mask); // test r9d, mask
+        bytes({0x0F, uint8_t(ifSet ? 0x85 : 0x84)});
+        imm32(0);
+        return code.size() - 4;
+    }
+    void patch(size_t at)
+    {
+        uint32_t rel = code.size() - (at + 4);
+        memcpy(&code[at], &rel, 4);
+    }
+};
+#endif
+
+template <class MEMORY, class INTERFACE>
+struct MinimalEmulator
+{
+    uint64_t cpuClockLengthInSystemClocks;
+    Clock mostRecentSystemClock;
+
+    // Architectural state that lives across instructions.  B and the memory
+    // address registers are only scratch inside an instruction's microcode,
+    // and BANK lives in MEMORY, so none of those are kept here.
+    uint8_t A = 0;
+    uint16_t PC = 0;
+    uint8_t flags = 0;
+
+    uint64_t instructions = 0;
+    std::array<uint8_t, 8 * 64> instructionCycles;
+
+    // Decoded basic blocks, when enabled with enableTranslationCache()
+    std::unique_ptr<TranslationCache> cache;
+
+    // Opcode sequences step() has run, when profiling
+    std::unique_ptr<NgramProfile> profile;
+
+    // Firmware waiting for input spins on INP.  Each time an INP finds
+    // nothing, the machine is noted as it is then; if it's back the same
+    // the next time, with nothing written, sent, received or banked in
+    // between, every trip round the loop will go the same way until input
+    // comes, so idle() jumps the clock over as many trips as fit the batch.
+    struct PollPoint
+    {
+        bool valid = false;
+        uint64_t clock = 0;
+        uint64_t instructions = 0;
+        uint64_t effects = 0;
+        uint16_t PC = 0;
+        uint8_t A = 0;
+        uint8_t flags = 0;
+        uint32_t bank = 0;
+    };
+    PollPoint lastPoll;
+    // an INP found nothing since idle() last looked
+    bool polledEmpty = false;
+    // counts writes, OUT, BNK and bytes received: anything that could make
+    // one trip round a loop differ from the last
+    uint64_t effects = 0;
+    bool skipIdle = true;
+    // system clocks skipped over that way
+    clk_t idleClocks = 0;
+
+    enum StepResult {
+        CONTINUE,
+        EXIT,
+    };
+
+    MinimalEmulator(uint64_t CPUClockRate, const Clock& systemClock) :
+        mostRecentSystemClock(systemClock)
+    {
+        assert(systemClock.rate % CPUClockRate == 0);
+        cpuClockLengthInSystemClocks = systemClock.rate / CPUClockRate;
+        for(int f = 0; f < 8; f++) {
+            for(int instruction = 0; instruction < 64; instruction++) {
+                instructionCycles[(f << 6) | instruction] = GetInstructionCycles(instruction, f);
+            }
+        }
+    }
+
+    // A + B + carry, latching flags the way EOFI does
+    uint8_t alu(uint8_t a, uint8_t b, uint8_t carry)
+    {
+        uint32_t result = a + b + carry;
+        flags = ((result & 0x80) ? FlagN : 0) | ((result > 0xFF) ? FlagC : 0) | (((result & 0xFF) == 0) ? FlagZ : 0);
+        return result;
+    }
+
+    // The microcode shifts right by rotating (C,A) left through the adder
+    // eight times; the net effect is one 9-bit rotate right.
+    void rotateRight(uint8_t carry)
+    {
+        uint8_t out = A & 1;
+        A = (carry << 7) | (A >> 1);
+        flags = ((A & 0x80) ? FlagN : 0) | (out ? FlagC : 0) | ((A == 0) ? FlagZ : 0);
+    }
+
+    uint8_t carry() const
+    {
+        return (flags & FlagC) ? 1 : 0;
+    }
+
+    uint8_t read(MEMORY& memory, uint16_t address)
+    {
+        uint8_t data;
+        memory.read(address, data);
+        return data;
+    }
+
+    uint16_t readWord(MEMORY& memory, uint16_t address)
+    {
+        uint8_t lo = read(memory, address);
+        uint8_t hi = read(memory, address + 1);
+        return u16from2xu8(hi, lo);
+    }
+
+    uint8_t fetch(MEMORY& memory)
+    {
+        return read(memory, PC++);
+    }
+
+    uint16_t fetchWord(MEMORY& memory)
+    {
+        uint16_t word = readWord(memory, PC);
+        PC += 2;
+        return word;
+    }
+
+    uint16_t fetchOperand(MEMORY& memory, uint8_t instruction)
+    {
+        switch(GetOperandBytes(instruction)) {
+            case 1: return fetch(memory);
+            case 2: return fetchWord(memory);
+            default: return 0;
+        }
+    }
+
+    // Every write goes through here so translated or compiled code written
+    // over is dropped; Memory reports what changed by translation-cache key
+    void write(MEMORY& memory, uint16_t address, uint8_t data)
+    {
+        // even a write that changes nothing can move the flash commands on
+        effects++;
+        if(!memory.write(address, data)) {
+            return;
+        }
+        if(cache) {
+            cache->written(memory.writtenFirst, memory.writtenLast);
+        }
+        if(!compiled.empty() && (memory.writtenFirst < FlashSize)) {
+            // compiled blocks don't run past the end of their bank, so
+            // dropping the banks written leaves the interpreter there
+            uint32_t last = std::min<uint32_t>(memory.writtenLast, FlashSize - 1);
+            std::fill(compiled.begin() + (memory.writtenFirst & ~0x7FFF), compiled.begin() + (last | 0x7FFF) + 1, nullptr);
+        }
+    }
+
+    // After an INP found nothing, with PC and mostRecentSystemClock past
+    // it: skip whole trips round a polling loop up to systemClock
+    void idle(MEMORY& memory, const Clock& systemClock)
+    {
+        polledEmpty = false;
+        PollPoint now{true, mostRecentSystemClock.clocks, instructions, effects, PC, A, flags, memory.bank};
+        // (a device mapped over memory might answer differently each time)
+        if(skipIdle && !profile && lastPoll.valid && (now.effects == lastPoll.effects) && (now.PC == lastPoll.PC) && (now.A == lastPoll.A) &&
+            (now.flags == lastPoll.flags) && (now.bank == lastPoll.bank) && (now.clock <= systemClock.clocks) &&
+            std::none_of(memory.handlers.begin(), memory.handlers.end(), [](const auto *handler) { return handler != nullptr; }))
+        {
+            uint64_t period = now.clock - lastPoll.clock;
+            uint64_t trips = (systemClock.clocks - now.clock) / period;
+            now.clock += trips * period;
+            now.instructions += trips * (now.instructions - lastPoll.instructions);
+            idleClocks += trips * period;
+            instructions = now.instructions;
+            mostRecentSystemClock.clocks = now.clock;
+        }
+        lastPoll = now;
+    }
+
+    void enableTranslationCache()
+    {
+        cache = std::make_unique<TranslationCache>();
+    }
+
+    // The translation cache, running common idioms as one handler each
+    void enableFusion()
+    {
+        enableTranslationCache();
+        cache->fusing = true;
+    }
+
+    // A basic block compiled ahead of time by emu-minimal-aot.  It runs its
+    // instructions from the start while clock is at or before limit,
+    // leaving clock at the end of the last one it started.
+    typedef void (*CompiledBlock)(MinimalEmulator& cpu, MEMORY& memory, INTERFACE& interface, uint64_t& clock, uint64_t limit);
+
+    // Compiled blocks by translation-cache key, when enabled with enableCompiledBlocks()
+    std::vector<CompiledBlock> compiled;
+
+    void enableCompiledBlocks(const std::vector<std::pair<uint32_t, CompiledBlock>>& blocks)
+    {
+        compiled.assign(TranslationCache::Keys, nullptr);
+        for(const auto& [key, block] : blocks) {
+            compiled[key] = block;
+        }
+    }
+
+    // Save or restore the CPU, after memory.  Whatever was decoded or
+    // compiled may not match restored memory, so it goes; compiled blocks
+    // only stay for banks whose flash is still the image's.
+    void snapshot(SnapshotArchive& archive, MEMORY& memory)
+    {
+        archive.field(mostRecentSystemClock);
+        archive.field(A);
+        archive.field(PC);
+        archive.field(flags);
+        archive.field(instructions);
+        if(archive.restoring) {
+            forgetCode(memory);
+        }
+    }
+
+    // Memory changed behind the CPU's back
+    void forgetCode(MEMORY& memory)
+    {
+        if(cache) {
+            cache->written(0, TranslationCache::Keys - 1);
+        }
+        if(!compiled.empty()) {
+            for(const auto& copy : memory.flash.copies) {
+                uint32_t bank = (copy.first << memory.flash.PageBits) & ~0x7FFF;
+                std::fill(compiled.begin() + bank, compiled.begin() + bank + 0x8000, nullptr);
+            }
+        }
+    }
+
+#if EMU_JIT
+    // Native code for hot blocks, when enabled with enableJit()
+    std::unique_ptr<JitCodeBuffer> jit;
+    uint32_t jitThreshold = 16;
+
+    // Turn on the translation cache and the JIT; false, leaving just the
+    // cache, if there's no executable memory to be had
+    bool enableJit()
+    {
+        enableTranslationCache();
+        jit = std::make_unique<JitCodeBuffer>();
+        if(!jit->succeeded()) {
+            jit.reset();
+            return false;
+        }
+        return true;
+    }
+
+    static bool BranchTaken(uint8_t instruction, uint8_t flags)
+    {
+        switch(instruction) {
+            case OpBNE: return !(flags & FlagZ);
+            case OpBEQ: return flags & FlagZ;
+            case OpBCC: return !(flags & FlagC);
+            case OpBCS: return flags & FlagC;
+            case OpBPL: return !(flags & FlagN);
+            default: return flags & FlagN;
+        }
+    }
+
+    static bool WritesFlags(uint8_t instruction)
+    {
+        return ((instruction >= OpCLC) && (instruction <= OpROL)) || ((instruction >= OpNEG) && (instruction <= OpDEC)) ||
+            ((instruction >= OpADI) && (instruction <= OpSCI)) || ((instruction >= OpADA) && (instruction <= OpSCA)) ||
+            (instruction == OpINB) || (instruction == OpDEB);
+    }
+
+    static bool ReadsFlags(uint8_t instruction)
+    {
+        return (instruction == OpROL) || (instruction == OpACI) || (instruction == OpSCI) || (instruction == OpACA) || (instruction == OpSCA) || (instruction >= OpBNE);
+    }
+
+    // Where native code finds the byte at address when the block runs, or
+    // nullptr if that depends on more than the block's key.  Flash writes,
+    // pages with handlers and flash reads from code in RAM, which sees
+    // whichever bank is current, are left to the interpreter.  Blocks are
+    // compiled in the bank of their key, so the page table has it mapped.
+    static uint8_t *HostAddress(MEMORY& memory, uint32_t region, uint16_t address, bool writing)
+    {
+        if(!(address & 0x8000) && (region == 16)) {
+            return nullptr;
+        }
+        const auto& page = memory.pages[address >> MEMORY::PageBits];
+        // native code only reads through pointers it didn't ask to write
+        uint8_t *host = writing ? page.write : const_cast<uint8_t *>(page.read);
+        return host ? (host + (address & (MEMORY::PageSize - 1))) : nullptr;
+    }
+
+    // Whether the JIT handles an instruction: ALU ops, loads and stores
+    // with a fixed address and a fixed cycle count, and jumps and branches
+    // to end the block on
+    bool JitHandles(MEMORY& memory, uint32_t region, const TranslationCache::Instruction& decoded)
+    {
+        uint8_t instruction = decoded.instruction;
+        if(instruction >= OpBNE) {
+            // cycles may only depend on whether the branch is taken
+            for(int f = 0; f < 8; f++) {
+                for(int g = 0; g < 8; g++) {
+                    if((BranchTaken(instruction, f) == BranchTaken(instruction, g)) && (instructionCycles[(f << 6) | instruction] != instructionCycles[(g << 6) | instruction])) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+        for(int f = 1; f < 8; f++) {
+            if(instructionCycles[(f << 6) | instruction] != instructionCycles[instruction]) {
+                return false;
+            }
+        }
+        switch(instruction) {
+            case OpNOP: case OpCLC: case OpSEC: case OpLSL: case OpROL: case OpNEG: case OpINC: case OpDEC:
+            case OpLDI: case OpADI: case OpSBI: case OpCPI: case OpACI: case OpSCI:
+            case OpJPA:
+                return true;
+            case OpLDA: case OpADA: case OpSBA: case OpCPA: case OpACA: case OpSCA:
+                return HostAddress(memory, region, decoded.operand, false) != nullptr;
+            case OpSTA: case OpINB: case OpDEB:
+                // Memory::write() traces RAM writes, and native stores skip it
+                return !Tracing(TraceMemory) && (HostAddress(memory, region, decoded.operand, true) != nullptr);
+            default:
+                return false;
+        }
+    }
+
+    // Emit native code for the block's instructions up to the first one the
+    // JIT doesn't handle; the interpreter picks up from there.
+    void compileBlock(MEMORY& memory, int32_t slot)
+    {
+        TranslationCache::Block& block = cache->blocks[slot];
+        uint32_t region = block.key >> 15;
+
+        size_t count = 0;
+        while((count < block.code.size()) && JitHandles(memory, region, block.code[count])) {
+            count++;
+        }
+        if(count == 0) {
+            // nothing to compile, so don't try again until the buffer wraps
+            block.native = nullptr;
+            block.nativeGeneration = jit->generation;
+            return;
+        }
+
+        // Flags only have to be worked out where something reads them
+        // before they're set again; every exit reads them.
+        std::vector<bool> flagsLive(count);
+        bool live = true;
+        for(size_t i = count; i-- > 0; ) {
+            uint8_t instruction = block.code[i].instruction;
+            bool sideExit = (instruction == OpSTA) || (instruction == OpINB) || (instruction == OpDEB);
+            flagsLive[i] = live || sideExit;
+            live = ReadsFlags(instruction) || (!WritesFlags(instruction) && flagsLive[i]);
+        }
+
+        struct SideExit
+        {
+            size_t patch;
+            uint16_t PC;
+            uint32_t executed;
+            uint32_t cycles;
+            uint32_t writtenKey;
+        };
+        std::vector<SideExit> sideExits;
+
+        JitAssembler as;
+        as.loadState();
+        uint32_t cycles = 0;
+        bool ended = false;
+        for(size_t i = 0; i < count; i++) {
+            const TranslationCache::Instruction& decoded = block.code[i];
+            uint8_t instruction = decoded.instruction;
+            uint8_t operand = decoded.operand;
+            uint8_t *p = nullptr;
+            if(((instruction >= OpLDA) && (instruction <= OpSCA)) || (instruction == OpINB) || (instruction == OpDEB)) {
+                p = HostAddress(memory, region, decoded.operand, (instruction == OpSTA) || (instruction == OpINB) || (instruction == OpDEB));
+                if(!(decoded.operand & 0x8000)) {
+                    // p points at the flash page as it is now, so the block
+                    // has to go if the page is programmed
+                    uint32_t key = TranslationCache::Key(region, decoded.operand);
+                    cache->covers(slot, key, key);
+                }
+            }
+            if(i + 1 == count) {
+                block.nativeLeadCycles = cycles;
+            }
+            if(instruction >= OpBNE) {
+                uint8_t mask = ((instruction == OpBNE) || (instruction == OpBEQ)) ? FlagZ : ((instruction == OpBCC) || (instruction == OpBCS)) ? FlagC : FlagN;
+                bool takenIfSet = (instruction == OpBEQ) || (instruction == OpBCS) || (instruction == OpBMI);
+                uint8_t takenFlags = takenIfSet ? mask : 0;
+                uint8_t notTakenFlags = takenIfSet ? 0 : mask;
+                size_t taken = as.jumpOnFlags(mask, takenIfSet);
+                as.exit(decoded.next, i + 1, cycles + instructionCycles[(notTakenFlags << 6) | instruction], JitState::NoWrite);
+                as.patch(taken);
+                as.exit(decoded.operand, i + 1, cycles + instructionCycles[(takenFlags << 6) | instruction], JitState::NoWrite);
+                ended = true;
+                break;
+            }
+            cycles += instructionCycles[instruction];
+            switch(instruction) {
+                case OpNOP: break;
+                case OpCLC: if(flagsLive[i]) { as.flagsFromImmediate(FlagN); } break;
+                case OpSEC: if(flagsLive[i]) { as.flagsFromImmediate(FlagC | FlagZ); } break;
+                case OpLSL: as.eaxFromA(); as.eaxDouble(); break;
+                case OpROL: as.eaxFromA(); as.eaxDouble(); as.eaxPlusCarry(); break;
+                case OpNEG: as.ecxFromA(); as.invertEcxByte(); as.eaxFromImmediate(1); as.eaxPlusEcx(); break;
+                case OpINC: as.eaxFromA(); as.eaxPlusImmediate(1); break;
+                case OpDEC: as.eaxFromA(); as.eaxPlusImmediate(0xFF); break;
+                case OpLDI: as.AFromImmediate(operand); break;
+                case OpADI: as.eaxFromA(); as.eaxPlusImmediate(operand); break;
+                case OpSBI: case OpCPI: as.eaxFromA(); as.eaxPlusImmediate(uint8_t(~operand) + 1); break;
+                case OpACI: as.eaxFromA(); as.eaxPlusImmediate(operand); as.eaxPlusCarry(); break;
+                case OpSCI: as.eaxFromA(); as.eaxPlusImmediate(uint8_t(~operand)); as.eaxPlusCarry(); break;
+                case OpJPA:
+                    as.exit(decoded.operand, i + 1, cycles, JitState::NoWrite);
+                    ended = true;
+                    break;
+                case OpLDA: as.addressInRax(p); as.AFromMemoryAtRax(); break;
+                case OpADA: case OpSBA: case OpCPA: case OpACA: case OpSCA:
+                    as.addressInRax(p);
+                    as.ecxFromMemoryAtRax();
+                    if((instruction == OpSBA) || (instruction == OpCPA) || (instruction == OpSCA)) {
+                        as.invertEcxByte();
+                    }
+                    as.eaxFromA();
+                    as.eaxPlusEcx();
+                    if((instruction == OpSBA) || (instruction == OpCPA)) {
+                        as.eaxPlusImmediate(1);
+                    } else if((instruction == OpACA) || (instruction == OpSCA)) {
+                        as.eaxPlusCarry();
+                    }
+                    break;
+                case OpSTA: case OpINB: case OpDEB: {
+                    as.addressInR10(p);
+                    if(instruction != OpSTA) {
+                        as.eaxFromMemoryAtR10();
+                        as.eaxPlusImmediate((instruction == OpINB) ? 1 : 0xFF);
+                        as.AFromAl();
+                        if(flagsLive[i]) {
+                            as.flagsFromEax();
+                        }
+                    }
+                    as.AToMemoryAtR10();
+                    // Leave if that landed on translated code, for the
+                    // interpreter to drop it
+                    uint32_t key = TranslationCache::Key(0, decoded.operand);
+                    as.addressInRax(&cache->codePages[key >> 8]);
+                    sideExits.push_back({as.jumpIfMemoryAtRaxNonzero(), decoded.next, uint32_t(i + 1), cycles, key});
+                    break;
+                }
+            }
+            if(ended) {
+                break;
+            }
+            // Latch the sum in eax into A and the flags
+            bool setsA = (instruction == OpLSL) || (instruction == OpROL) || (instruction == OpNEG) || (instruction == OpINC) || (instruction == OpDEC) ||
+                (instruction == OpADI) || (instruction == OpSBI) || (instruction == OpACI) || (instruction == OpSCI) ||
+                (instruction == OpADA) || (instruction == OpSBA) || (instruction == OpACA) || (instruction == OpSCA);
+            if(setsA) {
+                as.AFromAl();
+            }
+            bool sumFlags = setsA || (instruction == OpCPI) || (instruction == OpCPA);
+            if(sumFlags && flagsLive[i]) {
+                as.flagsFromEax();
+            }
+        }
+        if(!ended) {
+            as.exit(block.code[count - 1].next, count, cycles, JitState::NoWrite);
+        }
+        for(const auto& side : sideExits) {
+            as.patch(side.patch);
+            as.exit(side.PC, side.executed, side.cycles, side.writtenKey);
+        }
+
+        block.native = jit->add(as.code);
+        block.nativeInstructions = count;
+        block.nativeStores = std::any_of(block.code.begin(), block.code.begin() + count, [](const TranslationCache::Instruction& decoded) {
+            return (decoded.instruction == OpSTA) || (decoded.instruction == OpINB) || (decoded.instruction == OpDEB);
+        });
+        block.nativeGeneration = jit->generation;
+    }
+
+    // Run the block's native code if it has some and it would all start in
+    // time, returning how many of its instructions ran
+    size_t runNative(MEMORY& memory, int32_t slot, uint64_t& clock, const Clock& systemClock)
+    {
+        TranslationCache::Block& block = cache->blocks[slot];
+        if(!jit) {
+            return 0;
+        }
+        // Compile once hot, and again if the code buffer wrapped since
+        if(block.executions < jitThreshold) {
+            block.executions++;
+        }
+        if((block.executions >= jitThreshold) && (block.nativeGeneration != jit->generation)) {
+            compileBlock(memory, slot);
+        }
+        if(!block.native || (block.nativeGeneration != jit->generation) || (clock + block.nativeLeadCycles * cpuClockLengthInSystemClocks > systemClock.clocks)) {
+            return 0;
+        }
+        JitState state{A, flags, PC, 0, 0, JitState::NoWrite};
+        reinterpret_cast<JitFunction>(block.native)(&state);
+        A = state.A;
+        flags = state.flags;
+        PC = state.PC;
+        instructions += state.executed;
+        effects += block.nativeStores;
+        mostRecentSystemClock = Clock(systemClock, clock) + state.cycles * cpuClockLengthInSystemClocks;
+        clock = mostRecentSystemClock.clocks;
+        if(state.writtenKey != JitState::NoWrite) {
+            cache->written(state.writtenKey);
+        }
+        return state.executed;
+    }
+#endif
+
+    // Execute the whole instruction at PC, with the same effects as its
+    // microcode, and keep the CPU busy for as many clocks as that takes.
+    StepResult step(MEMORY& memory, INTERFACE& interface, const Clock& systemClock)
+    {
+        uint8_t instruction = fetch(memory) & 0x3F;
+        uint16_t operand = fetchOperand(memory, instruction);
+        if(profile) {
+            profile->count(instruction);
+        }
+        int cycles = execute(memory, interface, instruction, operand);
+        instructions++;
+        mostRecentSystemClock = systemClock + cycles * cpuClockLengthInSystemClocks;
+        return CONTINUE;
+    }
+
+    // Carry out an instruction whose opcode and operand were already fetched,
+    // with PC past them, and return the clocks it takes.
+    EMU_ALWAYS_INLINE int execute(MEMORY& memory, INTERFACE& interface, uint8_t instruction, uint16_t operand)
+    {
+        int cycles = instructionCycles[(flags << 6) | instruction];
+        uint16_t address;
+        uint8_t data;
+        uint8_t sp;
+
+        switch(instruction) {
+            case OpNOP: break;
+            case OpBNK: memory.setBank(A & 0xF); effects++; break;
+            case OpOUT: interface.writeUART(A); effects++; break;
+            case OpCLC: alu(A, ~A, 0); break;
+            case OpSEC: alu(A, ~A, 1); break;
+            case OpLSL: A = alu(A, A, 0); break;
+            case OpROL: A = alu(A, A, carry()); break;
+            case OpLSR: rotateRight(0); break;
+            case OpROR: rotateRight(carry()); break;
+            case OpASR: rotateRight(A >> 7); break;
+            case OpINP:
+                data = 0xFF;
+                if(interface.readUART(data)) {
+                    effects++;
+                } else {
+                    polledEmpty = true;
+                }
+                A = data;
+                alu(A, 0, 1);
+                break;
+            case OpNEG: A = alu(0, ~A, 1); break;
+            case OpINC: A = alu(A, 0, 1); break;
+            case OpDEC: A = alu(A, 0xFF, 0); break;
+
+            case OpLDI: A = operand; break;
+            case OpADI: A = alu(A, operand, 0); break;
+            case OpSBI: A = alu(A, ~operand, 1); break;
+            case OpCPI: alu(A, ~operand, 1); break;
+            case OpACI: A = alu(A, operand, carry()); break;
+            case OpSCI: A = alu(A, ~operand, carry()); break;
+
+            case OpJPA: PC = operand; break;
+            case OpLDA: A = read(memory, operand); break;
+            case OpSTA: write(memory, operand, A); break;
+            case OpADA: A = alu(A, read(memory, operand), 0); break;
+            case OpSBA: A = alu(A, ~read(memory, operand), 1); break;
+            case OpCPA: alu(A, ~read(memory, operand), 1); break;
+            case OpACA: A = alu(A, read(memory, operand), carry()); break;
+            case OpSCA: A = alu(A, ~read(memory, operand), carry()); break;
+
+            case OpJPR: PC = readWord(memory, operand); break;
+            case OpLDR: A = read(memory, readWord(memory, operand)); break;
+            case OpSTR: write(memory, readWord(memory, operand), A); break;
+            case OpADR: A = alu(A, read(memory, readWord(memory, operand)), 0); break;
+            case OpSBR: A = alu(A, ~read(memory, readWord(memory, operand)), 1); break;
+            case OpCPR: alu(A, ~read(memory, readWord(memory, operand)), 1); break;
+            case OpACR: A = alu(A, read(memory, readWord(memory, operand)), carry()); break;
+            case OpSCR: A = alu(A, ~read(memory, readWord(memory, operand)), carry()); break;
+
+            case OpCLB:
+                write(memory, operand, 0);
+                A = 0;
+                flags = FlagC | FlagZ;
+                break;
+            case OpNEB:
+                address = operand;
+                A = alu(0, ~read(memory, address), 1);
+                write(memory, address, A);
+                break;
+            case OpINB:
+                address = operand;
+                A = alu(read(memory, address), 0, 1);
+                write(memory, address, A);
+                break;
+            case OpDEB:
+                address = operand;
+                A = alu(read(memory, address), 0xFF, 0);
+                write(memory, address, A);
+                break;
+            case OpADB:
+                address = operand;
+                write(memory, address, alu(A, read(memory, address), 0));
+                break;
+            case OpSBB:
+                address = operand;
+                write(memory, address, alu(read(memory, address), ~A, 1));
+                break;
+            case OpACB:
+                address = operand;
+                A = alu(A, read(memory, address), carry());
+                write(memory, address, A);
+                break;
+            case OpSCB:
+                address = operand;
+                write(memory, address, alu(read(memory, address), ~A, carry()));
+                break;
+
+            case OpCLW:
+                address = operand;
+                write(memory, address, 0);
+                write(memory, address + 1, 0);
+                flags = FlagC | FlagZ;
+                break;
+            case OpNEW:
+                address = operand;
+                write(memory, address, alu(0, ~read(memory, address), 1));
+                A = alu(0, ~read(memory, address + 1), carry());
+                write(memory, address + 1, A);
+                break;
+            case OpINW:
+                address = operand;
+                write(memory, address, alu(read(memory, address), 0, 1));
+                A = alu(read(memory, address + 1), 0, carry());
+                write(memory, address + 1, A);
+                break;
+            case OpDEW:
+                address = operand;
+                write(memory, address, alu(read(memory, address), 0xFF, 0));
+                A = alu(read(memory, address + 1), 0xFF, carry());
+                write(memory, address + 1, A);
+                break;
+            case OpADW:
+                address = operand;
+                write(memory, address, alu(A, read(memory, address), 0));
+                A = alu(read(memory, address + 1), 0, carry());
+                write(memory, address + 1, A);
+                break;
+            case OpSBW:
+                address = operand;
+                write(memory, address, alu(read(memory, address), ~A, 1));
+                A = alu(read(memory, address + 1), 0xFF, carry());
+                write(memory, address + 1, A);
+                break;
+            case OpACW:
+                address = operand;
+                write(memory, address, alu(A, read(memory, address), carry()));
+                A = alu(read(memory, address + 1), 0, carry());
+                write(memory, address + 1, A);
+                break;
+            case OpSCW:
+                address = operand;
+                write(memory, address, alu(read(memory, address), ~A, carry()));
+                A = alu(read(memory, address + 1), 0xFF, carry());
+                write(memory, address + 1, A);
+                break;
+
+            // The stack pointer lives at 0xFFFF and indexes page 0xFF00
+            case OpLDS:
+                data = operand;
+                sp = read(memory, 0xFFFF);
+                A = read(memory, 0xFF00 | alu(sp, data, 0));
+                break;
+            case OpSTS:
+                // the microcode parks A at the stack pointer while it adds the offset
+                data = operand;
+                sp = read(memory, 0xFFFF);
+                write(memory, 0xFF00 | sp, A);
+                sp = read(memory, 0xFFFF);
+                address = 0xFF00 | alu(sp, data, 0);
+                A = read(memory, 0xFF00 | sp);
+                write(memory, address, A);
+                break;
+            case OpPHS:
+                sp = read(memory, 0xFFFF);
+                write(memory, 0xFF00 | sp, A);
+                write(memory, 0xFFFF, alu(sp, 0xFF, 0));
+                A = read(memory, 0xFF00 | sp);
+                break;
+            case OpPLS:
+                sp = alu(read(memory, 0xFFFF), 0, 1);
+                write(memory, 0xFFFF, sp);
+                A = read(memory, 0xFF00 | sp);
+                break;
+            case OpJPS:
+                // pushes the address of the operand; RTS skips over it
+                sp = read(memory, 0xFFFF);
+                write(memory, 0xFF00 | sp, PC & 0xFF);
+                A = alu(sp, 0xFF, 0);
+                write(memory, 0xFF00 | A, PC >> 8);
+                write(memory, 0xFFFF, alu(A, 0xFF, 0));
+                PC = readWord(memory, PC);
+                break;
+            case OpRTS:
+                A = alu(read(memory, 0xFFFF), 0, 1);
+                data = read(memory, 0xFF00 | A);
+                A = alu(A, 0, 1);
+                PC = u16from2xu8(data, read(memory, 0xFF00 | A)) + 2;
+                write(memory, 0xFFFF, A);
+                break;
+
+            case OpBNE: if(!(flags & FlagZ)) { PC = operand; } break;
+            case OpBEQ: if(flags & FlagZ) { PC = operand; } break;
+            case OpBCC: if(!(flags & FlagC)) { PC = operand; } break;
+            case OpBCS: if(flags & FlagC) { PC = operand; } break;
+            case OpBPL: if(!(flags & FlagN)) { PC = operand; } break;
+            case OpBMI: if(flags & FlagN) { PC = operand; } break;
+        }
+
+        return cycles;
+    }
+
+    // Run the idiom starting at code, which the translation cache fused,
+    // with the effects of its instructions one after another, and return
+    // the clocks they take together
+    int executeFused(MEMORY& memory, INTERFACE& interface, const TranslationCache::Instruction *code)
+    {
+        const TranslationCache::Instruction& last = code[code[0].fusedCount - 1];
+        uint8_t data;
+        PC = last.next;
+        switch(code[0].fusion) {
+            case TranslationCache::FuseCPIBranch:
+                alu(A, ~code[0].operand, 1);
+                break;
+            case TranslationCache::FuseLDIOUT:
+                A = code[0].operand;
+                interface.writeUART(A);
+                effects++;
+                break;
+            case TranslationCache::FuseINPCPIBranch:
+                data = 0xFF;
+                if(interface.readUART(data)) {
+                    effects++;
+                } else {
+                    polledEmpty = true;
+                }
+                A = data;
+                alu(A, ~code[1].operand, 1);
+                break;
+            case TranslationCache::FuseLDAADISTA:
+                A = alu(read(memory, code[0].operand), code[1].operand, 0);
+                write(memory, last.operand, A);
+                break;
+            default:
+                assert(false && "not a fused idiom");
+        }
+        // the branch, if any, takes clocks depending on the flags it sees
+        int cycles = code[0].fusedLeadCycles + instructionCycles[(flags << 6) | last.instruction];
+        if((last.instruction == OpBEQ) || (last.instruction == OpBNE)) {
+            if(((flags & FlagZ) != 0) == (last.instruction == OpBEQ)) {
+                PC = last.operand;
+            }
+        }
+        return cycles;
+    }
+
+    // Decode the basic block at PC into a new cache slot
+    int32_t translate(MEMORY& memory, uint32_t key)
+    {
+        int32_t slot = cache->allocate(key);
+        auto& code = cache->blocks[slot].code;
+        uint16_t pc = PC;
+        uint32_t last;
+        while(true) {
+            TranslationCache::Instruction decoded;
+            uint16_t start = pc;
+            decoded.instruction = read(memory, pc++) & 0x3F;
+            int bytes = GetOperandBytes(decoded.instruction);
+            decoded.operand = (bytes == 2) ? readWord(memory, pc) : (bytes == 1) ? read(memory, pc) : 0;
+            pc += bytes;
+            decoded.next = pc;
+            code.push_back(decoded);
+            last = TranslationCache::Key(memory.bank, pc - 1);
+            // Stop where code ends or would run on into another region
+            if(EndsBasicBlock(decoded.instruction) || (code.size() == TranslationCache::MaxBlockInstructions) || ((start ^ pc) & 0x8000) || (pc < start)) {
+                break;
+            }
+        }
+        if(cache->fusing) {
+            cache->fuse(slot);
+        }
+        if((last >> 15) != (key >> 15)) {
+            // an operand ran over into the next region
+            cache->covers(slot, key, key | 0x7FFF);
+            cache->covers(slot, last & ~0x7FFF, last);
+        } else {
+            cache->covers(slot, key, last);
+        }
+        return slot;
+    }
+
+    // Run basic blocks from the translation cache until the CPU is busy
+    // past systemClock, chaining from each block to the one that follows.
+    StepResult runTranslated(MEMORY& memory, INTERFACE& interface, const Clock& systemClock)
+    {
+        uint64_t clock = calculateNextActivity();
+        int32_t previous = -1;
+        uint32_t previousEpoch = 0;
+        while(clock <= systemClock.clocks) {
+            uint32_t key = TranslationCache::Key(memory.bank, PC);
+            int32_t slot = (previous >= 0) ? cache->follow(previous, key) : -1;
+            if(slot < 0) {
+                slot = cache->find(key);
+                if(slot < 0) {
+                    slot = translate(memory, key);
+                }
+                if((previous >= 0) && (cache->blocks[previous].epoch == previousEpoch)) {
+                    cache->link(previous, slot);
+                }
+            }
+            const TranslationCache::Block& block = cache->blocks[slot];
+            uint32_t epoch = block.epoch;
+            size_t start = 0;
+#if EMU_JIT
+            start = runNative(memory, slot, clock, systemClock);
+#endif
+            // Interpret whatever native code didn't cover, stopping if out
+            // of time or the block just wrote over itself
+            for(size_t i = start; (i < block.code.size()) && (clock <= systemClock.clocks) && (block.epoch == epoch); i++) {
+                const TranslationCache::Instruction& decoded = block.code[i];
+                int cycles;
+                // An idiom runs whole if its last instruction starts in time
+                if(decoded.fusion && (clock + decoded.fusedLeadCycles * cpuClockLengthInSystemClocks <= systemClock.clocks)) {
+                    cycles = executeFused(memory, interface, &decoded);
+                    instructions += decoded.fusedCount;
+                    i += decoded.fusedCount - 1;
+                } else {
+                    PC = decoded.next;
+                    cycles = execute(memory, interface, decoded.instruction, decoded.operand);
+                    instructions++;
+                }
+                mostRecentSystemClock = Clock(systemClock, clock) + cycles * cpuClockLengthInSystemClocks;
+                if(polledEmpty) {
+                    idle(memory, systemClock);
+                }
+                clock = mostRecentSystemClock.clocks;
+            }
+            previous = slot;
+            previousEpoch = epoch;
+        }
+        return CONTINUE;
+    }
+
+    // Run compiled blocks until the CPU is busy past systemClock, stepping
+    // the interpreter wherever nothing was compiled, like code in RAM or
+    // reached only through JPR or RTS
+    StepResult runCompiled(MEMORY& memory, INTERFACE& interface, const Clock& systemClock)
+    {
+        uint64_t clock = calculateNextActivity();
+        while(clock <= systemClock.clocks) {
+            CompiledBlock block = compiled[TranslationCache::Key(memory.bank, PC)];
+            if(block) {
+                block(*this, memory, interface, clock, systemClock.clocks);
+                mostRecentSystemClock = Clock(systemClock, clock);
+            } else {
+                step(memory, interface, Clock(systemClock, clock));
+            }
+            if(polledEmpty) {
+                idle(memory, systemClock);
+            }
+            clock = mostRecentSystemClock.clocks;
+        }
+        return CONTINUE;
+    }
+
+    // Return the next system clock tick at which the CPU will have transitioned one CPU clock,
+    // that is to say return the least clock for which the CPU has to do some work.
+    clk_t calculateNextActivity()
+    {
+        clk_t next = (mostRecentSystemClock.clocks + cpuClockLengthInSystemClocks - 1) / cpuClockLengthInSystemClocks * cpuClockLengthInSystemClocks;
+        // XXX debug printf("CPU next is %llu\n", next);
+        return next;
+    }
+
+    // Do work associated with CPU clock transitioning to active,
+    // after mostRecentSystemClock and up to and including systemClock.
+    // Do not repeat work if called twice with same clock.
+    // mostRecentSystemClock is left at the end of the last instruction
+    // started, which may be past systemClock.
+    StepResult updatePastClock(MEMORY& memory, INTERFACE& interface, const Clock& systemClock)
+    {
+        // memory or input may have been changed from outside since the
+        // last batch, so a loop has to come round again to count as idle
+        lastPoll.valid = false;
+        if(!compiled.empty()) {
+            return runCompiled(memory, interface, systemClock);
+        }
+        if(cache) {
+            return runTranslated(memory, interface, systemClock);
+        }
+        for(uint64_t clock = calculateNextActivity(); clock <= systemClock.clocks; clock = mostRecentSystemClock.clocks) {
+            StepResult result = step(memory, interface, Clock(systemClock, clock));
+            if(result != CONTINUE) {
+                return result;
+            }
+            if(polledEmpty) {
+                idle(memory, systemClock);
+            }
+        }
+        // XXX debug printf("systemClock is %llu, most recent is now %llu\n", systemClock.clocks, mostRecentSystemClock.clocks);
+        return CONTINUE;
+    }
+};
+
+// Runs the microcode itself, one control word per CPU clock, so it is exact
+// down to the odd LSR/ASR/STS sequences.  Use it as the reference for the
+// faster engines.
+template <class MEMORY, class INTERFACE>
+struct MicrocodeEmulator
+{
+    uint64_t cpuClockLengthInSystemClocks;
+    Clock mostRecentSystemClock;
+
+    // The datapath as a flat register file; no Bus, Wire or Block.
+    uint8_t A = 0;
+    uint8_t B = 0;
+    uint16_t PC = 0;
+    uint16_t MAR = 0;
+    uint8_t BANK = 0;
+    uint8_t flags = 0;
+    uint8_t IR = 0;
+    uint8_t stepCounter = 0;
+
+    uint64_t microsteps = 0;
+    uint64_t instructions = 0;
+
+    enum StepResult {
+        CONTINUE,
+        EXIT,
+    };
+
+    MicrocodeEmulator(uint64_t CPUClockRate, const Clock& systemClock) :
+        mostRecentSystemClock(systemClock)
+    {
+        assert(systemClock.rate % CPUClockRate == 0);
+        cpuClockLengthInSystemClocks = systemClock.rate / CPUClockRate;
+    }
+
+    // Apply the control word for the current step to the register file and
+    // return the number of CPU clocks it took.  Everything is evaluated from
+    // the values before the clock edge and then latched together, like the
+    // hardware does.
+    int microstep(MEMORY& memory, INTERFACE& interface)
+    {
+        uint32_t word = ControlSignalTable[(flags << 10) | (IR << 4) | stepCounter];
+
+        if(word & IC) {
+            // asynchronous clear of the step counter, costs no clock
+            stepCounter = 0;
+            instructions++;
+            return 0;
+        }
+
+        uint8_t bus = 0xFF; // nothing driving, the bus is pulled high
+
+        if(word & AO) { bus = A; }
+        if(word & BO) { bus = B; }
+        if(word & COH) { bus = PC >> 8; }
+        if(word & COL) { bus = PC & 0xFF; }
+        if(word & RO) { memory.read(MAR, bus); }
+        if(word & TO) { interface.readUART(bus); }
+
+        uint32_t result = A + ((word & ES) ? (~B & 0xFF) : B) + ((word & EC) ? 1 : 0);
+        if(word & EOFI) {
+            bus = result;
+            flags = ((result & 0x80) ? FlagN : 0) | ((result > 0xFF) ? FlagC : 0) | (((result & 0xFF) == 0) ? FlagZ : 0);
+        }
+
+        if(word & RI) { memory.write(MAR, bus); }
+        if(word & TI) { interface.writeUART(bus); }
+        if(word & KI) {
+            BANK = bus & 0xF;
+            memory.setBank(BANK);
+        }
+        if(word & II) { IR = bus & 0x3F; }
+        if(word & AI) { A = bus; }
+        if(word & BI) { B = bus; }
+
+        // PC and MAR are counters; a load wins over CEME's increment
+        if(word & CIH) {
+            PC = (bus << 8) | (PC & 0xFF);
+        } else if(word & CIL) {
+            PC = (PC & 0xFF00) | bus;
+        } else if(word & CEME) {
+            PC++;
+        }
+        if(word & MIH) {
+            MAR = (bus << 8) | (MAR & 0xFF);
+        } else if(word & MIL) {
+            MAR = (MAR & 0xFF00) | bus;
+        } else if(word & CEME) {
+            MAR++;
+        }
+
+        stepCounter = (stepCounter + 1) & 0xF;
+        if(stepCounter == 0) {
+            instructions++;
+        }
+        microsteps++;
+        return 1;
+    }
+
+    // Run microsteps through the end of the current instruction and return
+    // the number of CPU clocks they took.
+    int instruction(MEMORY& memory, INTERFACE& interface)
+    {
+        int clocks = 0;
+        do {
+            clocks += microstep(memory, interface);
+        } while(stepCounter != 0);
+        return clocks;
+    }
+
+    // Run one CPU clock, folding in any IC that ends an instruction.
+    StepResult step(MEMORY& memory, INTERFACE& interface, const Clock& systemClock)
+    {
+        while(microstep(memory, interface) == 0) {
+        }
+        mostRecentSystemClock = systemClock + cpuClockLengthInSystemClocks;
+        return CONTINUE;
+    }
+
+    // Return the next system clock tick at which the CPU will have transitioned one CPU clock,
+    // that is to say return the least clock for which the CPU has to do some work.
+    clk_t calculateNextActivity()
+    {
+        clk_t next = (mostRecentSystemClock.clocks + cpuClockLengthInSystemClocks - 1) / cpuClockLengthInSystemClocks * cpuClockLengthInSystemClocks;
+        return next;
+    }
+
+    // Do work associated with CPU clock transitioning to active,
+    // after mostRecentSystemClock and up to and including systemClock.
+    // Do not repeat work if called twice with same clock.
+    StepResult updatePastClock(MEMORY& memory, INTERFACE& interface, const Clock& systemClock)
+    {
+        for(uint64_t clock = calculateNextActivity(); clock <= systemClock.clocks; clock = mostRecentSystemClock.clocks) {
+            StepResult result = step(memory, interface, Clock(systemClock, clock));
+            if(result != CONTINUE) {
+                return result;
+            }
+        }
+        return CONTINUE;
+    }
+};
+
+// Runs each instruction as straight-line code generated at compile time from
+// the microcode.  Steps 0 to 2 fetch the opcode and are the same for every
+// instruction; after them there is one handler per (opcode, NCZ), the control
+// words from step 3 to IC unrolled with only the signals each one asserts.
+// Where EOFI changes the flags and later words depend on them, the handler
+// continues in the one for the new flags.  Editing mEEPROM regenerates it all.
+template <class MEMORY, class INTERFACE>
+struct UnrolledMicrocodeEmulator
+{
+    uint64_t cpuClockLengthInSystemClocks;
+    Clock mostRecentSystemClock;
+
+    // The same register file as MicrocodeEmulator, always between instructions
+    uint8_t A = 0;
+    uint8_t B = 0;
+    uint16_t PC = 0;
+    uint16_t MAR = 0;
+    uint8_t BANK = 0;
+    uint8_t flags = 0;
+    uint8_t IR = 0;
+
+    uint64_t instructions = 0;
+
+    enum StepResult {
+        CONTINUE,
+        EXIT,
+    };
+
+    // Runs from some step to the end of an instruction, returning CPU clocks
+    typedef int (UnrolledMicrocodeEmulator::*Handler)(MEMORY& memory, INTERFACE& interface);
+
+    static constexpr int FetchSteps = 3;
+
+    static constexpr uint32_t Signals(uint8_t instruction, uint8_t flags, int step)
+    {
+        return ControlSignalTable[(flags << 10) | (instruction << 4) | step];
+    }
+
+    static constexpr bool FetchIsCommon()
+    {
+        for(int instruction = 0; instruction < 64; instruction++) {
+            for(int f = 0; f < 8; f++) {
+                for(int step = 0; step < FetchSteps; step++) {
+                    if(Signals(instruction, f, step) != Signals(0, 0, step)) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return !(Signals(0, 0, FetchSteps - 1) & (IC | EOFI)) && (Signals(0, 0, FetchSteps - 1) & II);
+    }
+    static_assert(FetchIsCommon(), "every instruction starts with the same opcode fetch");
+
+    // Whether the control words from step on differ between flag values
+    static constexpr bool FlagsMatterFrom(uint8_t instruction, int step)
+    {
+        for(; step < 16; step++) {
+            for(int f = 1; f < 8; f++) {
+                if(Signals(instruction, f, step) != Signals(instruction, 0, step)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    UnrolledMicrocodeEmulator(uint64_t CPUClockRate, const Clock& systemClock) :
+        mostRecentSystemClock(systemClock)
+    {
+        assert(systemClock.rate % CPUClockRate == 0);
+        cpuClockLengthInSystemClocks = systemClock.rate / CPUClockRate;
+    }
+
+    // One control word, as MicrocodeEmulator::microstep does it, with
+    // everything the word doesn't assert compiled out
+    template <uint32_t WORD>
+    void apply(MEMORY& memory, INTERFACE& interface)
+    {
+        uint8_t bus = 0xFF; // nothing driving, the bus is pulled high
+
+        if constexpr(WORD & AO) { bus = A; }
+        if constexpr(WORD & BO) { bus = B; }
+        if constexpr(WORD & COH) { bus = PC >> 8; }
+        if constexpr(WORD & COL) { bus = PC & 0xFF; }
+        if constexpr(WORD & RO) { memory.read(MAR, bus); }
+        if constexpr(WORD & TO) { interface.readUART(bus); }
+
+        if constexpr(WORD & EOFI) {
+            uint32_t result = A + ((WORD & ES) ? (~B & 0xFF) : B) + ((WORD & EC) ? 1 : 0);
+            bus = result;
+            flags = ((result & 0x80) ? FlagN : 0) | ((result > 0xFF) ? FlagC : 0) | (((result & 0xFF) == 0) ? FlagZ : 0);
+        }
+
+        if constexpr(WORD & RI) { memory.write(MAR, bus); }
+        if constexpr(WORD & TI) { interface.writeUART(bus); }
+        if constexpr(WORD & KI) {
+            BANK = bus & 0xF;
+            memory.setBank(BANK);
+        }
+        if constexpr(WORD & II) { IR = bus & 0x3F; }
+        if constexpr(WORD & AI) { A = bus; }
+        if constexpr(WORD & BI) { B = bus; }
+
+        if constexpr(WORD & CIH) {
+            PC = (bus << 8) | (PC & 0xFF);
+        } else if constexpr(WORD & CIL) {
+            PC = (PC & 0xFF00) | bus;
+        } else if constexpr(WORD & CEME) {
+            PC++;
+        }
+        if constexpr(WORD & MIH) {
+            MAR = (bus << 8) | (MAR & 0xFF);
+        } else if constexpr(WORD & MIL) {
+            MAR = (MAR & 0xFF00) | bus;
+        } else if constexpr(WORD & CEME) {
+            MAR++;
+        }
+    }
+
+    template <uint8_t INSTRUCTION, uint8_t FLAGS, int STEP>
+    int run(MEMORY& memory, INTERFACE& interface)
+    {
+        constexpr uint32_t word = Signals(INSTRUCTION, FLAGS, STEP);
+        if constexpr(word & IC) {
+            // asynchronous clear of the step counter, costs no clock
+            return 0;
+        } else {
+            apply<word>(memory, interface);
+            if constexpr(STEP == 15) {
+                return 1;
+            } else if constexpr((word & EOFI) && FlagsMatterFrom(INSTRUCTION, STEP + 1)) {
+                static constexpr auto continuations = MakeFlagHandlers<INSTRUCTION, STEP + 1>(std::make_index_sequence<8>());
+                return 1 + (this->*continuations[flags])(memory, interface);
+            } else {
+                return 1 + run<INSTRUCTION, FLAGS, STEP + 1>(memory, interface);
+            }
+        }
+    }
+
+    // Handlers starting at STEP, for each (flags << 6) | instruction
+    template <int STEP, size_t... INDEX>
+    static constexpr std::array<Handler, sizeof...(INDEX)> MakeHandlers(std::index_sequence<INDEX...>)
+    {
+        return {&UnrolledMicrocodeEmulator::run<(INDEX & 0x3F), (INDEX >> 6), STEP>...};
+    }
+
+    // Handlers starting at STEP of one instruction, for each flags
+    template <uint8_t INSTRUCTION, int STEP, size_t... FLAGS>
+    static constexpr std::array<Handler, sizeof...(FLAGS)> MakeFlagHandlers(std::index_sequence<FLAGS...>)
+    {
+        return {&UnrolledMicrocodeEmulator::run<INSTRUCTION, FLAGS, STEP>...};
+    }
+
+    // Run a whole instruction and return the number of CPU clocks it took.
+    int instruction(MEMORY& memory, INTERFACE& interface)
+    {
+        static constexpr auto handlers = MakeHandlers<FetchSteps>(std::make_index_sequence<8 * 64>());
+        apply<Signals(0, 0, 0)>(memory, interface);
+        apply<Signals(0, 0, 1)>(memory, interface);
+        apply<Signals(0, 0, 2)>(memory, interface);
+        int clocks = FetchSteps + (this->*handlers[(flags << 6) | IR])(memory, interface);
+        instructions++;
+        return clocks;
+    }
+
+    StepResult step(MEMORY& memory, INTERFACE& interface, const Clock& systemClock)
+    {
+        int cycles = instruction(memory, interface);
+        mostRecentSystemClock = systemClock + cycles * cpuClockLengthInSystemClocks;
+        return CONTINUE;
+    }
+
+    // Return the next system clock tick at which the CPU will have transitioned one CPU clock,
+    // that is to say return the least clock for which the CPU has to do some work.
+    clk_t calculateNextActivity()
+    {
+        clk_t next = (mostRecentSystemClock.clocks + cpuClockLengthInSystemClocks - 1) / cpuClockLengthInSystemClocks * cpuClockLengthInSystemClocks;
+        return next;
+    }
+
+    // Do work associated with CPU clock transitioning to active,
+    // after mostRecentSystemClock and up to and including systemClock.
+    // Do not repeat work if called twice with same clock.
+    StepResult updatePastClock(MEMORY& memory, INTERFACE& interface, const Clock& systemClock)
+    {
+        for(uint64_t clock = calculateNextActivity(); clock <= systemClock.clocks; clock = mostRecentSystemClock.clocks) {
+            StepResult result = step(memory, interface, Clock(systemClock, clock));
+            if(result != CONTINUE) {
+                return result;
+            }
+        }
+        return CONTINUE;
+    }
+};
+
+// 64-bit FNV-1a, to tell flash images apart
+inline uint64_t HashBytes(const uint8_t *data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// A flash image, read-only once loaded so every engine and machine in the
+// process can share it, holding it by std::shared_ptr.  Files are mapped
+// rather than read where mmap is available.
+struct FlashImage
+{
+    const uint8_t *data = nullptr;
+#if EMU_MMAP
+    void *mapping = nullptr;
+#endif
+    std::vector<uint8_t> bytes;
+
+    // bytes, padded with zeroes to FlashSize, for tests
+    FlashImage(std::vector<uint8_t> bytes_ = {}) :
+        bytes(std::move(bytes_))
+    {
+        assert(bytes.size() <= FlashSize);
+        bytes.resize(FlashSize, 0);
+        data = bytes.data();
+    }
+
+    FlashImage(const std::string& flash_file)
+    {
+#if EMU_MMAP
+        int fd = open(flash_file.c_str(), O_RDONLY);
+        if(fd < 0) {
+            throw "couldn't open " + flash_file;
+        }
+        struct stat info;
+        if((fstat(fd, &info) != 0) || (info.st_size != FlashSize)) {
+            close(fd);
+            throw flash_file + " isn't a " + std::to_string(FlashSize) + "-byte flash image";
+        }
+        mapping = mmap(nullptr, FlashSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(mapping == MAP_FAILED) {
+            mapping = nullptr;
+            throw "couldn't map " + flash_file;
+        }
+        data = static_cast<const uint8_t *>(mapping);
+#else
+        FILE *fp = fopen(flash_file.c_str(), "rb");
+        if(!fp) {
+            throw "couldn't open " + flash_file;
+        }
+        bytes.resize(FlashSize + 1);
+        size_t size = fread(bytes.data(), 1, bytes.size(), fp);
+        fclose(fp);
+        if(size != FlashSize) {
+            throw flash_file + " isn't a " + std::to_string(FlashSize) + "-byte flash image";
+        }
+        bytes.resize(FlashSize);
+        data = bytes.data();
+#endif
+    }
+
+    FlashImage(const FlashImage&) = delete;
+    FlashImage& operator=(const FlashImage&) = delete;
+
+    ~FlashImage()
+    {
+#if EMU_MMAP
+        if(mapping) {
+            munmap(mapping, FlashSize);
+        }
+#endif
+    }
+
+    // All zeroes, for machines nobody loaded an image into
+    static std::shared_ptr<const FlashImage> Blank()
+    {
+        static std::shared_ptr<const FlashImage> blank = std::make_shared<FlashImage>();
+        return blank;
+    }
+};
+
+// Flash as one machine sees it: a shared image, and private copies of the
+// pages this machine has written, which are its dirty pages.  Machines
+// rarely write much flash, so the copies are kept in a small vector sorted
+// by page, and a machine that hasn't written any costs a pointer or two.
+struct Flash
+{
+    static constexpr uint32_t PageBits = 8;
+    static constexpr uint32_t PageSize = 1 << PageBits;
+    static constexpr uint32_t Pages = FlashSize >> PageBits;
+    typedef std::array<uint8_t, PageSize> Page;
+    typedef std::pair<uint32_t, std::unique_ptr<Page>> Copy;
+
+    std::shared_ptr<const FlashImage> image;
+    std::vector<Copy> copies;
+
+    Flash(std::shared_ptr<const FlashImage> image_ = FlashImage::Blank()) :
+        image(std::move(image_))
+    {}
+
+    Flash(const Flash& other)
+    {
+        *this = other;
+    }
+
+    Flash& operator=(const Flash& other)
+    {
+        image = other.image;
+        copies.clear();
+        copies.reserve(other.copies.size());
+        for(const auto& [page, copy] : other.copies) {
+            copies.push_back({page, std::make_unique<Page>(*copy)});
+        }
+        return *this;
+    }
+
+    // The copy of page, or copies.end()
+    std::vector<Copy>::const_iterator findCopy(uint32_t page) const
+    {
+        auto copy = std::lower_bound(copies.begin(), copies.end(), page, [](const Copy& c, uint32_t p) { return c.first < p; });
+        return ((copy != copies.end()) && (copy->first == page)) ? copy : copies.end();
+    }
+
+    // The bytes of the page holding offset
+    const uint8_t *page(uint32_t offset) const
+    {
+        if(!copies.empty()) {
+            auto copy = findCopy(offset >> PageBits);
+            if(copy != copies.end()) {
+                return copy->second->data();
+            }
+        }
+        return image->data + (offset & ~(PageSize - 1));
+    }
+
+    uint8_t operator[](uint32_t offset) const
+    {
+        return page(offset)[offset & (PageSize - 1)];
+    }
+
+    // The page holding offset, copied from the image first if it's clean
+    uint8_t *writablePage(uint32_t offset)
+    {
+        uint32_t page = offset >> PageBits;
+        auto copy = std::lower_bound(copies.begin(), copies.end(), page, [](const Copy& c, uint32_t p) { return c.first < p; });
+        if((copy == copies.end()) || (copy->first != page)) {
+            const uint8_t *clean = image->data + (page << PageBits);
+            copy = copies.insert(copy, {page, std::make_unique<Page>()});
+            std::copy(clean, clean + PageSize, copy->second->begin());
+        }
+        return copy->second->data();
+    }
+
+    void write(uint32_t offset, uint8_t data)
+    {
+        writablePage(offset)[offset & (PageSize - 1)] = data;
+    }
+
+    // Set bytes first to last
+    void fill(uint32_t first, uint32_t last, uint8_t data)
+    {
+        for(uint32_t offset = first; offset <= last; offset++) {
+            write(offset, data);
+        }
+    }
+
+    bool dirty(uint32_t page) const
+    {
+        return findCopy(page) != copies.end();
+    }
+
+    size_t dirtyPages() const
+    {
+        return copies.size();
+    }
+
+    // Save the image's hash and the dirty pages; restoring needs the same
+    // image loaded already
+    void snapshot(SnapshotArchive& archive)
+    {
+        uint64_t hash = HashBytes(image->data, FlashSize);
+        uint64_t savedHash = hash;
+        archive.field(savedHash);
+        if(savedHash != hash) {
+            throw std::string("snapshot was taken with a different flash image");
+        }
+        uint32_t count = copies.size();
+        archive.field(count);
+        if(archive.restoring) {
+            if(count > Pages) {
+                throw std::string("snapshot is corrupt");
+            }
+            copies.clear();
+        }
+        for(uint32_t i = 0; i < count; i++) {
+            uint32_t page = archive.restoring ? 0 : copies[i].first;
+            archive.field(page);
+            if(archive.restoring) {
+                // kept sorted, as findCopy() needs
+                if((page >= Pages) || (!copies.empty() && (page <= copies.back().first))) {
+                    throw std::string("snapshot is corrupt");
+                }
+                copies.push_back({page, std::make_unique<Page>()});
+            }
+            archive.field(*copies[i].second);
+        }
+    }
+
+    // Write the image with this machine's changes to flash_file, by way of
+    // a temporary file so the file can be the one the image was mapped from
+    bool flush(const std::string& flash_file) const
+    {
+        std::string temporary = flash_file + ".tmp";
+        FILE *fp = fopen(temporary.c_str(), "wb");
+        if(!fp) {
+            return false;
+        }
+        bool written = true;
+        for(uint32_t page = 0; page < Pages; page++) {
+            written = written && (fwrite(this->page(page << PageBits), PageSize, 1, fp) == 1);
+        }
+        written = (fclose(fp) == 0) && written;
+        if(!written || (std::rename(temporary.c_str(), flash_file.c_str()) != 0)) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+// A program to put straight into memory, as a programmer would, rather
+// than typed in through the monitor a byte at a time
+struct ProgramFile
+{
+    struct Segment
+    {
+        uint16_t address;
+        std::vector<uint8_t> bytes;
+    };
+    std::vector<Segment> segments;
+    // an Intel HEX start address record, if the file had one, moved by
+    // the load address like the data
+    bool hasStart = false;
+    uint16_t start = 0;
+
+    // A binary file goes at address.  Intel HEX, known by starting with
+    // ':', goes at the addresses in its records plus address.
+    static ProgramFile Load(const std::string& file, uint16_t address)
+    {
+        FILE *fp = fopen(file.c_str(), "rb");
+        if(!fp) {
+            throw "couldn't open " + file;
+        }
+        std::vector<uint8_t> contents;
+        uint8_t buffer[4096];
+        size_t count;
+        while((count = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+            contents.insert(contents.end(), buffer, buffer + count);
+        }
+        fclose(fp);
+        return Parse(contents, address, file);
+    }
+
+    // The contents of file
+    static ProgramFile Parse(const std::vector<uint8_t>& contents, uint16_t address, const std::string& file)
+    {
+        ProgramFile program;
+        if(!contents.empty() && (contents[0] == ':')) {
+            program.parseHex(std::string(contents.begin(), contents.end()), address, file);
+        } else {
+            program.add(address, contents.data(), contents.size(), file);
+        }
+        return program;
+    }
+
+    void add(uint32_t address, const uint8_t *bytes, size_t size, const std::string& file)
+    {
+        if(address + size > 0x10000) {
+            throw file + " runs past 0xFFFF";
+        }
+        if(size > 0) {
+            segments.push_back({uint16_t(address), std::vector<uint8_t>(bytes, bytes + size)});
+        }
+    }
+
+    // Data, end of file and start address records; the extended address
+    // records have to stay in the first 64K
+    void parseHex(const std::string& text, uint16_t address, const std::string& file)
+    {
+        int number = 0;
+        size_t position = 0;
+        while(position < text.size()) {
+            size_t end = text.find('\n', position);
+            std::string line = text.substr(position, (end == std::string::npos) ? std::string::npos : end - position);
+            position = (end == std::string::npos) ? text.size() : end + 1;
+            number++;
+            while(!line.empty() && isspace((unsigned char)line.back())) {
+                line.pop_back();
+            }
+            if(line.empty()) {
+                continue;
+            }
+            std::string where = file + ":" + std::to_string(number);
+            std::vector<uint8_t> record;
+            if((line[0] != ':') || (line.size() % 2 != 1) || (line.size() < 11)) {
+                throw where + ": not an Intel HEX record";
+            }
+            uint8_t sum = 0;
+            for(size_t i = 1; i < line.size(); i += 2) {
+                if(!isxdigit((unsigned char)line[i]) || !isxdigit((unsigned char)line[i + 1])) {
+                    throw where + ": not an Intel HEX record";
+                }
+                uint8_t byte = strtoul(line.substr(i, 2).c_str(), nullptr, 16);
+                record.push_back(byte);
+                sum += byte;
+            }
+            if((record.size() != record[0] + 5u) || (sum != 0)) {
+                throw where + ": bad length or checksum";
+            }
+            uint16_t offset = (record[1] << 8) | record[2];
+            const uint8_t *data = record.data() + 4;
+            switch(record[3]) {
+                case 0x00:
+                    add(address + offset, data, record[0], where);
+                    break;
+                case 0x01:
+                    return;
+                case 0x02: case 0x04:
+                    if((record[0] != 2) || (data[0] != 0) || (data[1] != 0)) {
+                        throw where + ": addresses past 64K";
+                    }
+                    break;
+                case 0x03: case 0x05:
+                    if(record[0] != 4) {
+                        throw where + ": bad start address";
+                    }
+                    hasStart = true;
+                    start = address + ((data[2] << 8) | data[3]);
+                    break;
+                default:
+                    throw where + ": unknown record type";
+            }
+        }
+    }
+
+    // Call put(offset, data) with each byte's offset into flash, in bank,
+    // then RAM, as TranslationCache keys are
+    template <class PUT>
+    void forEach(uint32_t bank, PUT put) const
+    {
+        for(const auto& segment : segments) {
+            for(size_t i = 0; i < segment.bytes.size(); i++) {
+                uint16_t address = segment.address + i;
+                put((address & 0x8000) ? FlashSize + (address & 0x7FFF) : (bank << 15) | address, segment.bytes[i]);
+            }
+        }
+    }
+};
+
+struct Memory;
+
+// Something mapped over whole pages of the CPU's address space in place of
+// memory.  read() and write() return whether the access did anything; a
+// write that changes memory says where in Memory::writtenFirst and
+// writtenLast.
+struct MemoryHandler
+{
+    virtual ~MemoryHandler() = default;
+    virtual bool read(Memory& memory, uint16_t address, uint8_t& data) = 0;
+    virtual bool write(Memory& memory, uint16_t address, uint8_t data) = 0;
+};
+
+// The software commands of the SST39SF040 flash.  A byte is only
+// programmed, clearing bits, or a 4K sector or the chip erased to 0xFF
+// after the unlock writes to 0x5555 and 0x2AAA, and the chip's ID reads
+// back in place of its contents between the ID entry and exit commands.
+// Any other write is ignored, as the chip does.
+struct FlashCommands : public MemoryHandler
+{
+    static constexpr uint16_t Unlock1 = 0x5555;
+    static constexpr uint16_t Unlock2 = 0x2AAA;
+    static constexpr uint32_t SectorSize = 4096;
+    static constexpr uint8_t ManufacturerID = 0xBF;
+    static constexpr uint8_t DeviceID = 0xB7;
+
+    // writes of the current command so far
+    int cycle = 0;
+    bool id = false;
+
+    virtual bool read(Memory& memory, uint16_t address, uint8_t& data);
+    virtual bool write(Memory& memory, uint16_t address, uint8_t data);
+    bool setID(Memory& memory, bool id_);
+};
+
+// The CPU's 64K address space as 256-byte pages, each reading and writing
+// host memory directly or going to a handler.  BNK only has to remap the
+// lower 32K to another flash bank.  Writes to flash go to the chip's
+// command decoder, so only programming sequences change it.
+//
+// Offsets into flash then RAM, as writtenFirst and writtenLast report
+// them, match TranslationCache keys.
+struct Memory
+{
+    static constexpr uint32_t PageBits = 8;
+    static constexpr uint32_t PageSize = 1 << PageBits;
+    static constexpr uint32_t Pages = 0x10000 >> PageBits;
+
+    struct Page
+    {
+        // host memory for the page, or nullptr to use handler
+        const uint8_t *read;
+        uint8_t *write;
+        MemoryHandler *handler;
+        // offset of the page in flash then RAM
+        uint32_t offset;
+    };
+
+    Flash flash;
+    std::array<uint8_t, RAMSize> RAM;
+    uint32_t bank = 0;
+    bool succeeded = false;
+    uint16_t traceName = InternWireName("Memory");
+    FlashCommands flashCommands;
+    std::array<Page, Pages> pages;
+    // handlers mapped over pages by mapHandler(), which win over memory
+    std::array<MemoryHandler *, Pages> handlers {};
+    // what the last write that returned true changed
+    uint32_t writtenFirst = 0;
+    uint32_t writtenLast = 0;
+
+    // image, shared, and blank RAM
+    Memory(std::shared_ptr<const FlashImage> image = FlashImage::Blank()) :
+        flash(std::move(image))
+    {
+        RAM.fill(0);
+        mapPages();
+        succeeded = true;
+    }
+
+    // Pages point into their own Memory, so copies map theirs afresh
+    Memory(const Memory& other)
+    {
+        *this = other;
+    }
+
+    Memory& operator=(const Memory& other)
+    {
+        flash = other.flash;
+        RAM = other.RAM;
+        bank = other.bank;
+        succeeded = other.succeeded;
+        flashCommands = other.flashCommands;
+        handlers = other.handlers;
+        mapPages();
+        return *this;
+    }
+
+    void mapPage(uint32_t page)
+    {
+        Page& p = pages[page];
+        if(page < (Pages / 2)) {
+            p.offset = (bank << 15) | (page << PageBits);
+            // flash pages are the same size as these, so one maps one
+            static_assert(Flash::PageSize == PageSize);
+            p.read = flashCommands.id ? nullptr : flash.page(p.offset);
+            p.write = nullptr;
+            p.handler = &flashCommands;
+        } else {
+            p.offset = FlashSize + ((page - Pages / 2) << PageBits);
+            p.read = p.write = &RAM[p.offset - FlashSize];
+            p.handler = nullptr;
+        }
+        if(handlers[page]) {
+            p.read = p.write = nullptr;
+            p.handler = handlers[page];
+        }
+    }
+
+    void mapPages()
+    {
+        for(uint32_t page = 0; page < Pages; page++) {
+            mapPage(page);
+        }
+    }
+
+    // Remap the pages showing flash offsets first to last, which programming
+    // or erasing may have copied; other banks' aren't mapped
+    void mapFlashPages(uint32_t first, uint32_t last)
+    {
+        first = std::max(first, bank << 15);
+        last = std::min(last, (bank << 15) | 0x7FFF);
+        for(uint32_t offset = first & ~(PageSize - 1); offset <= last; offset += PageSize) {
+            mapPage((offset & 0x7FFF) >> PageBits);
+        }
+    }
+
+    // Handlers are the host's wiring rather than machine state, so they
+    // stay as they are
+    void snapshot(SnapshotArchive& archive)
+    {
+        archive.field(bank);
+        if(bank >= 16) {
+            throw std::string("snapshot is corrupt");
+        }
+        archive.sparse(RAM.data(), RAM.size());
+        flash.snapshot(archive);
+        archive.field(flashCommands.cycle);
+        archive.field(flashCommands.id);
+        if(archive.restoring) {
+            mapPages();
+        }
+    }
+
+    // Put handler over the pages holding size bytes from address, or put
+    // back memory if handler is nullptr
+    void mapHandler(uint16_t address, uint32_t size, MemoryHandler *handler)
+    {
+        for(uint32_t page = address >> PageBits; page <= ((address + size - 1) >> PageBits); page++) {
+            handlers[page] = handler;
+            mapPage(page);
+        }
+    }
+
+    // Write program over what's there, flash in bank
+    void load(const ProgramFile& program, uint32_t bank)
+    {
+        program.forEach(bank, [this](uint32_t offset, uint8_t data) {
+            if(offset >= FlashSize) {
+                RAM[offset - FlashSize] = data;
+            } else {
+                flash.write(offset, data);
+            }
+        });
+        mapPages();
+    }
+
+    void setBank(uint8_t bank_)
+    {
+        assert(bank_ < 16);
+        bank = bank_;
+        for(uint32_t page = 0; page < Pages / 2; page++) {
+            mapPage(page);
+        }
+    }
+
+    bool read(uint16_t address, uint8_t& data)
+    {
+        const Page& page = pages[address >> PageBits];
+        if(page.read) {
+            data = page.read[address & (PageSize - 1)];
+            return true;
+        }
+        return page.handler->read(*this, address, data);
+    }
+
+    // Returns whether memory changed, setting writtenFirst and writtenLast
+    bool write(uint16_t address, uint8_t data)
+    {
+        const Page& page = pages[address >> PageBits];
+        if(page.write) {
+            page.write[address & (PageSize - 1)] = data;
+            writtenFirst = writtenLast = page.offset | (address & (PageSize - 1));
+            // Reads are every fetch too, so only writes are traced here
+            Trace(TraceMemory, TraceRAMWrite, traceName, address, data);
+            return true;
+        }
+        return page.handler->write(*this, address, data);
+    }
+};
+
+inline bool FlashCommands::read(Memory& memory, uint16_t address, uint8_t& data)
+{
+    data = (address & 1) ? DeviceID : ManufacturerID;
+    return true;
+}
+
+inline bool FlashCommands::write(Memory& memory, uint16_t address, uint8_t data)
+{
+    uint32_t offset = (memory.bank << 15) | (address & 0x7FFF);
+    // only A14-A0 of command addresses count
+    uint16_t command = address & 0x7FFF;
+    int step = cycle;
+    cycle = 0;
+    switch(step) {
+        case 0: case 3:
+            if((command == Unlock1) && (data == 0xAA)) {
+                cycle = step + 1;
+            } else if((step == 0) && (data == 0xF0)) {
+                // the one-write form of ID exit
+                return setID(memory, false);
+            }
+            return false;
+        case 1: case 4:
+            if((command == Unlock2) && (data == 0x55)) {
+                cycle = step + 1;
+            }
+            return false;
+        case 2:
+            if(command == Unlock1) {
+                switch(data) {
+                    case 0xA0: cycle = 6; break;
+                    case 0x80: cycle = 3; break;
+                    case 0x90: return setID(memory, true);
+                    case 0xF0: return setID(memory, false);
+                }
+            }
+            return false;
+        case 5:
+            if(data == 0x30) {
+                memory.writtenFirst = offset & ~(SectorSize - 1);
+                memory.writtenLast = memory.writtenFirst + SectorSize - 1;
+            } else if((command == Unlock1) && (data == 0x10)) {
+                memory.writtenFirst = 0;
+                memory.writtenLast = FlashSize - 1;
+            } else {
+                return false;
+            }
+            memory.flash.fill(memory.writtenFirst, memory.writtenLast, 0xFF);
+            memory.mapFlashPages(memory.writtenFirst, memory.writtenLast);
+            Trace(TraceMemory, TraceFlashErase, memory.traceName, memory.writtenFirst, memory.writtenLast);
+            return true;
+        default:
+            // programming can only clear bits
+            memory.flash.write(offset, memory.flash[offset] & data);
+            memory.mapFlashPages(offset, offset);
+            memory.writtenFirst = memory.writtenLast = offset;
+            Trace(TraceMemory, TraceFlashWrite, memory.traceName, offset, memory.flash[offset]);
+            return true;
+    }
+}
+
+// Entering or leaving ID mode changes what all of flash reads as
+inline bool FlashCommands::setID(Memory& memory, bool id_)
+{
+    if(id == id_) {
+        return false;
+    }
+    id = id_;
+    memory.mapPages();
+    memory.writtenFirst = 0;
+    memory.writtenLast = FlashSize - 1;
+    return true;
+}
+
+// Bytes passed from one thread to one other without locks.  Only the
+// producer moves tail and only the consumer moves head, each on a cache
+// line of its own.
+template <size_t SIZE>
+struct ByteRing
+{
+    static_assert((SIZE & (SIZE - 1)) == 0, "ring size is a power of two");
+
+    alignas(64) std::atomic<size_t> head {0};
+    alignas(64) std::atomic<size_t> tail {0};
+    alignas(64) std::array<uint8_t, SIZE> bytes;
+
+    // Producer: add what fits of size bytes, returning how many did
+    size_t push(const uint8_t *data, size_t size)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size = std::min(size, SIZE - (t - head.load(std::memory_order_acquire)));
+        for(size_t i = 0; i < size; i++) {
+            bytes[(t + i) & (SIZE - 1)] = data[i];
+        }
+        tail.store(t + size, std::memory_order_release);
+        return size;
+    }
+
+    bool push(uint8_t byte)
+    {
+        return push(&byte, 1) == 1;
+    }
+
+    // Consumer: take up to size bytes, returning how many there were
+    size_t pop(uint8_t *data, size_t size)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        size = std::min(size, tail.load(std::memory_order_acquire) - h);
+        for(size_t i = 0; i < size; i++) {
+            data[i] = bytes[(h + i) & (SIZE - 1)];
+        }
+        head.store(h + size, std::memory_order_release);
+        return size;
+    }
+
+    bool pop(uint8_t& byte)
+    {
+        return pop(&byte, 1) == 1;
+    }
+
+    // Producer: bytes there's room for
+    size_t room() const
+    {
+        return SIZE - (tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire));
+    }
+
+    // Consumer: whether there's nothing to take
+    bool empty() const
+    {
+        return tail.load(std::memory_order_acquire) == head.load(std::memory_order_relaxed);
+    }
+};
+
+// The UART's connection to the host: stdin and stdout, a pty, or one client
+// at a time on a Unix socket.  A thread of its own does the host's I/O,
+// writing whatever the machine sent since it last looked in one go, and
+// trades bytes with the emulator through lock-free rings, so a slow
+// terminal or pipe never holds up emulation.
+struct UARTBridge
+{
+    static constexpr size_t RingSize = 64 * 1024;
+    ByteRing<RingSize> received;
+    ByteRing<RingSize> transmitted;
+    // what the machine sent while transmitted was full, in order; only the
+    // emulator's thread touches it
+    std::vector<uint8_t> spill;
+
+    int inputFd = -1;
+    int outputFd = -1;
+    // the socket clients connect to, or -1
+    int listener = -1;
+    // whether to close inputFd and outputFd when done with them
+    bool ownsFds = false;
+    bool pty = false;
+    // the pty or socket to connect to, for telling the user
+    std::string name;
+    std::atomic<bool> stopping {false};
+    std::thread thread;
+    // signalled when input arrives, for an emulator with nothing else to do
+    std::mutex arrivalMutex;
+    std::condition_variable arrival;
+
+    UARTBridge() = default;
+    UARTBridge(const UARTBridge&) = delete;
+    UARTBridge& operator=(const UARTBridge&) = delete;
+
+    ~UARTBridge()
+    {
+        if(thread.joinable()) {
+            stopping.store(true, std::memory_order_release);
+            thread.join();
+        }
+#if EMU_UART_BRIDGE
+        // the thread has gone, so what it didn't get to is written here
+        uint8_t buffer[4096];
+        size_t count;
+        while((count = transmitted.pop(buffer, sizeof(buffer))) > 0) {
+            writeAll(buffer, count);
+        }
+        writeAll(spill.data(), spill.size());
+        closeClient();
+        if(listener >= 0) {
+            close(listener);
+            unlink(name.c_str());
+        }
+#endif
+    }
+
+    // Emulator side: a byte from the host, if one has come
+    bool receive(uint8_t& data)
+    {
+        return received.pop(data);
+    }
+
+    // Emulator side: send a byte to the host, never waiting
+    void transmit(uint8_t data)
+    {
+        flushSpill();
+        if(!spill.empty() || !transmitted.push(data)) {
+            spill.push_back(data);
+        }
+    }
+
+    void flushSpill()
+    {
+        if(!spill.empty()) {
+            spill.erase(spill.begin(), spill.begin() + transmitted.push(spill.data(), spill.size()));
+        }
+    }
+
+    // Emulator side: wait up to timeout for input, while the machine has
+    // nothing to do but poll for it
+    void waitForInput(std::chrono::microseconds timeout)
+    {
+        flushSpill();
+        std::unique_lock<std::mutex> lock(arrivalMutex);
+        arrival.wait_for(lock, timeout, [this]() { return !received.empty(); });
+    }
+
+#if EMU_UART_BRIDGE
+    // Bridge to "stdio", "pty" or "unix:PATH"
+    static std::unique_ptr<UARTBridge> Open(const std::string& spec)
+    {
+        auto bridge = std::make_unique<UARTBridge>();
+        if(spec == "stdio") {
+            bridge->inputFd = STDIN_FILENO;
+            bridge->outputFd = STDOUT_FILENO;
+            bridge->name = "stdin and stdout";
+        } else if(spec == "pty") {
+            int master = posix_openpt(O_RDWR | O_NOCTTY);
+            if((master < 0) || (grantpt(master) != 0) || (unlockpt(master) != 0) || !ptsname(master)) {
+                if(master >= 0) {
+                    close(master);
+                }
+                throw std::string("couldn't make a pty: ") + strerror(errno);
+            }
+            bridge->inputFd = bridge->outputFd = master;
+            bridge->ownsFds = true;
+            bridge->pty = true;
+            bridge->name = ptsname(master);
+        } else if(spec.compare(0, 5, "unix:") == 0) {
+            bridge->name = spec.substr(5);
+            sockaddr_un address {};
+            address.sun_family = AF_UNIX;
+            if(bridge->name.empty() || (bridge->name.size() >= sizeof(address.sun_path))) {
+                throw "bad socket path " + bridge->name;
+            }
+            strcpy(address.sun_path, bridge->name.c_str());
+            unlink(bridge->name.c_str());
+            bridge->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+            if((bridge->listener < 0) || (bind(bridge->listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) || (listen(bridge->listener, 1) != 0)) {
+                throw "couldn't listen on " + bridge->name + ": " + strerror(errno);
+            }
+        } else {
+            throw "unknown UART \"" + spec + "\"";
+        }
+        bridge->start();
+        return bridge;
+    }
+
+    // Bridge to file descriptors the caller keeps, as for tests
+    static std::unique_ptr<UARTBridge> Open(int inputFd, int outputFd)
+    {
+        auto bridge = std::make_unique<UARTBridge>();
+        bridge->inputFd = inputFd;
+        bridge->outputFd = outputFd;
+        bridge->start();
+        return bridge;
+    }
+
+    void start()
+    {
+        thread = std::thread([this]() { run(); });
+    }
+
+    bool writeAll(const uint8_t *data, size_t size)
+    {
+        while((size > 0) && (outputFd >= 0)) {
+            ssize_t n = write(outputFd, data, size);
+            if((n < 0) && (errno == EINTR)) {
+                continue;
+            }
+            if(n <= 0) {
+                return false;
+            }
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    void closeClient()
+    {
+        if(ownsFds) {
+            if(inputFd >= 0) {
+                close(inputFd);
+            }
+            if((outputFd >= 0) && (outputFd != inputFd)) {
+                close(outputFd);
+            }
+        }
+        inputFd = outputFd = -1;
+    }
+
+    // Host side, on the bridge's own thread
+    void run()
+    {
+        std::vector<uint8_t> buffer(RingSize);
+        while(true) {
+            // Check for stopping first, so the output check after it can't
+            // miss anything sent before the emulator stopped us
+            bool stop = stopping.load(std::memory_order_acquire);
+            size_t count = transmitted.pop(buffer.data(), buffer.size());
+            if((count > 0) && !writeAll(buffer.data(), count) && (listener >= 0)) {
+                // the client went away; wait for another
+                closeClient();
+            }
+            if(stop) {
+                return;
+            }
+
+            // Only read what there's room for, so a host typing ahead of
+            // the machine waits in the host's buffers rather than ours
+            pollfd fd {-1, POLLIN, 0};
+            if((inputFd < 0) && (listener >= 0)) {
+                fd.fd = listener;
+            } else if(received.room() > 0) {
+                fd.fd = inputFd;
+            }
+            // output goes out within a millisecond
+            if(poll(&fd, 1, 1) <= 0) {
+                continue;
+            }
+            if(fd.fd == listener) {
+                int client = accept(listener, nullptr, nullptr);
+                if(client >= 0) {
+                    inputFd = outputFd = client;
+                    ownsFds = true;
+                }
+            } else if(fd.revents & POLLIN) {
+                ssize_t n = read(inputFd, buffer.data(), std::min(buffer.size(), received.room()));
+                if(n > 0) {
+                    received.push(buffer.data(), n);
+                    // taking the lock means a waiter either saw the bytes
+                    // or is waiting already
+                    { std::lock_guard<std::mutex> lock(arrivalMutex); }
+                    arrival.notify_one();
+                } else if((n == 0) || (errno != EINTR && errno != EAGAIN)) {
+                    endOfInput();
+                }
+            } else if(fd.revents & (POLLHUP | POLLERR | POLLNVAL)) {
+                endOfInput();
+            }
+        }
+    }
+
+    // A socket client leaving makes way for the next; a pty nobody has
+    // open yet hangs up until somebody does; stdin just ends
+    void endOfInput()
+    {
+        if(listener >= 0) {
+            closeClient();
+        } else if(pty) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        } else {
+            inputFd = -1;
+        }
+    }
+#endif
+};
+
+// How the UART's line is clocked, when Interface models it.  Bytes go out
+// and come in one frame at a time, on edges of a clock ticking once a
+// frame, and what comes in waits in a FIFO for INP.
+struct UARTTiming
+{
+    enum Overrun {
+        OverrunDrop,      // a byte coming into a full FIFO is lost
+        OverrunOverwrite, // it takes the place of the newest one
+        OverrunHold,      // the host holds it back, as flow control would
+    };
+
+    uint32_t baud = 115200;
+    int dataBits = 8;
+    char parity = 'N';
+    int stopBits = 1;
+    size_t fifoDepth = 16;
+    Overrun overrun = OverrunDrop;
+
+    // start bit, data, parity and stop bits
+    int frameBits() const
+    {
+        return 1 + dataBits + ((parity != 'N') ? 1 : 0) + stopBits;
+    }
+
+    // "BAUD[,FRAME[,FIFO[,OVERRUN]]]", like "9600,7E2,1,hold"; FRAME is
+    // data bits, parity N, E or O, and stop bits
+    static UARTTiming Parse(const std::string& spec)
+    {
+        UARTTiming timing;
+        std::vector<std::string> parts;
+        size_t start = 0;
+        while(true) {
+            size_t comma = spec.find(',', start);
+            parts.push_back(spec.substr(start, comma - start));
+            if(comma == std::string::npos) {
+                break;
+            }
+            start = comma + 1;
+        }
+        char *end = nullptr;
+        unsigned long baud = strtoul(parts[0].c_str(), &end, 10);
+        if(parts[0].empty() || (*end != '\0') || (baud == 0) || (baud > SystemClockRate) || (parts.size() > 4)) {
+            throw "bad UART timing \"" + spec + "\"";
+        }
+        timing.baud = baud;
+        if(parts.size() > 1) {
+            const std::string& frame = parts[1];
+            if((frame.size() != 3) || (frame[0] < '5') || (frame[0] > '8') || !strchr("NEO", frame[1]) || (frame[2] < '1') || (frame[2] > '2')) {
+                throw "bad UART frame \"" + frame + "\", expected like 8N1";
+            }
+            timing.dataBits = frame[0] - '0';
+            timing.parity = frame[1];
+            timing.stopBits = frame[2] - '0';
+        }
+        if(parts.size() > 2) {
+            unsigned long depth = strtoul(parts[2].c_str(), &end, 10);
+            if(parts[2].empty() || (*end != '\0') || (depth == 0) || (depth > 65536)) {
+                throw "bad UART FIFO depth \"" + parts[2] + "\"";
+            }
+            timing.fifoDepth = depth;
+        }
+        if(parts.size() > 3) {
+            if(parts[3] == "drop") {
+                timing.overrun = OverrunDrop;
+            } else if(parts[3] == "overwrite") {
+                timing.overrun = OverrunOverwrite;
+            } else if(parts[3] == "hold") {
+                timing.overrun = OverrunHold;
+            } else {
+                throw "bad UART overrun \"" + parts[3] + "\", expected drop, overwrite or hold";
+            }
+        }
+        return timing;
+    }
+};
+
+// The UART input a session got from the host, so the session can be run
+// again exactly and as fast as the host goes.  While there's a journal,
+// bytes from the host only go into Interface::inputBuffer at clocks the
+// scheduler picks, and each is logged with the clock it went in at;
+// replaying puts them in at the same clocks, which fall between the same
+// two instructions whichever engine runs the CPU.  On disk it's a header
+// and then, for each byte, the clocks since the one before as a LEB128
+// followed by the byte.  Fields are in host byte order, like snapshots.
+// Replaying throws a std::string describing what's wrong with the journal.
+struct UARTJournal
+{
+    static constexpr char Magic[8] = {'M', 'I', 'N', 'I', 'U', 'A', 'R', 'T'};
+    static constexpr uint32_t Version = 1;
+    // how often a recording looks for input from the host
+    static constexpr int RecordFrequency = 1000;
+
+    bool recording;
+    std::vector<uint8_t> data;
+    // recording: how much of data is written to fp; replaying: where the
+    // entry after next starts
+    size_t position = 0;
+    FILE *fp = nullptr;
+    clk_t last = 0;
+    // replaying: the entry due next, if there's one left
+    bool pending = false;
+    clk_t nextClock = 0;
+    uint8_t nextByte = 0;
+
+    UARTJournal(clk_t rate, uint64_t imageHash) :
+        recording(true)
+    {
+        append(Magic, sizeof(Magic));
+        append(&Version, sizeof(Version));
+        append(&rate, sizeof(rate));
+        append(&imageHash, sizeof(imageHash));
+    }
+
+    // Replay data, which must have been recorded at rate from the same
+    // flash image
+    UARTJournal(std::vector<uint8_t> data_, clk_t rate, uint64_t imageHash) :
+        recording(false),
+        data(std::move(data_))
+    {
+        uint32_t version;
+        clk_t savedRate;
+        uint64_t savedHash;
+        if((data.size() < sizeof(Magic)) || (memcmp(data.data(), Magic, sizeof(Magic)) != 0)) {
+            throw std::string("not a UART journal");
+        }
+        position = sizeof(Magic);
+        take(&version, sizeof(version));
+        if(version != Version) {
+            throw "journal is version " + std::to_string(version) + ", this emulator reads version " + std::to_string(Version);
+        }
+        take(&savedRate, sizeof(savedRate));
+        take(&savedHash, sizeof(savedHash));
+        if(savedRate != rate) {
+            throw std::string("journal was recorded at a different clock rate");
+        }
+        if(savedHash != imageHash) {
+            throw std::string("journal was recorded with a different flash image");
+        }
+        advance();
+    }
+
+    ~UARTJournal()
+    {
+        if(fp) {
+            flush();
+            fclose(fp);
+        }
+    }
+
+    static std::unique_ptr<UARTJournal> Load(const std::string& journal_file, clk_t rate, uint64_t imageHash)
+    {
+        FILE *fp = fopen(journal_file.c_str(), "rb");
+        if(!fp) {
+            throw "couldn't open " + journal_file;
+        }
+        std::vector<uint8_t> data;
+        uint8_t buffer[65536];
+        size_t size;
+        while((size = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+            data.insert(data.end(), buffer, buffer + size);
+        }
+        bool failed = ferror(fp);
+        fclose(fp);
+        if(failed) {
+            throw "couldn't read " + journal_file;
+        }
+        return std::make_unique<UARTJournal>(std::move(data), rate, imageHash);
+    }
+
+    // Write the recording to journal_file as it goes, so a session that's
+    // killed keeps what it got up to the last flush()
+    bool open(const std::string& journal_file)
+    {
+        fp = fopen(journal_file.c_str(), "wb");
+        if(!fp) {
+            return false;
+        }
+        flush();
+        return true;
+    }
+
+    void append(const void *p, size_t size)
+    {
+        data.insert(data.end(), static_cast<const uint8_t*>(p), static_cast<const uint8_t*>(p) + size);
+    }
+
+    void take(void *p, size_t size)
+    {
+        if(data.size() - position < size) {
+            throw std::string("journal is truncated");
+        }
+        memcpy(p, data.data() + position, size);
+        position += size;
+    }
+
+    void record(clk_t clock, uint8_t byte)
+    {
+        clk_t delta = clock - last;
+        while(delta >= 0x80) {
+            data.push_back((delta & 0x7F) | 0x80);
+            delta >>= 7;
+        }
+        data.push_back(delta);
+        data.push_back(byte);
+        last = clock;
+    }
+
+    void flush()
+    {
+        if(fp && (position < data.size())) {
+            fwrite(data.data() + position, 1, data.size() - position, fp);
+            fflush(fp);
+            position = data.size();
+        }
+    }
+
+    // Read the next entry, if there's one left
+    void advance()
+    {
+        pending = position < data.size();
+        if(!pending) {
+            return;
+        }
+        clk_t delta = 0;
+        uint8_t byte;
+        int shift = 0;
+        do {
+            take(&byte, 1);
+            if(shift > 63) {
+                throw std::string("journal is corrupt");
+            }
+            delta |= clk_t(byte & 0x7F) << shift;
+            shift += 7;
+        } while(byte & 0x80);
+        take(&nextByte, 1);
+        nextClock = last + delta;
+        last = nextClock;
+    }
+
+    // Replayed to the end, after which input comes from the host as usual
+    bool finished() const
+    {
+        return !recording && !pending;
+    }
+};
+
+struct Interface
+{
+    bool succeeded = false;
+    Clock mostRecentSystemClock;
+    std::queue<uint8_t> inputBuffer;
+    uint16_t traceName = InternWireName("UART");
+    // where UART output is collected instead of going to stdout, if set
+    std::vector<uint8_t> *capture = nullptr;
+    // the host's end of the UART, if there is one; input queued in
+    // inputBuffer still comes first
+    UARTBridge *bridge = nullptr;
+    // input from the host being recorded or replayed, if any; see
+    // UARTJournal
+    UARTJournal *journal = nullptr;
+
+    // Unless timed is set, bytes go to and from the host the moment the
+    // machine sends or asks for them.  Set it with setTiming().
+    bool timed = false;
+    UARTTiming timing;
+    clk_t frameClocks = 0;
+    // Nothing tells firmware the transmitter is busy, so what it sends
+    // faster than the line goes queues up rather than being lost
+    std::queue<uint8_t> transmitQueue;
+    bool transmitting = false;
+    uint8_t transmitShift = 0;
+    std::queue<uint8_t> receiveFIFO;
+    bool receiving = false;
+    uint8_t receiveShift = 0;
+    // bytes that made it across the line each way, and bytes lost
+    uint64_t bytesSent = 0;
+    uint64_t bytesReceived = 0;
+    uint64_t overruns = 0;
+    size_t mostQueued = 0;
+
+    void setTiming(const UARTTiming& timing_, clk_t rate)
+    {
+        timed = true;
+        timing = timing_;
+        frameClocks = std::max<clk_t>(1, (rate * timing.frameBits() + timing.baud / 2) / timing.baud);
+    }
+
+    // The host's end of the line
+    void send(uint8_t data)
+    {
+        if(capture) {
+            capture->push_back(data);
+        } else if(bridge) {
+            bridge->transmit(data);
+        } else {
+            putchar(data);
+        }
+    }
+
+    bool receive(uint8_t& data)
+    {
+        if(!inputBuffer.empty()) {
+            data = inputBuffer.front();
+            inputBuffer.pop();
+            return true;
+        }
+        return hostInput() && bridge->receive(data);
+    }
+
+    // Whether input comes straight from the host, rather than by way of
+    // the journal
+    bool hostInput() const
+    {
+        return bridge && (!journal || journal->finished());
+    }
+
+    // Put what came from the host into inputBuffer, or what the journal
+    // says came by now
+    void journalInput(clk_t clock)
+    {
+        if(journal->recording) {
+            uint8_t data;
+            while(bridge && bridge->receive(data)) {
+                inputBuffer.push(data);
+                journal->record(clock, data);
+            }
+            journal->flush();
+        } else {
+            while(journal->pending && (journal->nextClock <= clock)) {
+                inputBuffer.push(journal->nextByte);
+                journal->advance();
+            }
+        }
+    }
+
+    // UART transmit, from OUT
+    void writeUART(uint8_t data)
+    {
+        Trace(TraceUART, TraceUARTWrite, traceName, 0, data);
+        if(timed) {
+            transmitQueue.push(data & ((1 << timing.dataBits) - 1));
+            mostQueued = std::max(mostQueued, transmitQueue.size());
+        } else {
+            send(data);
+        }
+    }
+
+    // UART receive, from INP; leaves data alone if nothing is waiting
+    bool readUART(uint8_t& data)
+    {
+        bool received;
+        if(timed) {
+            received = !receiveFIFO.empty();
+            if(received) {
+                data = receiveFIFO.front();
+                receiveFIFO.pop();
+            }
+        } else {
+            received = receive(data);
+        }
+        if(!received) {
+            Trace(TraceUART, TraceUARTReadEmpty, traceName);
+            return false;
+        }
+        Trace(TraceUART, TraceUARTRead, traceName, 0, data);
+        return true;
+    }
+
+    // One tick of the frame clock: a frame ends and the next starts, each way
+    void frameEdge()
+    {
+        if(transmitting) {
+            send(transmitShift);
+            bytesSent++;
+            transmitting = false;
+        }
+        if(!transmitQueue.empty()) {
+            transmitShift = transmitQueue.front();
+            transmitQueue.pop();
+            transmitting = true;
+        }
+        if(receiving) {
+            receiving = false;
+            if(receiveFIFO.size() < timing.fifoDepth) {
+                receiveFIFO.push(receiveShift);
+                bytesReceived++;
+            } else {
+                overruns++;
+                Trace(TraceUART, TraceUARTOverrun, traceName, 0, (timing.overrun == UARTTiming::OverrunOverwrite) ? receiveFIFO.back() : receiveShift);
+                if(timing.overrun == UARTTiming::OverrunOverwrite) {
+                    receiveFIFO.back() = receiveShift;
+                }
+            }
+        }
+        bool held = (timing.overrun == UARTTiming::OverrunHold) && (receiveFIFO.size() >= timing.fifoDepth);
+        if(!held && receive(receiveShift)) {
+            receiveShift &= (1 << timing.dataBits) - 1;
+            receiving = true;
+        }
+    }
+
+    // Nothing on the line either way, or waiting to go on it
+    bool quiet() const
+    {
+        return !transmitting && transmitQueue.empty() && !receiving && inputBuffer.empty() && (!hostInput() || bridge->received.empty());
+    }
+
+    bool attemptIterate()
+    {
+        return true;
+    }
+
+    // Give the host's core a rest for up to timeout, or until input the
+    // machine is waiting for comes
+    void waitForInput(std::chrono::microseconds timeout)
+    {
+        // a replay runs flat out, then waits on the host like anything else
+        if(journal && !journal->recording && !journal->finished()) {
+            return;
+        }
+        if(inputBuffer.empty() && bridge) {
+            bridge->waitForInput(timeout);
+        }
+    }
+
+    Interface(const Clock& systemClock) :
+        mostRecentSystemClock(systemClock)
+    {
+        succeeded = true;
+    }
+
+    clk_t calculateNextActivity()
+    {
+        clk_t next;
+        if(timed) {
+            // OUT could start a frame on any edge, so they come even when
+            // the line is quiet
+            next = nextFrameEdge();
+        } else {
+            // clk_t next = (mostRecentSystemClock.clocks + audioOutputSampleLengthInSystemClocks - 1) / audioOutputSampleLengthInSystemClocks * audioOutputSampleLengthInSystemClocks;
+            next = mostRecentSystemClock.clocks + 10000000;
+        }
+        if(journal && journal->recording) {
+            next = std::min(next, mostRecentSystemClock.clocks + std::max<clk_t>(1, mostRecentSystemClock.rate / UARTJournal::RecordFrequency));
+        } else if(journal && journal->pending) {
+            next = std::min(next, std::max(journal->nextClock, mostRecentSystemClock.clocks + 1));
+        }
+        // XXX debug printf("interface next is %llu\n", next);
+        return next;
+    }
+
+    // The first frame clock edge after the last look
+    clk_t nextFrameEdge() const
+    {
+        return (mostRecentSystemClock.clocks / frameClocks + 1) * frameClocks;
+    }
+
+// Do not repeat work if called twice with same clock.
+
+    void updatePastClock(const Clock& systemClock)
+    {
+        // before the line, which may take it straight away
+        if(journal) {
+            journalInput(systemClock.clocks);
+        }
+        if(timed) {
+            // every frame clock edge since the last look, though once the
+            // line is quiet the rest change nothing
+            for(clk_t edge = nextFrameEdge(); (edge <= systemClock.clocks) && !quiet(); edge += frameClocks) {
+                frameEdge();
+            }
+        }
+        mostRecentSystemClock = systemClock;
+    }
+
+    // The timing itself is the caller's, like the CPU's engine; what's on
+    // the line is the machine's
+    void snapshot(SnapshotArchive& archive)
+    {
+        archive.field(mostRecentSystemClock);
+        archive.field(inputBuffer);
+        archive.field(transmitQueue);
+        archive.field(transmitting);
+        archive.field(transmitShift);
+        archive.field(receiveFIFO);
+        archive.field(receiving);
+        archive.field(receiveShift);
+    }
+};
+
+inline std::vector<std::string> InstructionToMnemonic =
+{
+    "NOP",
+    "BNK",
+    "OUT",
+    "CLC",
+    "SEC",
+    "LSL",
+    "ROL",
+    "LSR",
+    "ROR",
+    "ASR",
+    "INP",
+    "NEG",
+    "Inc",
+    "Dec",
+    "LDI",
+    "ADI",
+    "SBI",
+    "CPI",
+    "ACI",
+    "SCI",
+    "JPA",
+    "LDA",
+    "STA",
+    "ADA",
+    "SBA",
+    "CPA",
+    "ACA",
+    "SCA",
+    "JPR",
+    "LDR",
+    "STR",
+    "ADR",
+    "SBR",
+    "CPR",
+    "ACR",
+    "SCR",
+    "CLB",
+    "NEB",
+    "INB",
+    "DEB",
+    "ADB",
+    "SBB",
+    "ACB",
+    "SCB",
+    "CLW",
+    "NEW",
+    "INW",
+    "DEW",
+    "ADW",
+    "SBW",
+    "ACW",
+    "SCW",
+    "LDS",
+    "STS",
+    "PHS",
+    "PLS",
+    "JPS",
+    "RTS",
+    "BNE",
+    "BEQ",
+    "BCC",
+    "BCS",
+    "BPL",
+    "BMI",
+};
+
+// Save or restore everything an instruction-level machine needs to carry on
+// where it was.  cpu's engine and what it has enabled are up to the caller;
+// any engine built on MinimalEmulator restores any other's snapshot.
+template <class CPU, class MEMORY, class INTERFACE>
+void SnapshotMachine(SnapshotArchive& archive, CPU& cpu, MEMORY& memory, INTERFACE& interface, Clock& systemClock)
+{
+    archive.header(SnapshotArchive::InstructionLevel);
+    archive.field(systemClock);
+    memory.snapshot(archive);
+    interface.snapshot(archive);
+    cpu.snapshot(archive, memory);
+    archive.trailer();
+}
+
+// Put program into memory between batches, when the CPU is between
+// instructions, and start it at start if asked
+template <class CPU>
+void LoadProgram(CPU& cpu, Memory& memory, const ProgramFile& program, uint32_t bank, bool setPC = false, uint16_t start = 0)
+{
+    memory.load(program, bank);
+    cpu.forgetCode(memory);
+    if(setPC) {
+        cpu.PC = start;
+    }
+}
+
+// Run the CPU and interface until systemClock reaches stopClock; false if
+// the CPU stopped first
+template <class CPU>
+bool RunUntil(CPU& cpu, Memory& memory, Interface& interface, Clock& systemClock, clk_t stopClock)
+{
+    while(systemClock.clocks < stopClock) {
+        uint64_t nextCPU = cpu.calculateNextActivity();
+        uint64_t nextInterface = interface.calculateNextActivity();
+        // XXX debug printf("cpu : %llu, interface: %llu\n", nextCPU, nextInterface);
+        if(nextCPU < nextInterface) {
+            // XXX debug printf("do cpu\n");
+            // Run the CPU in one batch up to the next thing it could interact with
+            Clock until(systemClock, std::min(nextInterface, stopClock) - 1);
+            typename CPU::StepResult result = cpu.updatePastClock(memory, interface, until);
+            if(result != CPU::CONTINUE) {
+                return false;
+            }
+            systemClock.clocks = until.clocks + 1;
+        } else {
+            // XXX debug printf("do interface\n");
+            interface.updatePastClock(systemClock);
+            systemClock.clocks = nextInterface;
+        }
+    }
+    return true;
+}
+
+// Clocks the CPU skipped through polling loops; only MinimalEmulator looks
+// for them
+template <class CPU>
+clk_t IdleClocks(const CPU& cpu)
+{
+    return 0;
+}
+
+template <class MEMORY, class INTERFACE>
+clk_t IdleClocks(const MinimalEmulator<MEMORY, INTERFACE>& cpu)
+{
+    return cpu.idleClocks;
+}
+
+// Run until the interface is done or, if given, systemClock reaches stopClock
+template <class CPU>
+void RunEmulator(CPU& cpu, Memory& memory, Interface& interface, Clock& systemClock, clk_t stopClock = std::numeric_limits<clk_t>::max())
+{
+    std::chrono::time_point<std::chrono::system_clock> interfaceThen = std::chrono::system_clock::now();
+
+    printf("Power up.\n");
+    // before anything the UART sends by way of a bridge
+    fflush(stdout);
+    bool done = false;
+    while(!done && (systemClock.clocks < stopClock)) {
+
+        uint64_t newClock = std::min(stopClock, systemClock.clocks + systemClock.rate / 240); // XXX I dunno, 4 chunks of a 60Hz tick???
+        uint64_t chunk = newClock - systemClock.clocks;
+        clk_t idleBefore = IdleClocks(cpu);
+        if(!RunUntil(cpu, memory, interface, systemClock, newClock)) {
+            // XXX debug printf("exit on unsupported instruction\n");
+            exit(EXIT_SUCCESS);
+        }
+        // Mostly spent waiting for input, so wait for it in real time
+        // rather than racing on through emulated time
+        if(IdleClocks(cpu) - idleBefore > chunk / 2) {
+            interface.waitForInput(std::chrono::microseconds(chunk * 1000000 / systemClock.rate));
+        }
+
+        std::chrono::time_point<std::chrono::system_clock> interfaceNow = std::chrono::system_clock::now();
+        auto elapsed = std::chrono::duration_cast<std::chrono::duration<float>>(interfaceNow - interfaceThen);
+        float dt = elapsed.count();
+        if(dt > (.9f * 1.0f / UIUpdateFrequency)) {
+            done = !interface.attemptIterate();
+            interfaceThen = interfaceNow;
+        }
+    }
+}
+
+#endif // MINIMAL_H